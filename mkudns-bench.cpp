@@ -0,0 +1,294 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mkudns.h"
+
+#define MKDATA_INLINE_IMPL
+#include "mkdata.hpp"
+
+#include "mkudns-responder.h"
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+// LCOV_EXCL_START
+static void usage() {
+  // clang-format off
+  std::clog << "\n";
+  std::clog << "Usage: mkudns-bench [options] <domain>\n";
+  std::clog << "\n";
+  std::clog << "Performs the same queries using each engine backend and prints\n";
+  std::clog << "how long it took. Unless you specify a name server, we query a\n";
+  std::clog << "local responder that answers every A query with 127.0.0.1.\n";
+  std::clog << "\n";
+  std::clog << "Options can start with either a single dash (i.e. -option) or\n";
+  std::clog << "a double dash (i.e. --option). Available options:\n";
+  std::clog << "\n";
+  std::clog << "  --adaptive : adapt the queries in flight per server to the loss\n";
+  std::clog << "  --backends <name,...> : backends to compare (default: io_uring,epoll)\n";
+  std::clog << "  --batch <n> : queries per engine run (default: 512)\n";
+  std::clog << "  --count <n> : queries per backend (default: 10000)\n";
+  std::clog << "  --delay <ms> : the local responder answers after ms (default: 0)\n";
+  std::clog << "  --max-qps <n> : send at most n queries per second\n";
+  std::clog << "  --producers <n> : post the queries from n threads and reap them\n";
+  std::clog << "  --server-address <ip> : name server address\n";
+  std::clog << "  --server-max-inflight <n> : at most n queries in flight per server\n";
+  std::clog << "  --server-max-qps <n> : send at most n queries per second per server\n";
+  std::clog << "  --server-port <port> : name server port\n";
+  std::clog << "  --shards <n> : use a sharded engine (0 means one per core)\n";
+  std::clog << "  --timeout <ms> : query timeout (default: 3000)\n";
+  std::clog << "  --workers <n> : parse responses in a pool (0: one per core)\n";
+  std::clog << std::endl;
+  // clang-format on
+}
+// LCOV_EXCL_STOP
+
+// has_scheduler_delay returns whether a send event of @p response tells how
+// long the query waited in the engine before we sent it.
+static bool has_scheduler_delay(const mkudns_response_t *response) {
+  size_t count = mkudns_response_get_events_size(response);
+  for (size_t idx = 0; idx < count; ++idx) {
+    std::string event = mkudns_response_get_event_at(response, idx);
+    if (event.find("\"mkudns.send\"") != std::string::npos &&
+        event.find("\"scheduler_delay\"") != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// max_window returns the largest window that an engine adapting the queries
+// in flight reaches after @p count responses, since it starts from ten
+// queries and grows by one query per window of responses.
+static size_t max_window(int64_t count) {
+  size_t window = 10;
+  for (int64_t acked = count; acked >= static_cast<int64_t>(window);) {
+    acked -= static_cast<int64_t>(window);
+    window += 1;
+  }
+  return window;
+}
+
+int main(int, char **argv) {
+  mkudns_query_uptr query{mkudns_query_new_nonnull()};
+  bool adaptive = false;
+  std::vector<std::string> backends{"io_uring", "epoll"};
+  int64_t batch = 512;
+  int64_t count = 10000;
+  int64_t delay = 0;
+  int64_t max_qps = 0;
+  int64_t producers = 0;
+  int64_t server_max_inflight = 0;
+  int64_t server_max_qps = 0;
+  int64_t shards = -1;
+  int64_t workers = -1;
+  bool local = true;
+  {
+    argh::parser cmdline;
+    cmdline.add_param("backends");
+    cmdline.add_param("batch");
+    cmdline.add_param("count");
+    cmdline.add_param("delay");
+    cmdline.add_param("max-qps");
+    cmdline.add_param("producers");
+    cmdline.add_param("server-address");
+    cmdline.add_param("server-max-inflight");
+    cmdline.add_param("server-max-qps");
+    cmdline.add_param("server-port");
+    cmdline.add_param("shards");
+    cmdline.add_param("timeout");
+    cmdline.add_param("workers");
+    cmdline.parse(argv);
+    for (auto &flag : cmdline.flags()) {
+      if (flag == "adaptive") {
+        adaptive = true;
+      } else {
+        std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (auto &param : cmdline.params()) {
+      if (param.first == "backends") {
+        backends.clear();
+        std::stringstream ss{param.second};
+        std::string backend;
+        while (std::getline(ss, backend, ',')) backends.push_back(backend);
+      } else if (param.first == "batch") {
+        batch = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "count") {
+        count = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "delay") {
+        delay = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "max-qps") {
+        max_qps = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "producers") {
+        producers = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "server-address") {
+        mkudns_query_set_server_address(query.get(), param.second.c_str());
+        local = false;
+      } else if (param.first == "server-max-inflight") {
+        server_max_inflight = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "server-max-qps") {
+        server_max_qps = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "server-port") {
+        mkudns_query_set_server_port(query.get(), param.second.c_str());
+      } else if (param.first == "shards") {
+        shards = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "timeout") {
+        mkudns_query_set_timeout(
+            query.get(), strtoll(param.second.c_str(), nullptr, 10));
+      } else if (param.first == "workers") {
+        workers = strtoll(param.second.c_str(), nullptr, 10);
+      } else {
+        std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    auto sz = cmdline.pos_args().size();
+    if (sz != 2 || batch <= 0 || count <= 0 || delay < 0 || max_qps < 0 ||
+        producers < 0 || server_max_inflight < 0 || server_max_qps < 0) {
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    mkudns_query_set_name(query.get(), cmdline.pos_args()[1].c_str());
+  }
+  responder r;
+  r.delay = std::chrono::milliseconds{delay};
+  if (local) {
+    if (!responder_start(&r)) {
+      std::clog << "FATAL: cannot start the local responder" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    mkudns_query_set_server_address(query.get(), "127.0.0.1");
+    mkudns_query_set_server_port(query.get(), r.port.c_str());
+  }
+  bool good = true;
+  for (auto &backend : backends) {
+    mkudns_engine_uptr engine{
+        (shards >= 0)
+            ? mkudns_engine_new_sharded_nonnull(
+                  backend.c_str(), static_cast<size_t>(shards))
+            : mkudns_engine_new_nonnull(backend.c_str())};
+    if (workers >= 0) {
+      mkudns_engine_set_workers(engine.get(), static_cast<size_t>(workers));
+    }
+    mkudns_engine_set_max_qps(engine.get(), max_qps);
+    mkudns_engine_set_server_max_qps(engine.get(), server_max_qps);
+    mkudns_engine_set_server_max_inflight(
+        engine.get(), static_cast<size_t>(server_max_inflight));
+    if (adaptive) mkudns_engine_set_adaptive_inflight(engine.get());
+    int64_t answered = 0;
+    int64_t unpaced = 0;
+    r.peak = 0;
+    auto begin = std::chrono::steady_clock::now();
+    if (producers > 0) {
+      std::vector<std::thread> threads;
+      for (int64_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p]() {
+          for (int64_t i = p; i < count; i += producers) {
+            mkudns_engine_post(
+                engine.get(), query.get(), static_cast<uint64_t>(i));
+          }
+        });
+      }
+      std::vector<mkudns_completion_t> completions(
+          static_cast<size_t>(batch));
+      for (int64_t reaped = 0; reaped < count;) {
+        size_t n = mkudns_engine_reap(
+            engine.get(), completions.data(), completions.size());
+        for (size_t i = 0; i < n; ++i) {
+          answered += mkudns_response_good(completions[i].response);
+          unpaced += mkudns_response_good(completions[i].response) &&
+                     !has_scheduler_delay(completions[i].response);
+          mkudns_response_delete(completions[i].response);
+        }
+        reaped += static_cast<int64_t>(n);
+      }
+      for (auto &thread : threads) thread.join();
+    }
+    for (int64_t done = 0; producers <= 0 && done < count; done += batch) {
+      for (int64_t i = done; i < count && i < done + batch; ++i) {
+        mkudns_engine_submit(engine.get(), query.get());
+      }
+      mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+      size_t total = mkudns_responses_get_size(responses.get());
+      for (size_t i = 0; i < total; ++i) {
+        const mkudns_response_t *response =
+            mkudns_responses_get_at(responses.get(), i);
+        answered += mkudns_response_good(response);
+        unpaced += mkudns_response_good(response) &&
+                   !has_scheduler_delay(response);
+      }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    std::clog << backend << " (using "
+              << mkudns_engine_get_backend(engine.get()) << ", "
+              << mkudns_engine_get_shards(engine.get()) << " shards): "
+              << count << " queries, " << answered << " good, "
+              << (elapsed / 1000) << " ms, "
+              << ((elapsed > 0) ? (count * 1000000) / elapsed : 0)
+              << " queries/s";
+    if (local && delay > 0) std::clog << ", " << r.peak << " held at most";
+    std::clog << std::endl;
+    good = good && answered > 0;
+    if (unpaced > 0) {
+      std::clog << backend << ": " << unpaced
+                << " good responses lack the scheduler_delay" << std::endl;
+      good = false;
+    }
+    // The engine may send the 10 ms worth of queries in its bucket at once,
+    // and each shard has its own bucket.
+    int64_t rate = (max_qps > 0 && (server_max_qps <= 0 ||
+                                    max_qps < server_max_qps))
+                       ? max_qps
+                       : server_max_qps;
+    int64_t burst = rate / 100 + static_cast<int64_t>(std::max<size_t>(
+                                     mkudns_engine_get_shards(engine.get()),
+                                     1));
+    if (rate > 0 && count > burst &&
+        elapsed < (count - burst) * 1000000 / rate) {
+      std::clog << backend << ": " << count << " queries in "
+                << (elapsed / 1000) << " ms exceed " << rate << " queries/s"
+                << std::endl;
+      good = false;
+    }
+    // The responder only observes the queries in flight when it holds them.
+    size_t limit = static_cast<size_t>(server_max_inflight);
+    if (adaptive) {
+      size_t window = max_window(count) * std::max<size_t>(
+          mkudns_engine_get_shards(engine.get()), 1);
+      limit = (limit > 0) ? std::min(limit, window) : window;
+    }
+    if (local && delay > 0 && limit > 0 && r.peak > limit) {
+      std::clog << backend << ": " << r.peak << " queries in flight exceed "
+                << limit << std::endl;
+      good = false;
+    }
+    if (local && delay > 0 && adaptive && server_max_inflight <= 0 &&
+        r.peak <= 10) {
+      std::clog << backend << ": the adaptive window did not grow beyond "
+                << r.peak << " queries in flight" << std::endl;
+      good = false;
+    }
+  }
+  if (local) responder_stop(&r);
+  if (!good) {
+    std::clog << "FATAL: some backends did not succeed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
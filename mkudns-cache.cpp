@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// We need the cache shards and the response messages, which are private.
+#define MKDATA_INLINE_IMPL
+#define MKUDNS_INLINE_IMPL
+#include "mkudns.h"
+
+#include "mkudns-responder.h"
+
+// check prints @p what and returns @p ok.
+static bool check(const char *what, bool ok) {
+  std::clog << (ok ? "PASS" : "FAIL") << ": " << what << std::endl;
+  return ok;
+}
+
+// cache_query returns a cached query for @p name to the responder @p r.
+static mkudns_query_uptr cache_query(
+    const responder &r, const std::string &name) {
+  mkudns_query_uptr query{mkudns_query_new_nonnull()};
+  mkudns_query_set_name(query.get(), name.c_str());
+  mkudns_query_set_server_address(query.get(), "127.0.0.1");
+  mkudns_query_set_server_port(query.get(), r.port.c_str());
+  mkudns_query_set_timeout(query.get(), 2000);
+  mkudns_query_set_cache(query.get());
+  return query;
+}
+
+// resolve performs @p query and returns the response.
+static mkudns_response_uptr resolve(const mkudns_query_uptr &query) {
+  return mkudns_response_uptr{mkudns_query_perform_nonnull(query.get())};
+}
+
+// cache_hits returns the number of cache hit events of @p response and, if
+// @p negative is not null, whether the last one is a negative hit.
+static size_t cache_hits(
+    const mkudns_response_uptr &response, bool *negative = nullptr) {
+  size_t hits = 0;
+  size_t count = mkudns_response_get_events_size(response.get());
+  for (size_t idx = 0; idx < count; ++idx) {
+    nlohmann::json event = nlohmann::json::parse(
+        mkudns_response_get_event_at(response.get(), idx));
+    if (event.at("key") != "mkudns.cache_hit") continue;
+    if (negative != nullptr) *negative = event.at("value").at("negative");
+    hits += 1;
+  }
+  return hits;
+}
+
+// has_ttls returns whether all the records of @p response have @p ttl, both
+// in their JSON representation and in the wire format messages, and all the
+// addresses have @p ttl as well.
+static bool has_ttls(const mkudns_response_uptr &response, uint32_t ttl) {
+  bool ok = !response->records.empty() && !response->addresses.empty();
+  for (size_t idx = 0; idx < response->addresses.size(); ++idx) {
+    ok = ok && mkudns_response_get_address_ttl_at(response.get(), idx) == ttl;
+  }
+  for (size_t idx = 0; idx < response->records.size(); ++idx) {
+    const mkudns_rr &rr = response->records[idx];
+    nlohmann::json record = nlohmann::json::parse(
+        mkudns_response_get_record_at(response.get(), idx));
+    const std::string &message = response->messages[rr.message];
+    size_t off = rr.rdata - 6;  // TTL and RDLENGTH precede the data
+    uint32_t wire = 0;
+    ok = ok && record.at("ttl") == ttl &&
+         mkudns_wire_u32(reinterpret_cast<const uint8_t *>(message.data()),
+                         message.size(), &off, &wire) &&
+         wire == ttl;
+  }
+  return ok;
+}
+
+// run_eviction fills a cache shard and checks that storing another entry
+// evicts the entry closest to expiry. It must run with an empty cache.
+static bool run_eviction(responder &r) {
+  std::vector<std::string> names;
+  mkudns_cache_shard *shard = nullptr;
+  for (int64_t idx = 0; names.size() <= mkudns_cache_max_entries; ++idx) {
+    std::string name = "evict-" + std::to_string(idx) + ".example.com";
+    mkudns_query_uptr query = cache_query(r, name);
+    mkudns_cache_shard *candidate =
+        mkudns_cache_shard_for(mkudns_cache_key(query.get()));
+    if (shard == nullptr) shard = candidate;
+    if (candidate == shard) names.push_back(name);
+  }
+  bool good = true;
+  for (size_t idx = 0; idx < names.size(); ++idx) {
+    // The first name is the closest to expiry, the last the farthest.
+    mkudns_query_uptr query = cache_query(r, names[idx]);
+    mkudns_query_set_cache_min_ttl(
+        query.get(), 1000 + static_cast<int64_t>(idx));
+    good = mkudns_response_good(resolve(query).get()) && good;
+  }
+  size_t size = 0;
+  {
+    std::unique_lock<std::mutex> _{shard->mutex};
+    size = shard->entries.size();
+  }
+  good = check("eviction: all stored", good) && good;
+  good = check("eviction: shard size",
+               size == mkudns_cache_max_entries) && good;
+  int64_t before = r.queries;
+  good = check("eviction: survivor hit",
+               cache_hits(resolve(cache_query(r, names[1]))) == 1 &&
+                   r.queries == before) && good;
+  good = check("eviction: victim miss",
+               cache_hits(resolve(cache_query(r, names[0]))) == 0 &&
+                   r.queries == before + 1) && good;
+  return good;
+}
+
+// run_positive checks the cache hits and the TTLs and bounds of the cached
+// answers, waiting for at least one second to age them.
+static bool run_positive(responder &r) {
+  bool good = true;
+  mkudns_query_uptr plain = cache_query(r, "plain.example.com");
+  mkudns_query_uptr floored = cache_query(r, "short.example.com");
+  mkudns_query_set_cache_min_ttl(floored.get(), 10);
+  mkudns_query_uptr capped = cache_query(r, "capped.example.com");
+  mkudns_query_set_cache_max_ttl(capped.get(), 1);
+
+  int64_t before = r.queries;
+  int64_t hits = mkudns_cache_get_hits();
+  mkudns_response_uptr first = resolve(plain);
+  good = check("positive: first is a miss",
+               mkudns_response_good(first.get()) && cache_hits(first) == 0 &&
+                   mkudns_response_get_rtt(first.get()) >= 0 &&
+                   has_ttls(first, 60)) && good;
+  good = check("min_ttl: first is a miss",
+               cache_hits(resolve(floored)) == 0) && good;
+  good = check("max_ttl: first is a miss",
+               cache_hits(resolve(capped)) == 0) && good;
+  good = check("first queries sent", r.queries == before + 3) && good;
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+  // A positive answer ages by the time spent in the cache.
+  before = r.queries;
+  mkudns_response_uptr second = resolve(plain);
+  good = check("positive: second is a hit",
+               mkudns_response_good(second.get()) &&
+                   cache_hits(second) == 1 && r.queries == before &&
+                   mkudns_response_get_rtt(second.get()) == -1 &&
+                   mkudns_response_get_rcode(second.get()) == 0 &&
+                   mkudns_cache_get_hits() == hits + 1) && good;
+  good = check("positive: TTLs decreased", has_ttls(second, 59)) && good;
+
+  // The minimum TTL keeps an answer whose TTL is one second.
+  second = resolve(floored);
+  good = check("min_ttl: second is a hit",
+               cache_hits(second) == 1 && r.queries == before &&
+                   has_ttls(second, 0)) && good;
+
+  // The maximum TTL expires an answer whose TTL is 60 seconds.
+  second = resolve(capped);
+  good = check("max_ttl: second is a miss",
+               cache_hits(second) == 0 && r.queries == before + 1 &&
+                   has_ttls(second, 60)) && good;
+  return good;
+}
+
+// run_negative checks that we cache the negative answers, but not a dual
+// stack answer of which only one reply is negative.
+static bool run_negative(responder &r) {
+  bool good = true;
+  mkudns_query_uptr nxdomain = cache_query(r, "nxdomain.example.com");
+  int64_t before = r.queries;
+  int64_t hits = mkudns_cache_get_hits();
+  int64_t negative_hits = mkudns_cache_get_negative_hits();
+  mkudns_response_uptr first = resolve(nxdomain);
+  good = check("nxdomain: first is a miss",
+               !mkudns_response_good(first.get()) && cache_hits(first) == 0 &&
+                   mkudns_response_get_rcode(first.get()) == 3 &&
+                   r.queries == before + 1) && good;
+  bool negative = false;
+  mkudns_response_uptr second = resolve(nxdomain);
+  good = check("nxdomain: second is a negative hit",
+               !mkudns_response_good(second.get()) &&
+                   cache_hits(second, &negative) == 1 && negative &&
+                   mkudns_response_get_rcode(second.get()) == 3 &&
+                   mkudns_response_get_rtt(second.get()) == -1 &&
+                   r.queries == before + 1 &&
+                   mkudns_cache_get_negative_hits() == negative_hits + 1 &&
+                   mkudns_cache_get_hits() == hits) && good;
+
+  // A SERVFAIL to the A query and a NODATA to the AAAA query.
+  mkudns_query_uptr partial = cache_query(r, "servfail4.example.com");
+  mkudns_query_set_dual_stack(partial.get());
+  before = r.queries;
+  first = resolve(partial);
+  second = resolve(partial);
+  good = check("dual stack partial: not cached",
+               !mkudns_response_good(first.get()) &&
+                   mkudns_response_get_rcode(first.get()) == 2 &&
+                   cache_hits(first) == 0 && cache_hits(second) == 0 &&
+                   r.queries == before + 4 &&
+                   mkudns_cache_get_negative_hits() == negative_hits + 1) &&
+         good;
+
+  // A NXDOMAIN to both the A and the AAAA queries.
+  mkudns_query_uptr both = cache_query(r, "nxdomain.example.org");
+  mkudns_query_set_dual_stack(both.get());
+  before = r.queries;
+  first = resolve(both);
+  second = resolve(both);
+  good = check("dual stack nxdomain: second is a negative hit",
+               cache_hits(first) == 0 && cache_hits(second, &negative) == 1 &&
+                   negative && r.queries == before + 2 &&
+                   mkudns_response_get_rcode(second.get()) == 3 &&
+                   mkudns_cache_get_negative_hits() == negative_hits + 2) &&
+         good;
+  return good;
+}
+
+int main() {
+  responder r;
+  if (!responder_start(&r)) {
+    std::clog << "FATAL: cannot start the local responder" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  bool good = run_eviction(r);
+  good = run_positive(r) && good;
+  good = run_negative(r) && good;
+  responder_stop(&r);
+  if (!good) {
+    std::clog << "FATAL: some scenarios did not succeed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
@@ -1,9 +1,20 @@
 #include <iostream>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+#include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include "mkudns.h"
 
@@ -28,54 +39,199 @@ static void usage() {
   std::clog << "Options can start with either a single dash (i.e. -option) or\n";
   std::clog << "a double dash (i.e. --option). Available options:\n";
   std::clog << "\n";
+  std::clog << "  --cache : answer from and fill the process-wide cache\n";
+  std::clog << "  --dual-stack : query for both A and AAAA\n";
+  std::clog << "  --edns-payload-size <bytes> : EDNS0 payload size (0 disables)\n";
+  std::clog << "  --expect-rcode <rcode> : succeed if the response has this rcode\n";
+  std::clog << "  --fanout-server-addresses <ip,...> : query these name servers\n";
+  std::clog << "  --hedge-delay <ms> : delay before querying the hedge server\n";
+  std::clog << "  --hedge-server-address <ip> : hedge name server address\n";
+  std::clog << "  --hedge-server-port <port> : hedge name server port\n";
+  std::clog << "  --linger <ms> : keep receiving late responses for <ms>\n";
+  std::clog << "  --nonblocking : drive the query from our own poll loop\n";
   std::clog << "  --server-address <ip> : name server address\n";
+  std::clog << "  --server-port <port> : name server port\n";
+  std::clog << "  --tcp : send the query over TCP\n";
+  std::clog << "  --traceroute <max-ttl> : perform a parasitic traceroute\n";
+  std::clog << "  --type <type> : query type (e.g. MX or 15)\n";
   std::clog << std::endl;
   // clang-format on
 }
 // LCOV_EXCL_STOP
 
-static void summary(mkudns_response_uptr &response) {
+// query_type returns the numeric value of the query type @p name, which is
+// either a type mnemonic or a number.
+static int64_t query_type(const std::string &name) {
+  static const std::map<std::string, int64_t> types{
+      {"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12},
+      {"MX", 15}, {"TXT", 16}, {"AAAA", 28}, {"SRV", 33}, {"SVCB", 64},
+      {"HTTPS", 65}, {"ANY", 255}, {"CAA", 257}};
+  auto it = types.find(name);
+  return (it != types.end()) ? it->second
+                             : strtoll(name.c_str(), nullptr, 10);
+}
+
+static void summary(const mkudns_response_t *response) {
   std::clog << "=== BEGIN SUMMARY ==="
             << std::endl
             << "Response good: "
-            << mkudns_response_good(response.get())
+            << mkudns_response_good(response)
             << std::endl
             << "Response cname: "
-            << mkudns_response_get_cname(response.get())
+            << mkudns_response_get_cname(response)
+            << std::endl
+            << "Response rcode: "
+            << mkudns_response_get_rcode(response)
+            << std::endl
+            << "Response flags: "
+            << mkudns_response_get_flags(response)
+            << std::endl
+            << "Response RTT: "
+            << mkudns_response_get_rtt(response)
+            << std::endl
+            << "Response recv TTL: "
+            << mkudns_response_get_recv_ttl(response)
             << std::endl
             << "Send event: "
-            << mkudns_response_get_send_event(response.get())
+            << mkudns_response_get_send_event(response)
             << std::endl
             << "Recv event: "
-            << mkudns_response_get_recv_event(response.get())
+            << mkudns_response_get_recv_event(response)
             << std::endl
             << "=== END SUMMARY ==="
             << std::endl
             << std::endl;
+  std::clog << "=== BEGIN EVENTS ==="
+            << std::endl;
+  {
+    size_t total = mkudns_response_get_events_size(response);
+    for (size_t i = 0; i < total; ++i) {
+      std::clog << "- "
+                << mkudns_response_get_event_at(response, i)
+                << std::endl;
+    }
+  }
+  std::clog << "=== END EVENTS ==="
+            << std::endl
+            << std::endl;
+  mkudns_response_wait_linger(response);
+  std::clog << "=== BEGIN LATE EVENTS ==="
+            << std::endl;
+  {
+    size_t total = mkudns_response_get_late_events_size(response);
+    for (size_t i = 0; i < total; ++i) {
+      std::clog << "- "
+                << mkudns_response_get_late_event_at(response, i)
+                << std::endl;
+    }
+  }
+  std::clog << "=== END LATE EVENTS ==="
+            << std::endl
+            << std::endl;
+  std::clog << "=== BEGIN CNAMES ==="
+            << std::endl;
+  {
+    size_t total = mkudns_response_get_cnames_size(response);
+    for (size_t i = 0; i < total; ++i) {
+      std::clog << "- "
+                << mkudns_response_get_cname_at(response, i)
+                << std::endl;
+    }
+  }
+  std::clog << "=== END CNAMES ==="
+            << std::endl
+            << std::endl;
   std::clog << "=== BEGIN ADDRESSES ==="
             << std::endl;
   {
-    size_t total = mkudns_response_get_addresses_size(response.get());
+    size_t total = mkudns_response_get_addresses_size(response);
     for (size_t i = 0; i < total; ++i) {
       std::clog << "- "
-                << mkudns_response_get_address_at(response.get(), i)
+                << mkudns_response_get_address_at(response, i)
+                << " (TTL "
+                << mkudns_response_get_address_ttl_at(response, i)
+                << ")"
                 << std::endl;
     }
   }
   std::clog << "=== END ADDRESSES ==="
             << std::endl
             << std::endl;
+  std::clog << "=== BEGIN RECORDS ==="
+            << std::endl;
+  {
+    size_t total = mkudns_response_get_records_size(response);
+    for (size_t i = 0; i < total; ++i) {
+      std::clog << "- "
+                << mkudns_response_get_record_at(response, i)
+                << std::endl;
+    }
+  }
+  std::clog << "=== END RECORDS ==="
+            << std::endl
+            << std::endl;
+}
+
+// client_socket_t is a system socket.
+#ifdef _WIN32
+using client_socket_t = SOCKET;
+#define CLIENT_POLL WSAPoll
+#else
+using client_socket_t = int;
+#define CLIENT_POLL poll
+#endif
+
+// perform_nonblocking performs @p query using the nonblocking API, driving
+// it from a poll loop, as an application with its own event loop would do.
+static mkudns_response_t *perform_nonblocking(const mkudns_query_t *query) {
+  mkudns_operation_uptr operation{mkudns_query_start_nonnull(query)};
+  while (!mkudns_operation_done(operation.get())) {
+    pollfd pfd{};
+    pfd.fd = static_cast<client_socket_t>(
+        mkudns_operation_get_socket(operation.get()));
+    pfd.events = POLLIN;
+    int64_t timeout = mkudns_operation_get_timeout(operation.get());
+    int ret = CLIENT_POLL(&pfd, 1, static_cast<int>(
+        std::min<int64_t>(timeout, INT_MAX)));
+    if (ret > 0) {
+      mkudns_operation_on_readable(operation.get());
+    } else if (ret == 0) {
+      mkudns_operation_on_timeout(operation.get());
+    }
+  }
+  return mkudns_operation_finish_nonnull(operation.get());
 }
 
 int main(int, char **argv) {
   mkudns_query_uptr query{mkudns_query_new_nonnull()};
+  int64_t expect_rcode = -1;
+  bool nonblocking = false;
+  std::string server_port = "53";
+  std::vector<std::string> fanout_server_addresses;
+  int64_t traceroute_max_ttl = 0;
   {
     argh::parser cmdline;
+    cmdline.add_param("edns-payload-size");
+    cmdline.add_param("expect-rcode");
+    cmdline.add_param("fanout-server-addresses");
+    cmdline.add_param("hedge-delay");
+    cmdline.add_param("hedge-server-address");
+    cmdline.add_param("hedge-server-port");
+    cmdline.add_param("linger");
     cmdline.add_param("server-address");
+    cmdline.add_param("server-port");
+    cmdline.add_param("traceroute");
+    cmdline.add_param("type");
     cmdline.parse(argv);
     for (auto &flag : cmdline.flags()) {
-      if (0) {
-        // TODO(bassosimone): here we'll probably have flags
+      if (flag == "cache") {
+        mkudns_query_set_cache(query.get());
+      } else if (flag == "dual-stack") {
+        mkudns_query_set_dual_stack(query.get());
+      } else if (flag == "nonblocking") {
+        nonblocking = true;
+      } else if (flag == "tcp") {
+        mkudns_query_set_transport_tcp(query.get());
       } else {
         std::clog << "fatal: unrecognized flag: " << flag << std::endl;
         usage();
@@ -83,8 +239,37 @@ int main(int, char **argv) {
       }
     }
     for (auto &param : cmdline.params()) {
-      if (param.first == "server-address") {
+      if (param.first == "edns-payload-size") {
+        mkudns_query_set_edns_payload_size(
+            query.get(), strtoll(param.second.c_str(), nullptr, 10));
+      } else if (param.first == "expect-rcode") {
+        expect_rcode = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "fanout-server-addresses") {
+        std::stringstream ss{param.second};
+        std::string address;
+        while (std::getline(ss, address, ',')) {
+          fanout_server_addresses.push_back(address);
+        }
+      } else if (param.first == "hedge-delay") {
+        mkudns_query_set_hedge_delay(
+            query.get(), strtoll(param.second.c_str(), nullptr, 10));
+      } else if (param.first == "hedge-server-address") {
+        mkudns_query_set_hedge_server_address(
+            query.get(), param.second.c_str());
+      } else if (param.first == "hedge-server-port") {
+        mkudns_query_set_hedge_server_port(query.get(), param.second.c_str());
+      } else if (param.first == "linger") {
+        mkudns_query_set_linger(
+            query.get(), strtoll(param.second.c_str(), nullptr, 10));
+      } else if (param.first == "server-address") {
         mkudns_query_set_server_address(query.get(), param.second.c_str());
+      } else if (param.first == "server-port") {
+        mkudns_query_set_server_port(query.get(), param.second.c_str());
+        server_port = param.second;
+      } else if (param.first == "traceroute") {
+        traceroute_max_ttl = strtoll(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "type") {
+        mkudns_query_set_type(query.get(), query_type(param.second));
       } else {
         std::clog << "fatal: unrecognized param: " << param.first << std::endl;
         usage();
@@ -98,8 +283,56 @@ int main(int, char **argv) {
     }
     mkudns_query_set_name(query.get(), cmdline.pos_args()[1].c_str());
   }
-  mkudns_response_uptr response{mkudns_query_perform_nonnull(query.get())};
-  summary(response);
+  if (traceroute_max_ttl > 0) {
+    mkudns_responses_uptr responses{
+        mkudns_query_perform_traceroute_nonnull(
+            query.get(), traceroute_max_ttl)};
+    std::clog << "=== BEGIN HOPS ===" << std::endl;
+    size_t total = mkudns_responses_get_size(responses.get());
+    for (size_t i = 0; i < total; ++i) {
+      const mkudns_response_t *response = mkudns_responses_get_at(
+          responses.get(), i);
+      std::clog << "- " << (i + 1) << " "
+                << (mkudns_response_good(response) ? "(answer) " : "")
+                << mkudns_response_get_icmp_origin(response) << " "
+                << mkudns_response_get_rtt(response) << " ms" << std::endl;
+    }
+    std::clog << "=== END HOPS ===" << std::endl;
+    return 0;
+  }
+  if (!fanout_server_addresses.empty()) {
+    for (auto &address : fanout_server_addresses) {
+      mkudns_query_add_fanout_server(
+          query.get(), address.c_str(), server_port.c_str());
+    }
+    mkudns_responses_uptr responses{
+        mkudns_query_perform_fanout_nonnull(query.get())};
+    bool good = true;
+    size_t total = mkudns_responses_get_size(responses.get());
+    for (size_t i = 0; i < total; ++i) {
+      const mkudns_response_t *response = mkudns_responses_get_at(
+          responses.get(), i);
+      summary(response);
+      good = good && mkudns_response_good(response);
+    }
+    if (!good) {
+      std::clog << "FATAL: some queries did not succeed" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return 0;
+  }
+  mkudns_response_uptr response{
+      nonblocking ? perform_nonblocking(query.get())
+                  : mkudns_query_perform_nonnull(query.get())};
+  summary(response.get());
+  if (expect_rcode >= 0) {
+    if (mkudns_response_get_rcode(response.get()) != expect_rcode) {
+      std::clog << "FATAL: the response rcode is not " << expect_rcode
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return 0;
+  }
   if (!mkudns_response_good(response.get())) {
     std::clog << "FATAL: the query did not succeed" << std::endl;
     exit(EXIT_FAILURE);
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mkudns.h"
+
+#define MKDATA_INLINE_IMPL
+#include "mkdata.hpp"
+
+#include "json.hpp"
+
+#include "mkudns-responder.h"
+
+// coalesce_queries is the number of identical queries that we perform at
+// the same time.
+constexpr size_t coalesce_queries = 8;
+
+// check prints @p what and returns @p ok.
+static bool check(const char *what, bool ok) {
+  std::clog << (ok ? "PASS" : "FAIL") << ": " << what << std::endl;
+  return ok;
+}
+
+// first_event returns the first event of @p response, or null if there is
+// no event.
+static nlohmann::json first_event(const mkudns_response_t *response) {
+  if (mkudns_response_get_events_size(response) <= 0) return nullptr;
+  return nlohmann::json::parse(mkudns_response_get_event_at(response, 0));
+}
+
+int main() {
+  responder r;
+  // The responder holds the query long enough for all threads to attach.
+  r.delay = std::chrono::milliseconds(500);
+  if (!responder_start(&r)) {
+    std::clog << "FATAL: cannot start the local responder" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::vector<mkudns_response_uptr> responses(coalesce_queries);
+  {
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    for (size_t idx = 0; idx < coalesce_queries; ++idx) {
+      threads.emplace_back([&r, &responses, &start, idx]() {
+        mkudns_query_uptr query{mkudns_query_new_nonnull()};
+        mkudns_query_set_name(query.get(), "www.example.com");
+        mkudns_query_set_server_address(query.get(), "127.0.0.1");
+        mkudns_query_set_server_port(query.get(), r.port.c_str());
+        mkudns_query_set_timeout(query.get(), 5000);
+        mkudns_query_set_coalesce(query.get());
+        while (!start) std::this_thread::yield();
+        responses[idx].reset(mkudns_query_perform_nonnull(query.get()));
+      });
+    }
+    start = true;
+    for (auto &t : threads) t.join();
+  }
+  responder_stop(&r);
+
+  bool good = check("one datagram sent", r.queries == 1);
+  // The leader is the only query whose events do not begin by telling that
+  // it has been coalesced, and its events carry its query ID.
+  std::vector<nlohmann::json> firsts;
+  nlohmann::json leader_id;
+  size_t leaders = 0;
+  for (auto &response : responses) {
+    good = check("response is good",
+                 mkudns_response_good(response.get())) && good;
+    firsts.push_back(first_event(response.get()));
+    if (firsts.back().is_object() &&
+        firsts.back().at("key") != "mkudns.coalesced") {
+      leader_id = firsts.back().at("value").at("query_id");
+      leaders += 1;
+    }
+  }
+  good = check("one leader", leaders == 1) && good;
+  for (size_t idx = 0; idx < firsts.size(); ++idx) {
+    if (!firsts[idx].is_object()) {
+      good = check("response has events", false) && good;
+      continue;
+    }
+    if (firsts[idx].at("key") != "mkudns.coalesced") continue;
+    // Then come the events of the leader, which carry its query ID.
+    nlohmann::json second = nlohmann::json::parse(
+        mkudns_response_get_events_size(responses[idx].get()) > 1
+            ? mkudns_response_get_event_at(responses[idx].get(), 1)
+            : "{}");
+    good = check("follower begins with mkudns.coalesced",
+                 firsts[idx].at("value").at("leader_query_id") == leader_id &&
+                     firsts[idx].at("value").at("query_id") != leader_id &&
+                     second.value("value", nlohmann::json::object())
+                             .value("query_id", nlohmann::json{}) ==
+                         leader_id) && good;
+  }
+  if (!good) {
+    std::clog << "FATAL: some checks did not succeed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
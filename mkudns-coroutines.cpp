@@ -0,0 +1,217 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "mkudns.h"
+
+#define MKDATA_INLINE_IMPL
+#include "mkdata.hpp"
+
+#ifdef MKUDNS_HAVE_COROUTINES
+
+#include "mkudns-responder.h"
+
+// task is a coroutine that starts immediately and whose frame lives until
+// the task is destroyed, so that we can destroy it while suspended.
+class task {
+ public:
+  // promise_type is the promise of a task.
+  struct promise_type {
+    task get_return_object() {
+      return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  // task takes ownership of @p handle.
+  explicit task(std::coroutine_handle<promise_type> handle) noexcept
+      : handle_{handle} {}
+
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+
+  // ~task destroys the coroutine frame, if any.
+  ~task() { reset(); }
+
+  // done tells whether the coroutine has completed.
+  bool done() const noexcept { return handle_ && handle_.done(); }
+
+  // reset destroys the coroutine frame, even if it is suspended.
+  void reset() noexcept {
+    if (handle_) handle_.destroy();
+    handle_ = nullptr;
+  }
+
+ private:
+  // handle_ is the coroutine handle.
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// outcome is what a lookup coroutine observed.
+struct outcome {
+  // canceled indicates that the response contains a mkudns.cancel event.
+  bool canceled = false;
+
+  // elapsed is the time it took to resolve.
+  std::chrono::steady_clock::duration elapsed{};
+
+  // good indicates that the response is good.
+  bool good = false;
+
+  // resumed indicates that the coroutine was resumed.
+  bool resumed = false;
+};
+
+// lookup resolves @p query with @p engine and fills @p result.
+static task lookup(mkudns_engine_t *engine, const mkudns_query_t *query,
+                   std::chrono::steady_clock::time_point deadline,
+                   std::stop_token token, outcome *result) {
+  auto begin = std::chrono::steady_clock::now();
+  mkudns_response_uptr response = co_await mkudns::resolve(
+      engine, query, deadline, std::move(token));
+  result->elapsed = std::chrono::steady_clock::now() - begin;
+  result->resumed = true;
+  result->good = mkudns_response_good(response.get()) != 0;
+  size_t count = mkudns_response_get_events_size(response.get());
+  for (size_t idx = 0; idx < count; ++idx) {
+    std::string event = mkudns_response_get_event_at(response.get(), idx);
+    if (event.find("\"mkudns.cancel\"") != std::string::npos) {
+      result->canceled = true;
+    }
+  }
+}
+
+// check prints @p what and returns @p ok.
+static bool check(const std::string &backend, const char *what, bool ok) {
+  std::clog << (ok ? "PASS" : "FAIL") << ": " << backend << ": " << what
+            << std::endl;
+  return ok;
+}
+
+// run_scenarios runs all the scenarios with @p backend and returns whether
+// they all succeeded.
+static bool run_scenarios(
+    const std::string &backend, const responder &live, const responder &mute) {
+  using namespace std::chrono_literals;
+  mkudns_engine_uptr engine{mkudns_engine_new_nonnull(backend.c_str())};
+  mkudns_query_uptr query{mkudns_query_new_nonnull()};
+  mkudns_query_set_name(query.get(), "www.example.com");
+  mkudns_query_set_server_address(query.get(), "127.0.0.1");
+  mkudns_query_set_timeout(query.get(), 5000);
+  bool good = true;
+
+  // The query completes and resumes the coroutine.
+  {
+    mkudns_query_set_server_port(query.get(), live.port.c_str());
+    outcome result;
+    task t = lookup(engine.get(), query.get(),
+                    std::chrono::steady_clock::now() + 2s, {}, &result);
+    mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+    good = check(backend, "completion",
+                 t.done() && result.resumed && result.good &&
+                     !result.canceled) && good;
+  }
+
+  mkudns_query_set_server_port(query.get(), mute.port.c_str());
+
+  // The deadline expires before the query timeout.
+  {
+    outcome result;
+    task t = lookup(engine.get(), query.get(),
+                    std::chrono::steady_clock::now() + 100ms, {}, &result);
+    mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+    good = check(backend, "deadline",
+                 t.done() && result.resumed && !result.good &&
+                     !result.canceled && result.elapsed < 2s) && good;
+  }
+
+  // Stop is requested before the coroutine suspends.
+  {
+    std::stop_source source;
+    source.request_stop();
+    outcome result;
+    task t = lookup(engine.get(), query.get(),
+                    std::chrono::steady_clock::now() + 2s,
+                    source.get_token(), &result);
+    mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+    good = check(backend, "pre-cancel",
+                 t.done() && result.resumed && !result.good &&
+                     result.canceled && result.elapsed < 1s) && good;
+  }
+
+  // Another thread requests stop while the engine waits for I/O.
+  {
+    std::stop_source source;
+    outcome result;
+    task t = lookup(engine.get(), query.get(),
+                    std::chrono::steady_clock::time_point::max(),
+                    source.get_token(), &result);
+    std::thread stopper{[&source]() {
+      std::this_thread::sleep_for(100ms);
+      source.request_stop();
+    }};
+    mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+    stopper.join();
+    good = check(backend, "cross-thread stop",
+                 t.done() && result.resumed && !result.good &&
+                     result.canceled && result.elapsed < 2s) && good;
+  }
+
+  // Destroying the suspended coroutine cancels its query.
+  {
+    std::stop_source source;
+    outcome result;
+    task t = lookup(engine.get(), query.get(),
+                    std::chrono::steady_clock::now() + 2s,
+                    source.get_token(), &result);
+    t.reset();
+    source.request_stop();  // must not touch the destroyed awaitable
+    auto begin = std::chrono::steady_clock::now();
+    mkudns_responses_uptr responses{mkudns_engine_run_nonnull(engine.get())};
+    good = check(backend, "destroy while suspended",
+                 !result.resumed &&
+                     std::chrono::steady_clock::now() - begin < 1s) && good;
+  }
+
+  return good;
+}
+
+int main() {
+  responder live;
+  responder mute;
+  mute.silent = true;
+  if (!responder_start(&live) || !responder_start(&mute)) {
+    std::clog << "FATAL: cannot start the local responders" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  bool good = true;
+  for (auto backend : {"io_uring", "epoll", "poll"}) {
+    good = run_scenarios(backend, live, mute) && good;
+  }
+  responder_stop(&mute);
+  responder_stop(&live);
+  if (!good) {
+    std::clog << "FATAL: some scenarios did not succeed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+#else  // MKUDNS_HAVE_COROUTINES
+
+// mkudns_coroutines_skip is the exit code telling ctest that we skipped the
+// test because the standard library lacks coroutines or stop tokens.
+constexpr int mkudns_coroutines_skip = 77;
+
+int main() {
+  std::clog << "SKIP: C++20 coroutines are not available" << std::endl;
+  return mkudns_coroutines_skip;
+}
+
+#endif  // MKUDNS_HAVE_COROUTINES
@@ -0,0 +1,234 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_MKUDNS_RESPONDER_H
+#define MEASUREMENT_KIT_MKUDNS_RESPONDER_H
+
+/// @file mkudns-responder.h. Local name server used by the mkudns benchmarks
+/// and tests, so that they do not depend on the network. It answers A and
+/// AAAA queries for any name with 127.0.0.1 and ::1 respectively, and any
+/// other query like an A query, except for the names whose first label is:
+///
+/// - `nxdomain`, for which it returns NXDOMAIN with a SOA;
+///
+/// - `servfail4`, for which it returns SERVFAIL to A queries and NODATA with
+///   a SOA to the other queries;
+///
+/// - `short`, whose records have a TTL of one second rather than 60.
+///
+/// The SOA records have a TTL of 30 seconds and a minimum of 60 seconds.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+// responder_socket_t is a system socket.
+#ifdef _WIN32
+using responder_socket_t = SOCKET;
+#define RESPONDER_CLOSESOCKET closesocket
+#define RESPONDER_POLL WSAPoll
+#else
+using responder_socket_t = int;
+#define RESPONDER_CLOSESOCKET close
+#define RESPONDER_POLL poll
+#endif
+
+// responder_held is a response that the responder sends later.
+struct responder_held {
+  // due is when the responder sends the response.
+  std::chrono::steady_clock::time_point due;
+
+  // from is the address of the client.
+  sockaddr_storage from{};
+
+  // fromlen is the length of from.
+  socklen_t fromlen = 0;
+
+  // msg is the response.
+  std::vector<char> msg;
+};
+
+// responder is a local name server that answers the queries as described
+// above, so that we can measure the cost of the engine and test the
+// resolver without using the network.
+struct responder {
+  // delay is how long the responder holds each query before answering.
+  std::chrono::milliseconds delay{0};
+
+  // peak is the largest number of queries held at the same time, which is
+  // a lower bound of the queries in flight in the engine. Only the responder
+  // thread updates it, and only when delay is positive.
+  std::atomic<size_t> peak{0};
+
+  // port is the port where the responder is listening.
+  std::string port;
+
+  // queries is the number of datagrams that the responder received.
+  std::atomic<int64_t> queries{0};
+
+  // silent indicates that the responder never answers.
+  bool silent = false;
+
+  // sock is the responder socket.
+  responder_socket_t sock = responder_socket_t(-1);
+
+  // stop tells the responder thread to stop.
+  std::atomic<bool> stop{false};
+
+  // thread is the responder thread.
+  std::thread thread;
+};
+
+// responder_append appends the @p n bytes at @p data to @p buff, which is
+// @p size bytes long, at @p off, and returns false if they do not fit.
+static bool responder_append(uint8_t *buff, size_t size, size_t *off,
+                             const uint8_t *data, size_t n) {
+  if (*off > size || n > size - *off) return false;
+  memcpy(&buff[*off], data, n);
+  *off += n;
+  return true;
+}
+
+// responder_answer turns the query in @p buff, which is @p n bytes long, into
+// a response, and returns its length, or zero if the query is invalid.
+static size_t responder_answer(uint8_t *buff, size_t n, size_t size) {
+  size_t off = 12;
+  while (off < n && buff[off] != 0) off += size_t{buff[off]} + 1;
+  off += 5;  // root label, type, and class
+  if (n < 13 || off > n) return 0;
+  std::string label{reinterpret_cast<const char *>(&buff[13]),
+                    std::min<size_t>(buff[12], n - 13)};
+  bool aaaa = buff[off - 4] == 0x00 && buff[off - 3] == 0x1c;
+  uint8_t ttl = (label == "short") ? 0x01 : 0x3c;
+  const uint8_t a[] = {
+      0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+      0x00, ttl,  0x00, 0x04, 0x7f, 0x00, 0x00, 0x01};
+  const uint8_t quad_a[] = {
+      0xc0, 0x0c, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x00, ttl,
+      0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01};
+  const uint8_t soa[] = {
+      0xc0, 0x0c, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x00, 0x1e,
+      0x00, 0x16, 0x00, 0x00,              // root mname and rname
+      0x00, 0x00, 0x00, 0x01,              // serial
+      0x00, 0x00, 0x0e, 0x10,              // refresh
+      0x00, 0x00, 0x02, 0x58,              // retry
+      0x00, 0x01, 0x51, 0x80,              // expire
+      0x00, 0x00, 0x00, 0x3c};             // minimum
+  uint8_t rcode = 0x00;  // NOERROR
+  bool answer = true;
+  if (label == "nxdomain") {
+    rcode = 0x03;  // NXDOMAIN
+    answer = false;
+  } else if (label == "servfail4") {
+    rcode = aaaa ? 0x00 : 0x02;  // NOERROR, SERVFAIL
+    answer = false;
+  }
+  buff[2] = 0x81;  // QR, RD
+  buff[3] = static_cast<uint8_t>(0x80 | rcode);  // RA
+  memset(&buff[6], 0, 6);  // ANCOUNT, NSCOUNT, ARCOUNT
+  if (answer) {
+    buff[7] = 0x01;
+    return (aaaa ? responder_append(buff, size, &off, quad_a, sizeof(quad_a))
+                 : responder_append(buff, size, &off, a, sizeof(a)))
+               ? off : 0;
+  }
+  if (rcode == 0x02) return off;
+  buff[9] = 0x01;
+  return responder_append(buff, size, &off, soa, sizeof(soa)) ? off : 0;
+}
+
+// responder_loop answers queries until @p r is stopped.
+static void responder_loop(responder *r) {
+  std::vector<char> buff(4096);
+  std::deque<responder_held> held;
+  while (!r->stop) {
+    auto now = std::chrono::steady_clock::now();
+    while (!held.empty() && held.front().due <= now) {
+      responder_held &h = held.front();
+      (void)sendto(r->sock, h.msg.data(), static_cast<int>(h.msg.size()), 0,
+                   reinterpret_cast<sockaddr *>(&h.from), h.fromlen);
+      held.pop_front();
+    }
+    int timeout = 100;
+    if (!held.empty()) {
+      timeout = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              held.front().due - now).count() + 1);
+    }
+    pollfd pfd{};
+    pfd.fd = r->sock;
+    pfd.events = POLLIN;
+    if (RESPONDER_POLL(&pfd, 1, timeout) <= 0) continue;
+    sockaddr_storage from{};
+    socklen_t fromlen = sizeof(from);
+    auto n = recvfrom(r->sock, buff.data(), static_cast<int>(buff.size()), 0,
+                      reinterpret_cast<sockaddr *>(&from), &fromlen);
+    if (n <= 0) continue;
+    r->queries += 1;
+    if (r->silent) continue;
+    size_t count = responder_answer(
+        reinterpret_cast<uint8_t *>(buff.data()), static_cast<size_t>(n),
+        buff.size());
+    if (count <= 0) continue;
+    if (r->delay.count() <= 0) {
+      (void)sendto(r->sock, buff.data(), static_cast<int>(count), 0,
+                   reinterpret_cast<sockaddr *>(&from), fromlen);
+      continue;
+    }
+    responder_held h;
+    h.due = std::chrono::steady_clock::now() + r->delay;
+    h.from = from;
+    h.fromlen = fromlen;
+    h.msg.assign(buff.data(), buff.data() + count);
+    held.push_back(std::move(h));
+    if (held.size() > r->peak) r->peak = held.size();
+  }
+}
+
+// responder_start starts @p r on a random port of 127.0.0.1.
+static bool responder_start(responder *r) {
+  r->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (r->sock == responder_socket_t(-1)) return false;
+  int bufsiz = 1 << 22;
+  (void)setsockopt(r->sock, SOL_SOCKET, SO_RCVBUF,
+                   reinterpret_cast<char *>(&bufsiz), sizeof(bufsiz));
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (bind(r->sock, reinterpret_cast<sockaddr *>(&sin), len) != 0 ||
+      getsockname(r->sock, reinterpret_cast<sockaddr *>(&sin), &len) != 0) {
+    RESPONDER_CLOSESOCKET(r->sock);
+    return false;
+  }
+  r->port = std::to_string(static_cast<unsigned>(ntohs(sin.sin_port)));
+  r->thread = std::thread{responder_loop, r};
+  return true;
+}
+
+// responder_stop stops @p r.
+static void responder_stop(responder *r) {
+  r->stop = true;
+  r->thread.join();
+  RESPONDER_CLOSESOCKET(r->sock);
+}
+
+#endif  // MEASUREMENT_KIT_MKUDNS_RESPONDER_H
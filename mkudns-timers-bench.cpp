@@ -0,0 +1,168 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// We need the engine timer wheel, which is private.
+#define MKDATA_INLINE_IMPL
+#define MKUDNS_INLINE_IMPL
+#include "mkudns.h"
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+// LCOV_EXCL_START
+static void usage() {
+  // clang-format off
+  std::clog << "\n";
+  std::clog << "Usage: mkudns-timers-bench [options]\n";
+  std::clog << "\n";
+  std::clog << "Inserts timers expiring at random times, cancels half of them,\n";
+  std::clog << "and expires the others one millisecond at a time, using the\n";
+  std::clog << "engine timer wheel and a std::multimap, and prints how long\n";
+  std::clog << "each operation took on average.\n";
+  std::clog << "\n";
+  std::clog << "Options can start with either a single dash (i.e. -option) or\n";
+  std::clog << "a double dash (i.e. --option). Available options:\n";
+  std::clog << "\n";
+  std::clog << "  --count <n> : number of timers (default: 100000 and 1000000)\n";
+  std::clog << "  --window <ms> : timers expire within this window (default: 30000)\n";
+  std::clog << std::endl;
+  // clang-format on
+}
+// LCOV_EXCL_STOP
+
+// elapsed_ns returns the nanoseconds elapsed since @p begin.
+static int64_t elapsed_ns(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - begin).count();
+}
+
+// print prints the results of a benchmark of @p name with @p count timers.
+static void print(const char *name, size_t count, int64_t insert,
+                  int64_t cancel, int64_t expire) {
+  int64_t n = static_cast<int64_t>(count);
+  std::clog << name << ": " << count << " timers, insert "
+            << (insert / n) << " ns, cancel " << (cancel / (n / 2))
+            << " ns, expire " << (expire / (n - n / 2)) << " ns"
+            << std::endl;
+}
+
+// bench_wheel benchmarks the wheel using @p deadlines, which start after
+// @p start. Returns false if a timer expired at the wrong time.
+static bool bench_wheel(const std::vector<int64_t> &deadlines, int64_t start,
+                        int64_t window) {
+  std::unique_ptr<mkudns_wheel> wheel{new mkudns_wheel};
+  std::vector<mkudns_wheel_timer> timers(deadlines.size());
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < deadlines.size(); ++i) {
+    timers[i].value = i;
+    mkudns_wheel_insert(wheel.get(), &timers[i], deadlines[i], start);
+  }
+  int64_t insert = elapsed_ns(begin);
+  begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < timers.size(); i += 2) {
+    mkudns_wheel_cancel(wheel.get(), &timers[i]);
+  }
+  int64_t cancel = elapsed_ns(begin);
+  size_t expired = 0;
+  bool good = true;
+  begin = std::chrono::steady_clock::now();
+  for (int64_t now = start; now <= start + window; ++now) {
+    mkudns_wheel_timer *timer = nullptr;
+    while ((timer = mkudns_wheel_pop(wheel.get(), now)) != nullptr) {
+      good = good && timer->deadline == now && timer->value % 2 == 1;
+      ++expired;
+    }
+  }
+  int64_t expire = elapsed_ns(begin);
+  print("wheel", deadlines.size(), insert, cancel, expire);
+  return good && expired == deadlines.size() / 2 && wheel->count == 0;
+}
+
+// bench_multimap is like bench_wheel but uses a std::multimap.
+static bool bench_multimap(const std::vector<int64_t> &deadlines,
+                           int64_t start, int64_t window) {
+  std::multimap<int64_t, size_t> timers;
+  std::vector<std::multimap<int64_t, size_t>::iterator> its;
+  its.reserve(deadlines.size());
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < deadlines.size(); ++i) {
+    its.push_back(timers.emplace(deadlines[i], i));
+  }
+  int64_t insert = elapsed_ns(begin);
+  begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < its.size(); i += 2) timers.erase(its[i]);
+  int64_t cancel = elapsed_ns(begin);
+  size_t expired = 0;
+  bool good = true;
+  begin = std::chrono::steady_clock::now();
+  for (int64_t now = start; now <= start + window; ++now) {
+    while (!timers.empty() && timers.begin()->first <= now) {
+      good = good && timers.begin()->first == now;
+      timers.erase(timers.begin());
+      ++expired;
+    }
+  }
+  int64_t expire = elapsed_ns(begin);
+  print("multimap", deadlines.size(), insert, cancel, expire);
+  return good && expired == deadlines.size() / 2;
+}
+
+int main(int, char **argv) {
+  std::vector<size_t> counts{100000, 1000000};
+  int64_t window = 30000;
+  {
+    argh::parser cmdline;
+    cmdline.add_param("count");
+    cmdline.add_param("window");
+    cmdline.parse(argv);
+    for (auto &flag : cmdline.flags()) {
+      std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    for (auto &param : cmdline.params()) {
+      if (param.first == "count") {
+        counts = {static_cast<size_t>(
+            strtoull(param.second.c_str(), nullptr, 10))};
+      } else if (param.first == "window") {
+        window = strtoll(param.second.c_str(), nullptr, 10);
+      } else {
+        std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (cmdline.pos_args().size() != 1 || counts[0] < 2 || window <= 0) {
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  // Start from the current time, like the engine, so that we also cover
+  // the ticks that are not aligned to the wheel slots.
+  int64_t start = mkudns_now();
+  bool good = true;
+  for (size_t count : counts) {
+    std::mt19937_64 rng{count};
+    std::uniform_int_distribution<int64_t> dist{0, window};
+    std::vector<int64_t> deadlines;
+    for (size_t i = 0; i < count; ++i) deadlines.push_back(start + dist(rng));
+    good = bench_wheel(deadlines, start, window) && good;
+    good = bench_multimap(deadlines, start, window) && good;
+  }
+  if (!good) {
+    std::clog << "FATAL: some timers expired at the wrong time" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
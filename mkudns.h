@@ -19,20 +19,20 @@
 ///
 /// 6. we can perform a parasitic traceroute
 ///
+/// 7. we can notice if we receive subsequent DNS responses after the
+///    first response has been received (see mkudns_query_set_linger)
+///
+/// 8. we can send queries over TCP (see mkudns_query_set_transport_tcp)
+///
+/// 9. we can issue queries of any type (see mkudns_query_set_type)
+///
 /// This is currently implementd using https://github.com/c-ares/c-ares
 /// however any backend resolver library that allows us to implement these
 /// functionalities is actually good.
 ///
 /// This code does not meet the following requirements:
 ///
-/// 1. possibility of sending queries over TCP
-///
-/// 2. possibility of sending queries different from A and AAAA
-///
-/// 3. possibility of noticing if we receive subsequent DNS responses
-///    after the first response has been received
-///
-/// 4. possibility of performing non stub resolutions
+/// 1. possibility of performing non stub resolutions
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -47,6 +47,9 @@ typedef struct mkudns_query mkudns_query_t;
 /// mkudns_response_t is the response to a DNS query.
 typedef struct mkudns_response mkudns_response_t;
 
+/// mkudns_responses_t is the list of responses to a fan-out DNS query.
+typedef struct mkudns_responses mkudns_responses_t;
+
 /// mkudns_query_new_nonnull creates a DNS query. This function never
 /// returns null and will abort if memory allocations fail.
 mkudns_query_t *mkudns_query_new_nonnull(void);
@@ -59,16 +62,116 @@ void mkudns_query_set_name(mkudns_query_t *query, const char *name);
 /// A, which is the most common case. Aborts if the @p query is null.
 void mkudns_query_set_type_AAAA(mkudns_query_t *query);
 
+/// mkudns_query_set_type sets the query type to @p qtype (e.g. 15 for MX
+/// or 65 for HTTPS). For types other than A and AAAA, the query succeeds if
+/// the answer section contains at least one record of @p qtype, and you
+/// should use mkudns_response_get_record_at to read the records. Aborts if
+/// @p query is null or @p qtype is not within 0 and 65535.
+void mkudns_query_set_type(mkudns_query_t *query, int64_t qtype);
+
+/// mkudns_query_set_dual_stack queries for both A and AAAA. The two queries
+/// are sent back to back using a single socket and distinct query IDs, and
+/// their responses are collected concurrently. The response contains the
+/// addresses of both families (A first) and the events of both queries,
+/// each tagged with its query_type. The query succeeds if at least one
+/// family resolves before the timeout. Hedging is not used for dual stack
+/// queries. Aborts if the @p query is null.
+void mkudns_query_set_dual_stack(mkudns_query_t *query);
+
+/// mkudns_query_set_transport_tcp sends @p query over TCP rather than UDP.
+/// TCP connections are kept open and reused by later queries for the same
+/// server, and concurrent queries are pipelined over the same connection and
+/// may be answered out of order (see RFC 7766). A connection is closed after
+/// being idle for ten seconds. If a reused connection fails before we receive
+/// the response, we retry once using a new connection. The connect event has
+/// the `"mkudns.connect"` key and all events have a `transport` field. The
+/// TTL, hedge, and linger settings are not used over TCP, while dual stack
+/// queries are pipelined over one connection. Aborts if @p query is null.
+void mkudns_query_set_transport_tcp(mkudns_query_t *query);
+
+/// mkudns_query_set_edns_payload_size sets the UDP payload size that we
+/// advertise using an EDNS0 OPT record. The default is 1232 bytes, which
+/// avoids IP fragmentation on most paths, while 4096 allows larger responses
+/// to arrive in a single round trip. Values below 512 are raised to 512 and
+/// values above 65535 are clamped to 65535. Zero or a negative value disable
+/// EDNS0. We size the receive buffer accordingly and, if a response does not
+/// fit into it anyway, we handle it like a truncated response (see
+/// mkudns_query_perform_nonnull). Aborts if @p query is null.
+void mkudns_query_set_edns_payload_size(mkudns_query_t *query, int64_t size);
+
+/// mkudns_query_set_cache enables the in-process cache for @p query. When
+/// enabled, mkudns_query_perform_nonnull first looks for a cached answer to a
+/// query with the same server, name, and type and, if there is one, returns
+/// it without using the network. A cached response contains a single event,
+/// with the `"mkudns.cache_hit"` key and the `cache_age` and `cache_expires_in`
+/// fields in milliseconds, and no send and recv events, so that cached data
+/// cannot be mistaken for measurements. Its TTLs are decreased by the time
+/// spent in the cache and its RTT is -1. Otherwise, we store the answer, if
+/// good, for the smallest TTL of the answer records, clamped within the
+/// bounds set using mkudns_query_set_cache_min_ttl and
+/// mkudns_query_set_cache_max_ttl. We also cache negative answers, i.e.
+/// NXDOMAIN and NODATA, for the TTL of the SOA record in the authority section
+/// or its minimum field, whichever is smaller, clamped within the same bounds
+/// (see RFC 2308). Negative answers without a SOA are not cached. A cached
+/// negative response is not good, its rcode is the cached one, and its cache
+/// hit event has the `negative` field set. By default the cache is not used.
+/// Aborts if @p query is null.
+void mkudns_query_set_cache(mkudns_query_t *query);
+
+/// mkudns_query_set_cache_min_ttl sets the minimum number of seconds for
+/// which we cache an answer. The default is zero. Aborts if @p query is null.
+void mkudns_query_set_cache_min_ttl(mkudns_query_t *query, int64_t ttl);
+
+/// mkudns_query_set_cache_max_ttl sets the maximum number of seconds for
+/// which we cache an answer. The default is one day. Zero or a negative
+/// value prevent caching. Aborts if @p query is null.
+void mkudns_query_set_cache_max_ttl(mkudns_query_t *query, int64_t ttl);
+
+/// mkudns_cache_get_hits returns the number of positive cache hits since the
+/// program started.
+int64_t mkudns_cache_get_hits(void);
+
+/// mkudns_cache_get_negative_hits returns the number of negative cache hits
+/// since the program started.
+int64_t mkudns_cache_get_negative_hits(void);
+
+/// mkudns_cache_get_misses returns the number of cache lookups that did not
+/// find any cached answer since the program started.
+int64_t mkudns_cache_get_misses(void);
+
+/// mkudns_query_set_coalesce allows @p query to share the network exchange
+/// with identical concurrent queries. If an identical query (i.e. same
+/// server, name, type, and settings) that also allows this is in flight,
+/// mkudns_query_perform_nonnull waits for its response and returns a copy of
+/// it, instead of sending another query. The copy begins with an event with
+/// the `"mkudns.coalesced"` key and the `leader_query_id` field, followed by
+/// the events of the query in flight, which have its query ID. This reduces
+/// the load on the server during bursts of identical queries. By default
+/// queries are not coalesced. Aborts if @p query is null.
+void mkudns_query_set_coalesce(mkudns_query_t *query);
+
 /// mkudns_query_set_ttl allows to set the TTL. Values above 255 will
 /// be clamped down to 255. Negative values will disable setting a
-/// TTL (which is the default). Passing a null @p query causes this
-/// function to call abort.
+/// TTL (which is the default). When the server is an IPv6 address, this
+/// sets the hop limit instead, and the ICMPv6 time exceeded errors are
+/// captured like their ICMP counterparts. Passing a null @p query causes
+/// this function to call abort.
 void mkudns_query_set_ttl(mkudns_query_t *query, int64_t ttl);
 
 /// mkudns_query_set_timeout sets the query timeout.
 /// TODO(bassosimone): document
 void mkudns_query_set_timeout(mkudns_query_t *query, int64_t timeout);
 
+/// mkudns_query_set_linger sets the linger window in milliseconds. When the
+/// window is positive, after we have received the first response we keep
+/// receiving on the same socket for the duration of the window, to notice
+/// duplicate and late responses (e.g. an injected response followed by the
+/// legit one). This happens in a background thread, so the first response
+/// is returned immediately, and the late responses are appended to it as
+/// they arrive (see mkudns_response_get_late_event_at). By default there is
+/// no linger window. Aborts if @p query is null.
+void mkudns_query_set_linger(mkudns_query_t *query, int64_t linger);
+
 /// mkudns_query_set_server_address sets the server address. The address must be
 /// a valid IPv4 or IPv6 address. This function aborts if passed null pointers.
 void mkudns_query_set_server_address(
@@ -79,11 +182,62 @@ void mkudns_query_set_server_address(
 void mkudns_query_set_server_port(
     mkudns_query_t *query, const char *port);
 
+/// mkudns_query_set_hedge_server_address sets the address of the hedge
+/// server. When set, if the server does not answer within the hedge delay,
+/// we also send the query to the hedge server and the first valid response
+/// wins. The address must be a valid IPv4 or IPv6 address. By default no hedge
+/// server is configured. This function aborts if passed null pointers.
+void mkudns_query_set_hedge_server_address(
+    mkudns_query_t *query, const char *address);
+
+/// mkudns_query_set_hedge_server_port sets the hedge server port. The port
+/// must be a valid port number. This function aborts if passed null pointers.
+void mkudns_query_set_hedge_server_port(
+    mkudns_query_t *query, const char *port);
+
+/// mkudns_query_set_hedge_delay sets the number of milliseconds after which
+/// we send the query to the hedge server, if we have not received a response
+/// yet. A negative value (the default) means that we use the 95th percentile
+/// of the recently observed RTTs of the server, or half the timeout if we do
+/// not have enough samples. Aborts if @p query is null.
+void mkudns_query_set_hedge_delay(mkudns_query_t *query, int64_t delay);
+
 /// mkudns_query_perform_nonnull performs @p query. It aborts if @p query is a
 /// null pointer. It always return a valid pointer, that you own. You must use
-/// mkudns_response_good to check whether the query succeeded.
+/// mkudns_response_good to check whether the query succeeded. If we receive
+/// a truncated UDP response (i.e. with the TC bit set), we retry the query
+/// over TCP with the same server within the original timeout, recording a
+/// `"mkudns.tcp_fallback"` event followed by the TCP events.
 mkudns_response_t *mkudns_query_perform_nonnull(const mkudns_query_t *query);
 
+/// mkudns_query_add_fanout_server adds a server to the list of servers to
+/// which mkudns_query_perform_fanout_nonnull sends @p query. The address must
+/// be a valid IPv4 or IPv6 address and the port a valid port number. This
+/// function aborts if passed null pointers.
+void mkudns_query_add_fanout_server(
+    mkudns_query_t *query, const char *address, const char *port);
+
+/// mkudns_query_perform_fanout_nonnull sends @p query to all the servers
+/// added with mkudns_query_add_fanout_server at the same time, and waits
+/// until either all of them have answered or the timeout expires. It aborts
+/// if @p query is a null pointer. It always returns a valid pointer, that you
+/// own, containing a response per server, in the order in which servers were
+/// added. The hedge and dual stack settings of @p query are not used.
+mkudns_responses_t *mkudns_query_perform_fanout_nonnull(
+    const mkudns_query_t *query);
+
+/// mkudns_query_perform_traceroute_nonnull performs a parasitic traceroute
+/// towards the server of @p query. It sends @p query with all the TTLs from
+/// 1 to @p max_ttl (clamped to 255) at the same time, using a socket per TTL,
+/// and collects the ICMP time exceeded errors and the responses until all the
+/// TTLs have been answered or the timeout expires. It aborts if @p query is
+/// a null pointer. It always returns a valid pointer, that you own, with one
+/// response per TTL, in increasing TTL order. Use mkudns_response_get_rtt and
+/// mkudns_response_get_icmp_origin to know the RTT and address of each hop.
+/// The hedge, dual stack, and fan-out settings of @p query are not used.
+mkudns_responses_t *mkudns_query_perform_traceroute_nonnull(
+    const mkudns_query_t *query, int64_t max_ttl);
+
 /// mkudns_query_delete destroys @p query, which may be null.
 void mkudns_query_delete(mkudns_query_t *query);
 
@@ -108,6 +262,69 @@ size_t mkudns_response_get_addresses_size(const mkudns_response_t *response);
 const char *mkudns_response_get_address_at(
     const mkudns_response_t *response, size_t idx);
 
+/// mkudns_response_get_records_size returns the number of resource records
+/// in the answer, authority, and additional sections of the response (of
+/// both responses for dual stack queries). Aborts if @p response is null.
+size_t mkudns_response_get_records_size(const mkudns_response_t *response);
+
+/// mkudns_response_get_record_at returns the record at index @p idx
+/// serialised as a JSON object, like in the following example:
+///
+/// ```
+/// {"class":1,"data":{"exchange":"mx.example.com","preference":10},
+///  "name":"example.com","section":"answer","ttl":300,"type":15}
+/// ```
+///
+/// The `section` is one of `"answer"`, `"authority"`, and `"additional"`.
+/// The `data` fields depend on the type: `address` for A and AAAA; `target`
+/// for CNAME, NS, and PTR; `preference` and `exchange` for MX; `strings` for
+/// TXT; `mname`, `rname`, `serial`, `refresh`, `retry`, `expire`, and
+/// `minimum` for SOA; `priority`, `weight`, `port`, and `target` for SRV;
+/// `flags`, `tag`, and `value` for CAA; `priority`, `target`, and `params`
+/// for SVCB and HTTPS. Other records, and records that we cannot decode,
+/// have their base64 encoded data in `rdata`. Records are decoded the first
+/// time they are accessed. This function aborts if @p response is null or
+/// @p idx is out of bounds with respect to the records size. The returned
+/// string is owned by @p response and has the same lifecycle.
+const char *mkudns_response_get_record_at(
+    const mkudns_response_t *response, size_t idx);
+
+/// mkudns_response_get_address_ttl_at returns the TTL in seconds of the
+/// address at index @p idx, or -1 if unknown. When the address has been
+/// reached through CNAMEs, this is the smallest TTL along the chain. This
+/// function aborts if @p response is null or @p idx is out of bounds with
+/// respect to the addresses size.
+int64_t mkudns_response_get_address_ttl_at(
+    const mkudns_response_t *response, size_t idx);
+
+/// mkudns_response_get_rcode returns the response code (e.g. 0 for NOERROR,
+/// 2 for SERVFAIL, and 3 for NXDOMAIN), including the EDNS0 extended bits,
+/// or -1 if we did not receive any valid response. This allows to tell apart
+/// the reasons why a query is not good. For dual stack queries, this is the
+/// rcode of the A response, regardless of which response arrived first.
+/// Aborts if @p response is null.
+int64_t mkudns_response_get_rcode(const mkudns_response_t *response);
+
+/// mkudns_response_get_flags returns the 16 bit flags word of the response
+/// header (i.e. QR, opcode, AA, TC, RD, RA, AD, CD, and rcode), or -1 if we
+/// did not receive any valid response. For dual stack queries, these are the
+/// flags of the A response. Aborts if @p response is null.
+int64_t mkudns_response_get_flags(const mkudns_response_t *response);
+
+/// mkudns_response_get_cnames_size returns the length of the CNAME chain,
+/// which is zero when the query name is not an alias. For dual stack
+/// queries, this is the chain of the A response. Aborts if @p response is
+/// null.
+size_t mkudns_response_get_cnames_size(const mkudns_response_t *response);
+
+/// mkudns_response_get_cname_at returns the CNAME at index @p idx of the
+/// CNAME chain, which starts from the target of the query name, and ends
+/// with the canonical name. This function aborts if @p response is null or
+/// @p idx is out of bounds with respect to the CNAMEs size. The returned
+/// string is owned by @p response and has the same lifecycle.
+const char *mkudns_response_get_cname_at(
+    const mkudns_response_t *response, size_t idx);
+
 /// mkudns_response_get_send_event returns the send event serialised as
 /// a JSON object. In case of failure, this function will return an empty
 /// JSON object, i.e., `"{}"`. The returned string is owned by the @p
@@ -120,9 +337,270 @@ const char *mkudns_response_get_send_event(const mkudns_response_t *response);
 // TODO(bassosimone): document
 const char *mkudns_response_get_recv_event(const mkudns_response_t *response);
 
+/// mkudns_response_get_recv_ttl returns the IP TTL (or IPv6 hop limit) of
+/// the datagram containing the response, or -1 if it is not known. Since
+/// injectors are usually at a different distance than the real server, this
+/// value helps to spot injected responses. The TTL of each datagram is also
+/// saved in the `recv_ttl` field of recv events. Aborts if @p response is null.
+int64_t mkudns_response_get_recv_ttl(const mkudns_response_t *response);
+
+/// mkudns_response_get_rtt returns the milliseconds elapsed between sending
+/// the query and receiving either a response or an ICMP error, or -1 if we
+/// did not receive anything. Aborts if @p response is null.
+int64_t mkudns_response_get_rtt(const mkudns_response_t *response);
+
+/// mkudns_response_get_icmp_origin returns the address of the host that sent
+/// us an ICMP error (e.g. the hop at which the TTL expired) or an empty string
+/// if we did not receive any ICMP error. The returned string is owned by
+/// @p response. Aborts if @p response is null.
+const char *mkudns_response_get_icmp_origin(const mkudns_response_t *response);
+
+/// mkudns_response_get_events_size returns the number of events that occurred
+/// when performing the query, including the send and recv events of every
+/// attempt, in chronological order. Aborts if @p response is null.
+size_t mkudns_response_get_events_size(const mkudns_response_t *response);
+
+/// mkudns_response_get_event_at returns the event at index @p idx serialised
+/// as a JSON object. This function aborts if @p response is null or @p idx
+/// is out of bounds with respect to the events size. The returned string is
+/// owned by the @p response instance and has the same lifecycle.
+const char *mkudns_response_get_event_at(
+    const mkudns_response_t *response, size_t idx);
+
+/// mkudns_response_wait_linger blocks until the linger window of @p response
+/// is closed, if any. After this function returns, no more late events will
+/// be added to @p response. Aborts if @p response is null.
+void mkudns_response_wait_linger(const mkudns_response_t *response);
+
+/// mkudns_response_get_late_events_size returns the number of datagrams for
+/// the query ID that we received during the linger window so far. This number
+/// may grow until the linger window is closed. Aborts if @p response is null.
+size_t mkudns_response_get_late_events_size(
+    const mkudns_response_t *response);
+
+/// mkudns_response_get_late_event_at returns the recv event of the late
+/// datagram at index @p idx serialised as a JSON object. The event key is
+/// `"mkudns.late_recv"` and the event time is when we received it. Aborts if
+/// @p response is null or @p idx is out of bounds with respect to the late
+/// events size. The returned string is owned by @p response.
+const char *mkudns_response_get_late_event_at(
+    const mkudns_response_t *response, size_t idx);
+
 /// mkudns_response_delete destroys @p response, which may be null.
 void mkudns_response_delete(mkudns_response_t *response);
 
+/// mkudns_responses_get_size returns the number of responses, which is equal
+/// to the number of fan-out servers. Aborts if @p responses is null.
+size_t mkudns_responses_get_size(const mkudns_responses_t *responses);
+
+/// mkudns_responses_get_at returns the response at index @p idx. This
+/// function aborts if @p responses is null or @p idx is out of bounds with
+/// respect to the responses size. The returned response is owned by the
+/// @p responses instance and will be destroyed when it is destroyed.
+const mkudns_response_t *mkudns_responses_get_at(
+    const mkudns_responses_t *responses, size_t idx);
+
+/// mkudns_responses_delete destroys @p responses, which may be null.
+void mkudns_responses_delete(mkudns_responses_t *responses);
+
+/// mkudns_operation_t is a query performed without blocking, so that you can
+/// drive it from your own event loop.
+typedef struct mkudns_operation mkudns_operation_t;
+
+/// mkudns_query_start_nonnull starts performing a copy of @p query without
+/// blocking, i.e., it creates a socket and sends the query. Then, until
+/// mkudns_operation_done is true, wait for the socket returned by
+/// mkudns_operation_get_socket to become readable, or for the timeout
+/// returned by mkudns_operation_get_timeout to expire, and call either
+/// mkudns_operation_on_readable or mkudns_operation_on_timeout. Finally, use
+/// mkudns_operation_finish_nonnull to get the response. If the cache is
+/// enabled and contains an answer, the operation is done immediately. The
+/// operation uses UDP and ignores the TCP, dual stack, hedge, coalesce, and
+/// fan-out settings. A truncated response is not retried over TCP and is not
+/// good. It always returns a valid pointer, that you own. Aborts if @p query
+/// is null.
+mkudns_operation_t *mkudns_query_start_nonnull(const mkudns_query_t *query);
+
+/// mkudns_operation_get_socket returns the socket that @p operation is
+/// waiting on, or -1 if @p operation is done. Do not read from or close the
+/// socket. Aborts if @p operation is null.
+int64_t mkudns_operation_get_socket(const mkudns_operation_t *operation);
+
+/// mkudns_operation_get_timeout returns the number of milliseconds until the
+/// deadline of @p operation, which is zero if the deadline has passed, and
+/// negative if there is no deadline (i.e. the query timeout is negative) or
+/// @p operation is done. Aborts if @p operation is null.
+int64_t mkudns_operation_get_timeout(const mkudns_operation_t *operation);
+
+/// mkudns_operation_on_readable receives the response of @p operation and,
+/// unless the socket was not actually readable, completes it. Does nothing if
+/// @p operation is done. Aborts if @p operation is null.
+void mkudns_operation_on_readable(mkudns_operation_t *operation);
+
+/// mkudns_operation_on_timeout completes @p operation with a timeout error.
+/// Does nothing if @p operation is done. Aborts if @p operation is null.
+void mkudns_operation_on_timeout(mkudns_operation_t *operation);
+
+/// mkudns_operation_done returns whether @p operation is complete. Aborts if
+/// @p operation is null.
+int64_t mkudns_operation_done(const mkudns_operation_t *operation);
+
+/// mkudns_operation_finish_nonnull returns the response of @p operation,
+/// that you own. If @p operation is not done, we cancel it, adding to the
+/// response a `"mkudns.cancel"` event with the `"operation_canceled"` error.
+/// Aborts if @p operation is null or you already called this function.
+mkudns_response_t *mkudns_operation_finish_nonnull(
+    mkudns_operation_t *operation);
+
+/// mkudns_operation_delete destroys @p operation, which may be null.
+void mkudns_operation_delete(mkudns_operation_t *operation);
+
+/// mkudns_engine_t is an engine that performs many UDP queries at the same
+/// time from a single thread, using a few shared sockets, or from several
+/// threads if it is sharded. An engine is not thread safe: only use it from
+/// the thread that runs it, except for mkudns_engine_post and
+/// mkudns_engine_cancel_async.
+typedef struct mkudns_engine mkudns_engine_t;
+
+/// mkudns_engine_new_nonnull creates an engine using @p backend, which is one
+/// of `"io_uring"`, `"epoll"`, `"poll"`, and `"auto"`. The io_uring backend
+/// submits the sends and a multishot receive per socket with registered
+/// sockets and a ring of provided buffers, so that many queries only need a
+/// few io_uring_enter calls. It requires Linux 6.0 or later. When the
+/// requested backend is not available, and with `"auto"`, we use the best
+/// available backend, i.e., io_uring, then epoll, and finally poll. Use
+/// mkudns_engine_get_backend to know which backend is in use. This function
+/// never returns null and aborts if @p backend is null or unknown.
+mkudns_engine_t *mkudns_engine_new_nonnull(const char *backend);
+
+/// mkudns_engine_new_sharded_nonnull creates an engine that performs its
+/// queries using @p shards engines, each of which runs in its own thread
+/// with its own sockets, query IDs, and timers, so that the engine scales
+/// with the number of cores. Zero @p shards means one shard per core. We
+/// distribute the submitted queries to the shards round robin, except for
+/// the shards we skip when a limit is smaller than their number (see
+/// mkudns_engine_set_max_qps), and each mkudns_engine_run_nonnull runs all
+/// the shards at the same time. You cannot use
+/// mkudns_engine_submit_callback, mkudns_engine_cancel, and
+/// mkudns_engine_cancel_async with a sharded engine. This function never
+/// returns null and aborts if @p backend is null or unknown (see
+/// mkudns_engine_new_nonnull).
+mkudns_engine_t *mkudns_engine_new_sharded_nonnull(
+    const char *backend, size_t shards);
+
+/// mkudns_engine_get_shards returns the number of shards of @p engine, which
+/// is zero unless you created it using mkudns_engine_new_sharded_nonnull.
+/// Aborts if @p engine is null.
+size_t mkudns_engine_get_shards(const mkudns_engine_t *engine);
+
+/// mkudns_engine_set_workers makes @p engine parse the responses and create
+/// the recv events using a pool of @p workers threads, rather than in the
+/// threads performing the I/O, which are then more responsive. The workers
+/// steal work from each other, so that the load is balanced even if some
+/// shards receive many more responses than others. All the shards of a
+/// sharded engine share the pool. Zero @p workers means one per core. The
+/// responses to the queries submitted with mkudns_engine_submit_callback
+/// are still processed by the engine thread. Do not call this function
+/// while the engine is running. Aborts if @p engine is null.
+void mkudns_engine_set_workers(mkudns_engine_t *engine, size_t workers);
+
+/// mkudns_engine_set_max_qps limits the rate at which @p engine sends
+/// queries to @p qps queries per second, using a token bucket holding 10 ms
+/// worth of queries, so that the engine does not send bursts. The queries
+/// exceeding the rate wait in the engine. The time that each query waited
+/// between its submission and its send is the `scheduler_delay` of its send
+/// event, in milliseconds, which is not part of its RTT. Zero or negative
+/// @p qps means no limit, which is the default. A sharded engine divides the
+/// rate among its shards, so that their rates add up to @p qps. When @p qps
+/// is smaller than the number of shards, the engine only routes queries to
+/// @p qps shards, each sending one query per second. Do not call this
+/// function while the engine is running. Aborts if @p engine is null.
+void mkudns_engine_set_max_qps(mkudns_engine_t *engine, int64_t qps);
+
+/// mkudns_engine_set_server_max_qps is like mkudns_engine_set_max_qps, but
+/// limits the rate of the queries sent to each server, i.e., to each server
+/// address and port. The queries to a server that exceeds its rate wait
+/// without delaying the queries to the other servers.
+void mkudns_engine_set_server_max_qps(mkudns_engine_t *engine, int64_t qps);
+
+/// mkudns_engine_set_server_max_inflight limits to @p max the number of
+/// queries that @p engine has in flight to each server, i.e., that it sent
+/// and that are not complete. The other queries to the server wait without
+/// delaying the queries to the other servers. Zero means no limit, which is
+/// the default. A sharded engine divides the limit among its shards like
+/// mkudns_engine_set_max_qps divides the rate, using at most @p max shards.
+/// Do not call this function while the engine is running. Aborts if
+/// @p engine is null.
+void mkudns_engine_set_server_max_inflight(
+    mkudns_engine_t *engine, size_t max);
+
+/// mkudns_engine_set_adaptive_inflight makes @p engine adapt the number of
+/// queries in flight to each server to the loss it observes. Each server
+/// starts with a window of 10 queries in flight, which grows by one query
+/// whenever a full window of queries gets a response, and is halved when a
+/// query times out or the server refuses it, at most once per window. The
+/// window never exceeds mkudns_engine_set_server_max_inflight, if set. Do not
+/// call this function while the engine is running. Aborts if @p engine is
+/// null.
+void mkudns_engine_set_adaptive_inflight(mkudns_engine_t *engine);
+
+/// mkudns_engine_get_backend returns the name of the backend used by
+/// @p engine. The returned string is static. Aborts if @p engine is null.
+const char *mkudns_engine_get_backend(const mkudns_engine_t *engine);
+
+/// mkudns_engine_submit adds a copy of @p query to the queries that @p engine
+/// will perform. Aborts if passed null pointers.
+void mkudns_engine_submit(mkudns_engine_t *engine, const mkudns_query_t *query);
+
+/// mkudns_engine_run_nonnull performs all the queries submitted to @p engine
+/// since the previous run at the same time, within the configured limits,
+/// and waits until each of them has been answered or has timed out. It
+/// always returns a valid pointer, that you own, with a response per query,
+/// in submission order. Each response contains the send and recv events of
+/// its query, whose ID is chosen by the engine. The engine uses UDP and
+/// ignores the TCP, dual stack, hedge, linger, cache, coalesce, TTL, and
+/// fan-out settings. A truncated response, or a response larger than 4096
+/// bytes, is not retried over TCP and is not good. This function also
+/// performs the queries submitted with mkudns_engine_submit_callback,
+/// including the ones submitted by callbacks while it runs, but does not
+/// return their responses. Aborts if @p engine is null.
+mkudns_responses_t *mkudns_engine_run_nonnull(mkudns_engine_t *engine);
+
+/// mkudns_completion_t is a query posted to an engine that is complete,
+/// which you obtain using mkudns_engine_reap.
+typedef struct mkudns_completion {
+  /// response is the response to the query, that you own.
+  mkudns_response_t *response;
+
+  /// tag is the tag passed to mkudns_engine_post.
+  uint64_t tag;
+} mkudns_completion_t;
+
+/// mkudns_engine_post adds a copy of @p query, identified by @p tag, to the
+/// queries that @p engine performs in the background, and returns without
+/// waiting. Many threads may post at the same time: posting does not take
+/// any lock, and costs an allocation and a few atomic operations. The first
+/// post starts the engine threads, i.e., a thread for a plain engine, or
+/// the shard threads of a sharded engine, which run until you delete the
+/// engine. Use mkudns_engine_reap to obtain the responses. After the first
+/// post, you cannot submit, run, or set the workers of @p engine. Aborts if
+/// passed null pointers, or if @p engine has queries that did not run.
+void mkudns_engine_post(mkudns_engine_t *engine, const mkudns_query_t *query,
+                        uint64_t tag);
+
+/// mkudns_engine_reap moves up to @p max complete posted queries of
+/// @p engine into @p out, and returns how many it moved. If no posted query
+/// is complete, it waits until one is, unless all the posted queries have
+/// already been reaped, in which case it returns zero. Only one thread at a
+/// time may reap. Aborts if @p engine is null, or if @p out is null and
+/// @p max is not zero.
+size_t mkudns_engine_reap(mkudns_engine_t *engine, mkudns_completion_t *out,
+                          size_t max);
+
+/// mkudns_engine_delete destroys @p engine, which may be null, stopping the
+/// engine threads. We discard the posted queries that were not reaped.
+void mkudns_engine_delete(mkudns_engine_t *engine);
+
 #ifdef __cplusplus
 }  // extern "C"
 
@@ -150,6 +628,226 @@ struct mkudns_response_deleter {
 using mkudns_response_uptr = std::unique_ptr<mkudns_response_t,
                                              mkudns_response_deleter>;
 
+/// mkudns_responses_deleter is a deleter for mkudns_responses_t.
+struct mkudns_responses_deleter {
+  void operator()(mkudns_responses_t *responses) {
+    mkudns_responses_delete(responses);
+  }
+};
+
+/// mkudns_responses_uptr is a unique pointer to mkudns_responses_t.
+using mkudns_responses_uptr = std::unique_ptr<mkudns_responses_t,
+                                              mkudns_responses_deleter>;
+
+/// mkudns_operation_deleter is a deleter for mkudns_operation_t.
+struct mkudns_operation_deleter {
+  void operator()(mkudns_operation_t *operation) {
+    mkudns_operation_delete(operation);
+  }
+};
+
+/// mkudns_operation_uptr is a unique pointer to mkudns_operation_t.
+using mkudns_operation_uptr = std::unique_ptr<mkudns_operation_t,
+                                              mkudns_operation_deleter>;
+
+/// mkudns_engine_deleter is a deleter for mkudns_engine_t.
+struct mkudns_engine_deleter {
+  void operator()(mkudns_engine_t *engine) {
+    mkudns_engine_delete(engine);
+  }
+};
+
+/// mkudns_engine_uptr is a unique pointer to mkudns_engine_t.
+using mkudns_engine_uptr = std::unique_ptr<mkudns_engine_t,
+                                           mkudns_engine_deleter>;
+
+#include <chrono>
+#include <functional>
+
+/// mkudns_engine_callback is a callback receiving the response to a query.
+using mkudns_engine_callback = std::function<void(mkudns_response_uptr)>;
+
+/// mkudns_engine_submit_callback is like mkudns_engine_submit, except that
+/// mkudns_engine_run_nonnull passes the response to @p callback as soon as
+/// the query completes, rather than returning it. The callback may submit
+/// more queries. If the query does not complete before @p deadline, which
+/// may come before its timeout, it times out. Use time_point::max() for no
+/// deadline. Returns the serial number of the query, that you can pass to
+/// mkudns_engine_cancel. Aborts if passed null pointers, an empty callback,
+/// or a sharded engine.
+uint64_t mkudns_engine_submit_callback(
+    mkudns_engine_t *engine, const mkudns_query_t *query,
+    std::chrono::steady_clock::time_point deadline,
+    mkudns_engine_callback callback);
+
+/// mkudns_engine_cancel completes the query of @p engine whose serial number
+/// is @p serial, adding a `"mkudns.cancel"` event with the
+/// `"operation_canceled"` error to its response. Does nothing if there is no
+/// such query or it has already completed. Aborts if @p engine is null or
+/// sharded.
+void mkudns_engine_cancel(mkudns_engine_t *engine, uint64_t serial);
+
+/// mkudns_engine_cancel_async is like mkudns_engine_cancel, except that you
+/// may call it from any thread until you delete @p engine. The engine thread
+/// cancels the query while running mkudns_engine_run_nonnull, waking up if
+/// it is waiting for I/O. Aborts if @p engine is null or sharded.
+void mkudns_engine_cancel_async(mkudns_engine_t *engine, uint64_t serial);
+
+#if defined __cpp_impl_coroutine && defined __has_include
+#if __has_include(<coroutine>) && __has_include(<stop_token>)
+#define MKUDNS_HAVE_COROUTINES
+#endif
+#endif
+
+// MKUDNS_HAVE_COROUTINES tells whether mkudns::resolve is available, which
+// requires compiling with C++20 coroutines.
+#ifdef MKUDNS_HAVE_COROUTINES
+#include <coroutine>
+#include <optional>
+#include <stop_token>
+
+namespace mkudns {
+
+/// resolve_awaitable is the awaitable returned by mkudns::resolve.
+class resolve_awaitable {
+ public:
+  /// resolve_awaitable creates an awaitable that, when awaited, submits
+  /// @p query to @p engine with @p deadline, and cancels it on @p token.
+  resolve_awaitable(mkudns_engine_t *engine, const mkudns_query_t *query,
+                    std::chrono::steady_clock::time_point deadline,
+                    std::stop_token token) noexcept
+      : deadline_{deadline}, engine_{engine}, query_{query},
+        token_{std::move(token)} {}
+
+  /// resolve_awaitable is not copyable, since the engine refers to it.
+  resolve_awaitable(const resolve_awaitable &) = delete;
+
+  /// operator= is deleted, since the engine refers to the awaitable.
+  resolve_awaitable &operator=(const resolve_awaitable &) = delete;
+
+  /// ~resolve_awaitable cancels the query if the awaiting coroutine is
+  /// destroyed while suspended, so that the engine does not resume it.
+  ~resolve_awaitable() {
+    if (!suspended_) return;
+    *alive_ = false;
+    stop_callback_.reset();
+    mkudns_engine_cancel(engine_, serial_);
+  }
+
+  /// await_ready returns false because we always need to suspend.
+  bool await_ready() const noexcept { return false; }
+
+  /// await_suspend submits the query, which resumes @p handle once done.
+  void await_suspend(std::coroutine_handle<> handle) {
+    alive_ = std::make_shared<bool>(true);
+    serial_ = mkudns_engine_submit_callback(
+        engine_, query_, deadline_,
+        [this, alive = alive_, handle](mkudns_response_uptr response) {
+          if (!*alive) return;  // the coroutine has been destroyed
+          suspended_ = false;
+          stop_callback_.reset();
+          response_ = std::move(response);
+          handle.resume();  // may destroy this
+        });
+    suspended_ = true;
+    if (token_.stop_possible()) {
+      // If stop was already requested, this cancels the query immediately,
+      // and the engine will resume us from mkudns_engine_run_nonnull.
+      stop_callback_.emplace(token_, canceler{engine_, serial_});
+    }
+  }
+
+  /// await_resume returns the response.
+  mkudns_response_uptr await_resume() noexcept {
+    return std::move(response_);
+  }
+
+ private:
+  // canceler cancels a query when stop is requested.
+  struct canceler {
+    // engine is the engine performing the query.
+    mkudns_engine_t *engine;
+
+    // serial is the serial number of the query.
+    uint64_t serial;
+
+    void operator()() const noexcept {
+      mkudns_engine_cancel_async(engine, serial);
+    }
+  };
+
+  // alive_ is false once the awaitable is destroyed, which tells the engine
+  // callback, that owns a copy, not to touch the awaitable.
+  std::shared_ptr<bool> alive_;
+
+  // deadline_ is the query deadline.
+  std::chrono::steady_clock::time_point deadline_;
+
+  // engine_ is the engine performing the query.
+  mkudns_engine_t *engine_;
+
+  // query_ is the query to perform.
+  const mkudns_query_t *query_;
+
+  // response_ is the response, once the query is complete.
+  mkudns_response_uptr response_;
+
+  // serial_ is the serial number of the query, once submitted.
+  uint64_t serial_ = 0;
+
+  // stop_callback_ cancels the query when stop is requested.
+  std::optional<std::stop_callback<canceler>> stop_callback_;
+
+  // suspended_ indicates that the coroutine waits for the query.
+  bool suspended_ = false;
+
+  // token_ is the token that allows to cancel the query.
+  std::stop_token token_;
+};
+
+/// resolve returns an awaitable that performs @p query using @p engine and
+/// resumes the awaiting coroutine with the response when the query is
+/// complete, it reaches @p deadline, or it is canceled through @p token. A
+/// canceled query's response contains a `"mkudns.cancel"` event. The engine
+/// copies @p query when the coroutine suspends. You drive the coroutines by
+/// calling mkudns_engine_run_nonnull, which returns when all of them are
+/// suspended on something else or done. For example:
+///
+/// ```
+/// task lookup(mkudns_engine_t *engine, const mkudns_query_t *query) {
+///   mkudns_response_uptr response = co_await mkudns::resolve(
+///       engine, query, std::chrono::steady_clock::now() +
+///       std::chrono::seconds{2});
+///   if (mkudns_response_good(response.get())) {
+///     // ...
+///   }
+/// }
+/// ```
+///
+/// You may request stop on @p token from any thread, and the engine cancels
+/// the query as soon as it runs. Destroying a coroutine suspended in resolve
+/// cancels its query: do that on the thread that runs the engine, before
+/// deleting the engine. Deleting the engine while coroutines are suspended
+/// in resolve leaks them, since nobody resumes them.
+inline resolve_awaitable resolve(
+    mkudns_engine_t *engine, const mkudns_query_t *query,
+    std::chrono::steady_clock::time_point deadline,
+    std::stop_token token = {}) noexcept {
+  return resolve_awaitable{engine, query, deadline, std::move(token)};
+}
+
+/// resolve is like the previous overload without a deadline.
+inline resolve_awaitable resolve(
+    mkudns_engine_t *engine, const mkudns_query_t *query,
+    std::stop_token token = {}) noexcept {
+  return resolve_awaitable{engine, query,
+                           std::chrono::steady_clock::time_point::max(),
+                           std::move(token)};
+}
+
+}  // namespace mkudns
+#endif  // MKUDNS_HAVE_COROUTINES
+
 // MKUDNS_INLINE_IMPL controls whether to inline the implementation.
 #ifdef MKUDNS_INLINE_IMPL
 
@@ -159,15 +857,46 @@ using mkudns_response_uptr = std::unique_ptr<mkudns_response_t,
 #else
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// MKUDNS_HAVE_IO_URING indicates that we can build the io_uring backend,
+// which requires the kernel headers of Linux 6.0 or later.
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined IORING_RECV_MULTISHOT && defined __NR_io_uring_setup
+#define MKUDNS_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -245,14 +974,132 @@ static void mkudns_ids_put(uint16_t id) {
   ids->ids.erase(id);
 }
 
+// mkudns_rtts
+// -----------
+
+// mkudns_rtts_max_samples is the number of RTT samples we keep per server.
+constexpr size_t mkudns_rtts_max_samples = 128;
+
+// mkudns_rtts_min_samples is the number of RTT samples we need before we
+// consider the percentiles of a server to be meaningful.
+constexpr size_t mkudns_rtts_min_samples = 16;
+
+// mkudns_rtts keeps track of the recently observed RTTs of each server.
+struct mkudns_rtts {
+  // samples maps a server endpoint to its most recent RTT samples.
+  std::map<std::string, std::deque<int64_t>> samples;
+
+  // mutex protects samples against concurrent accesses.
+  std::mutex mutex;
+};
+
+// mkudns_rtts_singleton_nonnull returns the RTTs singleton. This function
+// will never return a null pointer and will abort if allocations fail.
+static mkudns_rtts *mkudns_rtts_singleton_nonnull() {
+  static std::mutex mutex;
+  static std::unique_ptr<mkudns_rtts> singleton = nullptr;
+  std::unique_lock<std::mutex> _{mutex};
+  if (singleton == nullptr) singleton.reset(new mkudns_rtts);
+  return singleton.get();
+}
+
+// mkudns_rtts_key returns the key identifying the @p address, @p port server.
+static std::string mkudns_rtts_key(
+    const std::string &address, const std::string &port) {
+  return address + " " + port;
+}
+
+// mkudns_rtts_add records that the @p address, @p port server has answered
+// a query after @p rtt milliseconds.
+static void mkudns_rtts_add(
+    const std::string &address, const std::string &port, int64_t rtt) {
+  mkudns_rtts *rtts = mkudns_rtts_singleton_nonnull();
+  if (rtts == nullptr) MKUDNS_ABORT();
+  std::unique_lock<std::mutex> _{rtts->mutex};
+  std::deque<int64_t> &samples = rtts->samples[mkudns_rtts_key(address, port)];
+  samples.push_back(rtt);
+  if (samples.size() > mkudns_rtts_max_samples) samples.pop_front();
+}
+
+// mkudns_rtts_add_samples is like mkudns_rtts_add but records all the
+// @p samples of the server identified by @p key at once.
+static void mkudns_rtts_add_samples(
+    const std::string &key, const std::vector<int64_t> &samples) {
+  mkudns_rtts *rtts = mkudns_rtts_singleton_nonnull();
+  if (rtts == nullptr) MKUDNS_ABORT();
+  auto first = samples.begin();
+  if (samples.size() > mkudns_rtts_max_samples) {
+    first = samples.end() - mkudns_rtts_max_samples;
+  }
+  std::unique_lock<std::mutex> _{rtts->mutex};
+  std::deque<int64_t> &recent = rtts->samples[key];
+  recent.insert(recent.end(), first, samples.end());
+  while (recent.size() > mkudns_rtts_max_samples) recent.pop_front();
+}
+
+// mkudns_rtts_p95 returns the 95th percentile of the RTTs recently observed
+// for the @p address, @p port server, or -1 if we don't have enough samples.
+static int64_t mkudns_rtts_p95(
+    const std::string &address, const std::string &port) {
+  mkudns_rtts *rtts = mkudns_rtts_singleton_nonnull();
+  if (rtts == nullptr) MKUDNS_ABORT();
+  std::vector<int64_t> samples;
+  {
+    std::unique_lock<std::mutex> _{rtts->mutex};
+    auto it = rtts->samples.find(mkudns_rtts_key(address, port));
+    if (it == rtts->samples.end()) return -1;
+    samples.assign(it->second.begin(), it->second.end());
+  }
+  if (samples.size() < mkudns_rtts_min_samples) return -1;
+  auto nth = samples.begin() + static_cast<std::ptrdiff_t>(
+      (samples.size() * 95) / 100);
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
 // mkudns_query w/o perform
 // ------------------------
 
 // mkudns_query is the private data bound to mkudns_query_t.
 struct mkudns_query {
+  // cache indicates whether to use the cache.
+  bool cache = false;
+
+  // cache_max_ttl is the maximum caching time in seconds.
+  int64_t cache_max_ttl = 86400;
+
+  // cache_min_ttl is the minimum caching time in seconds.
+  int64_t cache_min_ttl = 0;
+
+  // coalesce indicates whether to coalesce identical concurrent queries.
+  bool coalesce = false;
+
   // dnsclass is the class of the query.
   int dnsclass = ns_c_in;
 
+  // dual_stack indicates whether to query for both A and AAAA.
+  bool dual_stack = false;
+
+  // edns_payload_size is the EDNS0 UDP payload size. Zero disables EDNS0.
+  int64_t edns_payload_size = 1232;
+
+  // fanout_servers contains the address and port of the fan-out servers.
+  std::vector<std::pair<std::string, std::string>> fanout_servers;
+
+  // hedge_delay is the delay in milliseconds after which we also send the
+  // query to the hedge server. When negative, we use the server's p95 RTT.
+  int64_t hedge_delay = -1;
+
+  // hedge_server_address is the hedge DNS server address. When empty, we
+  // don't send the query to any hedge server.
+  std::string hedge_server_address;
+
+  // hedge_server_port is the hedge DNS server port.
+  std::string hedge_server_port = "53";
+
+  // linger is the linger window in milliseconds.
+  int64_t linger = 0;
+
   // id is the ID of the query.
   uint16_t id = mkudns_ids_get();
 
@@ -265,6 +1112,9 @@ struct mkudns_query {
   // server_port is the DNS server port.
   std::string server_port = "53";
 
+  // tcp indicates whether to use TCP rather than UDP.
+  bool tcp = false;
+
   // timeout is the timeout in milliseconds.
   int64_t timeout = 3000;
 
@@ -287,6 +1137,47 @@ void mkudns_query_set_type_AAAA(mkudns_query_t *query) {
   query->type = ns_t_aaaa;
 }
 
+void mkudns_query_set_type(mkudns_query_t *query, int64_t qtype) {
+  if (query == nullptr || qtype < 0 || qtype > UINT16_MAX) MKUDNS_ABORT();
+  query->type = static_cast<int>(qtype);
+}
+
+void mkudns_query_set_dual_stack(mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->dual_stack = true;
+}
+
+void mkudns_query_set_transport_tcp(mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->tcp = true;
+}
+
+void mkudns_query_set_edns_payload_size(mkudns_query_t *query, int64_t size) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->edns_payload_size = (size <= 0) ? 0 : (size < 512) ? 512
+                           : (size > UINT16_MAX) ? UINT16_MAX : size;
+}
+
+void mkudns_query_set_cache(mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->cache = true;
+}
+
+void mkudns_query_set_cache_min_ttl(mkudns_query_t *query, int64_t ttl) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->cache_min_ttl = ttl;
+}
+
+void mkudns_query_set_cache_max_ttl(mkudns_query_t *query, int64_t ttl) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->cache_max_ttl = ttl;
+}
+
+void mkudns_query_set_coalesce(mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->coalesce = true;
+}
+
 void mkudns_query_set_ttl(mkudns_query_t *query, int64_t ttl) {
   if (query == nullptr) MKUDNS_ABORT();
   query->ttl = ttl;
@@ -297,6 +1188,11 @@ void mkudns_query_set_timeout(mkudns_query_t *query, int64_t timeout) {
   query->timeout = timeout;
 }
 
+void mkudns_query_set_linger(mkudns_query_t *query, int64_t linger) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->linger = linger;
+}
+
 void mkudns_query_set_server_address(
     mkudns_query_t *query, const char *address) {
   if (query == nullptr || address == nullptr) MKUDNS_ABORT();
@@ -309,6 +1205,31 @@ void mkudns_query_set_server_port(
   query->server_port = port;
 }
 
+void mkudns_query_set_hedge_server_address(
+    mkudns_query_t *query, const char *address) {
+  if (query == nullptr || address == nullptr) MKUDNS_ABORT();
+  query->hedge_server_address = address;
+}
+
+void mkudns_query_set_hedge_server_port(
+    mkudns_query_t *query, const char *port) {
+  if (query == nullptr || port == nullptr) MKUDNS_ABORT();
+  query->hedge_server_port = port;
+}
+
+void mkudns_query_set_hedge_delay(mkudns_query_t *query, int64_t delay) {
+  if (query == nullptr) MKUDNS_ABORT();
+  query->hedge_delay = delay;
+}
+
+void mkudns_query_add_fanout_server(
+    mkudns_query_t *query, const char *address, const char *port) {
+  if (query == nullptr || address == nullptr || port == nullptr) {
+    MKUDNS_ABORT();
+  }
+  query->fanout_servers.emplace_back(address, port);
+}
+
 void mkudns_query_delete(mkudns_query_t *query) {
   if (query != nullptr) {
     mkudns_ids_put(query->id);
@@ -316,53 +1237,585 @@ void mkudns_query_delete(mkudns_query_t *query) {
   }
 }
 
-// mkudns_response
-// ---------------
-
-// mkudns_response is the private data of mkudns_response_t.
-struct mkudns_response {
-  // addresses contains the resolved addresses.
-  std::vector<std::string> addresses;
-
-  // events contains the events occurred when performing the query.
-  std::vector<std::string> events;
-
-  // cname contains the response CNAME.
-  std::string cname;
-
-  // good indicates whether the query succeeded.
-  int64_t good = false;
-
-  // recv_event is the receive event.
-  std::string recv_event;
+// mkudns_wire
+// -----------
 
-  // send_event is the send event.
-  std::string send_event;
-};
+// mkudns_wire_max_pointers is the maximum number of compression pointers
+// that we follow when reading a name, to stop pointer loops.
+constexpr int mkudns_wire_max_pointers = 64;
 
-int64_t mkudns_response_good(const mkudns_response_t *response) {
-  if (response == nullptr) MKUDNS_ABORT();
-  return response->good;
+// mkudns_wire_u8 reads a byte at @p *off from the message @p data, which
+// is @p size bytes long, stores it into @p out, and advances @p *off. The
+// mkudns_wire functions never allocate and return false if the message is
+// too short or otherwise invalid.
+static bool mkudns_wire_u8(
+    const uint8_t *data, size_t size, size_t *off, uint8_t *out) {
+  if (data == nullptr || off == nullptr || out == nullptr) MKUDNS_ABORT();
+  if (*off >= size) return false;
+  *out = data[(*off)++];
+  return true;
 }
 
-const char *mkudns_response_get_cname(const mkudns_response_t *response) {
-  if (response == nullptr) MKUDNS_ABORT();
-  return response->cname.c_str();
+// mkudns_wire_u16 is like mkudns_wire_u8 but reads a 16 bit integer.
+static bool mkudns_wire_u16(
+    const uint8_t *data, size_t size, size_t *off, uint16_t *out) {
+  if (data == nullptr || off == nullptr || out == nullptr) MKUDNS_ABORT();
+  if (*off > size || size - *off < 2) return false;
+  *out = static_cast<uint16_t>((data[*off] << 8) | data[*off + 1]);
+  *off += 2;
+  return true;
 }
 
-size_t mkudns_response_get_addresses_size(const mkudns_response_t *response) {
-  if (response == nullptr) MKUDNS_ABORT();
-  return response->addresses.size();
+// mkudns_wire_u32 is like mkudns_wire_u8 but reads a 32 bit integer.
+static bool mkudns_wire_u32(
+    const uint8_t *data, size_t size, size_t *off, uint32_t *out) {
+  if (data == nullptr || off == nullptr || out == nullptr) MKUDNS_ABORT();
+  if (*off > size || size - *off < 4) return false;
+  *out = (static_cast<uint32_t>(data[*off]) << 24) |
+         (static_cast<uint32_t>(data[*off + 1]) << 16) |
+         (static_cast<uint32_t>(data[*off + 2]) << 8) |
+         static_cast<uint32_t>(data[*off + 3]);
+  *off += 4;
+  return true;
 }
 
-const char *mkudns_response_get_address_at(
-    const mkudns_response_t *response, size_t idx) {
-  if (response == nullptr || idx >= response->addresses.size()) MKUDNS_ABORT();
-  return response->addresses[idx].c_str();
+// mkudns_wire_escape appends @p count bytes at @p base to @p out using the
+// master file format, where @p special are the characters to escape.
+static void mkudns_wire_escape(
+    const uint8_t *base, size_t count, const char *special, std::string *out) {
+  if (base == nullptr || special == nullptr || out == nullptr) MKUDNS_ABORT();
+  for (size_t i = 0; i < count; ++i) {
+    uint8_t ch = base[i];
+    if (ch < 0x20 || ch > 0x7e) {
+      char buf[5];
+      snprintf(buf, sizeof(buf), "\\%03u", static_cast<unsigned>(ch));
+      *out += buf;
+      continue;
+    }
+    if (strchr(special, ch) != nullptr) *out += '\\';
+    *out += static_cast<char>(ch);
+  }
 }
 
-const char *mkudns_response_get_send_event(const mkudns_response_t *response) {
-  if (response == nullptr) MKUDNS_ABORT();
+// mkudns_wire_name reads the possibly compressed name at @p *off, advances
+// @p *off past it, and appends it to @p name in presentation format without
+// the trailing dot (the root is `"."`). When @p name is null, we just skip
+// the name, without allocating.
+static bool mkudns_wire_name(
+    const uint8_t *data, size_t size, size_t *off, std::string *name) {
+  if (data == nullptr || off == nullptr) MKUDNS_ABORT();
+  size_t cur = *off;
+  bool jumped = false;
+  int pointers = 0;
+  size_t length = 0;
+  for (;;) {
+    uint8_t len = 0;
+    if (!mkudns_wire_u8(data, size, &cur, &len)) return false;
+    if ((len & 0xc0) == 0xc0) {
+      uint8_t low = 0;
+      if (!mkudns_wire_u8(data, size, &cur, &low)) return false;
+      if (++pointers > mkudns_wire_max_pointers) return false;
+      if (!jumped) *off = cur;
+      jumped = true;
+      cur = (static_cast<size_t>(len & 0x3f) << 8) | low;
+      continue;
+    }
+    if ((len & 0xc0) != 0) return false;  // reserved label types
+    if (len == 0) break;
+    if (cur > size || size - cur < len) return false;
+    length += len + 1u;
+    if (length > 255) return false;
+    if (name != nullptr) {
+      mkudns_wire_escape(data + cur, len, ".\\\"()@;$", name);
+      *name += '.';
+    }
+    cur += len;
+  }
+  if (!jumped) *off = cur;
+  if (name != nullptr) {
+    if (name->empty()) {
+      *name = ".";
+    } else if (name->back() == '.') {
+      name->pop_back();
+    }
+  }
+  return true;
+}
+
+// mkudns_section identifies a section of a DNS message.
+enum class mkudns_section { answer = 1, authority = 2, additional = 3 };
+
+// mkudns_rr is a resource record within a DNS message. It only contains
+// offsets and fixed size fields, so that walking a message does not
+// allocate, and the record data is decoded only when needed.
+struct mkudns_rr {
+  // dnsclass is the record class.
+  uint16_t dnsclass = 0;
+
+  // message is the index of the message containing the record.
+  size_t message = 0;
+
+  // name is the offset of the record owner name.
+  size_t name = 0;
+
+  // rdata is the offset of the record data.
+  size_t rdata = 0;
+
+  // rdlength is the length of the record data.
+  uint16_t rdlength = 0;
+
+  // section is the section containing the record.
+  mkudns_section section = mkudns_section::answer;
+
+  // ttl is the record TTL in seconds.
+  uint32_t ttl = 0;
+
+  // type is the record type.
+  uint16_t type = 0;
+};
+
+// mkudns_wire_walk walks the DNS message @p data, which is @p size bytes
+// long, and calls @p visit for each record of the answer, authority, and
+// additional sections, in order. It stops when @p visit returns false. It
+// returns false if the message is invalid.
+template <typename Visitor>
+static bool mkudns_wire_walk(const uint8_t *data, size_t size, Visitor visit) {
+  if (data == nullptr) MKUDNS_ABORT();
+  size_t off = 4;
+  uint16_t counts[4] = {};
+  for (uint16_t &count : counts) {
+    if (!mkudns_wire_u16(data, size, &off, &count)) return false;
+  }
+  for (uint16_t i = 0; i < counts[0]; ++i) {
+    if (!mkudns_wire_name(data, size, &off, nullptr)) return false;
+    if (off > size || size - off < 4) return false;
+    off += 4;
+  }
+  const mkudns_section sections[] = {mkudns_section::answer,
+                                     mkudns_section::authority,
+                                     mkudns_section::additional};
+  for (size_t s = 0; s < 3; ++s) {
+    for (uint16_t i = 0; i < counts[s + 1]; ++i) {
+      mkudns_rr rr;
+      rr.section = sections[s];
+      rr.name = off;
+      if (!mkudns_wire_name(data, size, &off, nullptr) ||
+          !mkudns_wire_u16(data, size, &off, &rr.type) ||
+          !mkudns_wire_u16(data, size, &off, &rr.dnsclass) ||
+          !mkudns_wire_u32(data, size, &off, &rr.ttl) ||
+          !mkudns_wire_u16(data, size, &off, &rr.rdlength)) {
+        return false;
+      }
+      rr.rdata = off;
+      if (off > size || size - off < rr.rdlength) return false;
+      off += rr.rdlength;
+      if (!visit(rr)) return true;
+    }
+  }
+  return true;
+}
+
+// mkudns_wire_address returns the IPv4 or IPv6 address of @p family at
+// @p base in presentation format, or an empty string on failure.
+static std::string mkudns_wire_address(int family, const uint8_t *base) {
+  if (base == nullptr) MKUDNS_ABORT();
+  char buf[46];  // INET6_ADDRSTRLEN
+  if (inet_ntop(family, base, buf, sizeof(buf)) == nullptr) return "";
+  return buf;
+}
+
+// mkudns_wire_strings decodes the sequence of character strings between
+// @p off and @p end into @p out. Returns false if they are invalid.
+static bool mkudns_wire_strings(
+    const uint8_t *data, size_t off, size_t end, nlohmann::json *out) {
+  if (data == nullptr || out == nullptr) MKUDNS_ABORT();
+  *out = nlohmann::json::array();
+  while (off < end) {
+    uint8_t len = data[off++];
+    if (end - off < len) return false;
+    std::string s;
+    mkudns_wire_escape(data + off, len, "\\\"", &s);
+    out->push_back(s);
+    off += len;
+  }
+  return true;
+}
+
+// mkudns_wire_svc_key_name returns the name of the SVCB/HTTPS parameter
+// whose key is @p key, i.e., its registered name or "key" followed by the
+// key number (see RFC 9460).
+static std::string mkudns_wire_svc_key_name(uint16_t key) {
+  static const char *names[] = {"mandatory", "alpn", "no-default-alpn",
+                                "port", "ipv4hint", "ech", "ipv6hint"};
+  if (key < 7) return names[key];
+  return "key" + std::to_string(static_cast<unsigned>(key));
+}
+
+// mkudns_wire_svc_params decodes the SVCB/HTTPS parameters between @p off
+// and @p end into @p out (see RFC 9460). Returns false if they are invalid.
+static bool mkudns_wire_svc_params(
+    const uint8_t *data, size_t off, size_t end, nlohmann::json *out) {
+  if (data == nullptr || out == nullptr) MKUDNS_ABORT();
+  *out = nlohmann::json::object();
+  while (off < end) {
+    uint16_t key = 0;
+    uint16_t len = 0;
+    if (!mkudns_wire_u16(data, end, &off, &key) ||
+        !mkudns_wire_u16(data, end, &off, &len) || end - off < len) {
+      return false;
+    }
+    std::string name = mkudns_wire_svc_key_name(key);
+    nlohmann::json value;
+    size_t cur = off;
+    switch (key) {
+      case 0:
+        value = nlohmann::json::array();
+        while (cur + 2 <= off + len) {
+          uint16_t k = 0;
+          (void)mkudns_wire_u16(data, off + len, &cur, &k);
+          value.push_back(mkudns_wire_svc_key_name(k));
+        }
+        break;
+      case 1:
+        if (!mkudns_wire_strings(data, off, off + len, &value)) return false;
+        break;
+      case 3: {
+        uint16_t port = 0;
+        if (!mkudns_wire_u16(data, off + len, &cur, &port)) return false;
+        value = port;
+      } break;
+      case 4:
+      case 6: {
+        int family = (key == 4) ? AF_INET : AF_INET6;
+        size_t step = (key == 4) ? 4 : 16;
+        value = nlohmann::json::array();
+        for (; cur + step <= off + len; cur += step) {
+          value.push_back(mkudns_wire_address(family, data + cur));
+        }
+      } break;
+      default:
+        value = mk::data::base64_encode(std::string{
+            reinterpret_cast<const char *>(data + off), len});
+        break;
+    }
+    (*out)[name] = value;
+    off += len;
+  }
+  return true;
+}
+
+// mkudns_wire_rdata decodes the data of @p rr, which is contained in the
+// message @p data of @p size bytes, into @p out. Records of unknown type,
+// and records that we cannot decode, have their data base64 encoded into
+// the `rdata` field.
+static void mkudns_wire_rdata(
+    const uint8_t *data, size_t size, const mkudns_rr &rr,
+    nlohmann::json *out) {
+  if (data == nullptr || out == nullptr || rr.rdata > size ||
+      size - rr.rdata < rr.rdlength) {
+    MKUDNS_ABORT();
+  }
+  *out = nlohmann::json::object();
+  size_t off = rr.rdata;
+  size_t end = rr.rdata + rr.rdlength;
+  bool good = false;
+  switch (rr.type) {
+    case ns_t_a:
+    case ns_t_aaaa: {
+      int family = (rr.type == ns_t_a) ? AF_INET : AF_INET6;
+      size_t len = (rr.type == ns_t_a) ? 4 : 16;
+      if ((good = (rr.rdlength == len))) {
+        (*out)["address"] = mkudns_wire_address(family, data + off);
+      }
+    } break;
+    case ns_t_ns:
+    case ns_t_cname:
+    case ns_t_ptr: {
+      std::string name;
+      if ((good = mkudns_wire_name(data, size, &off, &name) && off == end)) {
+        (*out)["target"] = name;
+      }
+    } break;
+    case ns_t_mx: {
+      uint16_t preference = 0;
+      std::string exchange;
+      if ((good = mkudns_wire_u16(data, end, &off, &preference) &&
+                  mkudns_wire_name(data, size, &off, &exchange) &&
+                  off == end)) {
+        (*out)["preference"] = preference;
+        (*out)["exchange"] = exchange;
+      }
+    } break;
+    case ns_t_txt: {
+      nlohmann::json strings;
+      if ((good = mkudns_wire_strings(data, off, end, &strings))) {
+        (*out)["strings"] = strings;
+      }
+    } break;
+    case ns_t_soa: {
+      std::string mname;
+      std::string rname;
+      uint32_t values[5] = {};
+      good = mkudns_wire_name(data, size, &off, &mname) &&
+             mkudns_wire_name(data, size, &off, &rname);
+      for (uint32_t &value : values) {
+        good = good && mkudns_wire_u32(data, end, &off, &value);
+      }
+      if ((good = good && off == end)) {
+        (*out)["mname"] = mname;
+        (*out)["rname"] = rname;
+        (*out)["serial"] = values[0];
+        (*out)["refresh"] = values[1];
+        (*out)["retry"] = values[2];
+        (*out)["expire"] = values[3];
+        (*out)["minimum"] = values[4];
+      }
+    } break;
+    case ns_t_srv: {
+      uint16_t values[3] = {};
+      std::string target;
+      good = true;
+      for (uint16_t &value : values) {
+        good = good && mkudns_wire_u16(data, end, &off, &value);
+      }
+      if ((good = good && mkudns_wire_name(data, size, &off, &target) &&
+                  off == end)) {
+        (*out)["priority"] = values[0];
+        (*out)["weight"] = values[1];
+        (*out)["port"] = values[2];
+        (*out)["target"] = target;
+      }
+    } break;
+    case 257: {  // CAA
+      uint8_t flags = 0;
+      uint8_t len = 0;
+      if ((good = mkudns_wire_u8(data, end, &off, &flags) &&
+                  mkudns_wire_u8(data, end, &off, &len) && end - off >= len)) {
+        std::string tag;
+        std::string value;
+        mkudns_wire_escape(data + off, len, "\\\"", &tag);
+        mkudns_wire_escape(data + off + len, end - off - len, "\\\"", &value);
+        (*out)["flags"] = flags;
+        (*out)["tag"] = tag;
+        (*out)["value"] = value;
+      }
+    } break;
+    case 64:    // SVCB
+    case 65: {  // HTTPS
+      uint16_t priority = 0;
+      std::string target;
+      nlohmann::json params;
+      if ((good = mkudns_wire_u16(data, end, &off, &priority) &&
+                  mkudns_wire_name(data, size, &off, &target) &&
+                  off <= end &&
+                  mkudns_wire_svc_params(data, off, end, &params))) {
+        (*out)["priority"] = priority;
+        (*out)["target"] = target;
+        (*out)["params"] = params;
+      }
+    } break;
+    default: break;
+  }
+  if (!good) {
+    *out = nlohmann::json::object();
+    (*out)["rdata"] = mk::data::base64_encode(std::string{
+        reinterpret_cast<const char *>(data + rr.rdata), rr.rdlength});
+  }
+}
+
+// mkudns_response
+// ---------------
+
+// mkudns_linger contains the events received during the linger window. It is
+// shared by a response and by the background thread that fills it.
+struct mkudns_linger {
+  // cond allows to wait for done to become true.
+  std::condition_variable cond;
+
+  // done indicates that the linger window is closed.
+  bool done = false;
+
+  // events contains the late recv events. We use a deque because we return
+  // pointers to its strings while new events are being appended.
+  std::deque<std::string> events;
+
+  // mutex protects this structure against concurrent accesses.
+  std::mutex mutex;
+};
+
+// mkudns_response is the private data of mkudns_response_t.
+struct mkudns_response {
+  // addresses contains the resolved addresses.
+  std::vector<std::string> addresses;
+
+  // address_ttls contains the TTL of each address.
+  std::vector<int64_t> address_ttls;
+
+  // cnames contains the CNAME chain.
+  std::vector<std::string> cnames;
+
+  // events contains the events occurred when performing the query.
+  std::vector<std::string> events;
+
+  // cname contains the response CNAME.
+  std::string cname;
+
+  // good indicates whether the query succeeded.
+  int64_t good = false;
+
+  // icmp_origin is the address of the host that sent an ICMP error.
+  std::string icmp_origin;
+
+  // linger contains the late events, if we have a linger window.
+  std::shared_ptr<mkudns_linger> linger;
+
+  // messages contains the DNS messages that we parsed.
+  std::vector<std::string> messages;
+
+  // primary is the index of the message that answers the query, which is
+  // the A query for dual stack queries, or -1 if we did not parse it.
+  int64_t primary = -1;
+
+  // received indicates that we received at least a datagram, which is what
+  // opens the linger window.
+  bool received = false;
+
+  // recv_event is the receive event.
+  std::string recv_event;
+
+  // recv_ttl is the TTL (or hop limit) of the response.
+  int64_t recv_ttl = -1;
+
+  // records contains the records of the parsed messages.
+  std::vector<mkudns_rr> records;
+
+  // records_json contains the serialized records, or empty strings for the
+  // records not accessed yet.
+  mutable std::vector<std::string> records_json;
+
+  // records_mutex protects records_json against concurrent accesses.
+  mutable std::mutex records_mutex;
+
+  // rtt is the round trip time in milliseconds.
+  int64_t rtt = -1;
+
+  // send_event is the send event.
+  std::string send_event;
+
+  // sent_at is when we last successfully sent a query.
+  int64_t sent_at = 0;
+
+  // truncated indicates that we received a UDP response with the TC bit.
+  bool truncated = false;
+};
+
+int64_t mkudns_response_good(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->good;
+}
+
+const char *mkudns_response_get_cname(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->cname.c_str();
+}
+
+size_t mkudns_response_get_addresses_size(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->addresses.size();
+}
+
+const char *mkudns_response_get_address_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || idx >= response->addresses.size()) MKUDNS_ABORT();
+  return response->addresses[idx].c_str();
+}
+
+size_t mkudns_response_get_records_size(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->records.size();
+}
+
+const char *mkudns_response_get_record_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || idx >= response->records.size()) MKUDNS_ABORT();
+  std::unique_lock<std::mutex> _{response->records_mutex};
+  response->records_json.resize(response->records.size());
+  std::string &cached = response->records_json[idx];
+  if (cached.empty()) {
+    const mkudns_rr &rr = response->records[idx];
+    const std::string &message = response->messages[rr.message];
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(message.data());
+    nlohmann::json json;
+    std::string name;
+    size_t off = rr.name;
+    (void)mkudns_wire_name(data, message.size(), &off, &name);
+    json["class"] = rr.dnsclass;
+    mkudns_wire_rdata(data, message.size(), rr, &json["data"]);
+    json["name"] = name;
+    json["section"] = (rr.section == mkudns_section::answer) ? "answer"
+                      : (rr.section == mkudns_section::authority)
+                          ? "authority" : "additional";
+    json["ttl"] = rr.ttl;
+    json["type"] = rr.type;
+    cached = json.dump();
+  }
+  return cached.c_str();
+}
+
+int64_t mkudns_response_get_address_ttl_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || idx >= response->addresses.size()) MKUDNS_ABORT();
+  return (idx < response->address_ttls.size()) ? response->address_ttls[idx]
+                                                : -1;
+}
+
+// mkudns_message_rcode returns the response code, including the EDNS0
+// extended bits, of the message at index @p message of @p response.
+static int64_t mkudns_message_rcode(
+    const mkudns_response_t *response, size_t message) {
+  if (response == nullptr || message >= response->messages.size()) {
+    MKUDNS_ABORT();
+  }
+  int64_t rcode = response->messages[message][3] & 0x0f;
+  for (const mkudns_rr &rr : response->records) {
+    if (rr.message == message && rr.section == mkudns_section::additional &&
+        rr.type == ns_t_opt) {
+      rcode |= static_cast<int64_t>(rr.ttl >> 24) << 4;  // see RFC 6891
+      break;
+    }
+  }
+  return rcode;
+}
+
+int64_t mkudns_response_get_flags(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  if (response->primary < 0) return -1;
+  const std::string &message =
+      response->messages[static_cast<size_t>(response->primary)];
+  return (static_cast<int64_t>(static_cast<uint8_t>(message[2])) << 8) |
+         static_cast<uint8_t>(message[3]);
+}
+
+int64_t mkudns_response_get_rcode(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  if (response->primary < 0) return -1;
+  return mkudns_message_rcode(
+      response, static_cast<size_t>(response->primary));
+}
+
+size_t mkudns_response_get_cnames_size(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->cnames.size();
+}
+
+const char *mkudns_response_get_cname_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || idx >= response->cnames.size()) MKUDNS_ABORT();
+  return response->cnames[idx].c_str();
+}
+
+const char *mkudns_response_get_send_event(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
   return response->send_event.c_str();
 }
 
@@ -371,8 +1824,83 @@ const char *mkudns_response_get_recv_event(const mkudns_response_t *response) {
   return response->recv_event.c_str();
 }
 
+int64_t mkudns_response_get_recv_ttl(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->recv_ttl;
+}
+
+int64_t mkudns_response_get_rtt(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->rtt;
+}
+
+const char *mkudns_response_get_icmp_origin(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->icmp_origin.c_str();
+}
+
+size_t mkudns_response_get_events_size(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  return response->events.size();
+}
+
+const char *mkudns_response_get_event_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || idx >= response->events.size()) MKUDNS_ABORT();
+  return response->events[idx].c_str();
+}
+
+void mkudns_response_wait_linger(const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  if (response->linger == nullptr) return;
+  std::unique_lock<std::mutex> lock{response->linger->mutex};
+  response->linger->cond.wait(lock, [&]() { return response->linger->done; });
+}
+
+size_t mkudns_response_get_late_events_size(
+    const mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  if (response->linger == nullptr) return 0;
+  std::unique_lock<std::mutex> _{response->linger->mutex};
+  return response->linger->events.size();
+}
+
+const char *mkudns_response_get_late_event_at(
+    const mkudns_response_t *response, size_t idx) {
+  if (response == nullptr || response->linger == nullptr) MKUDNS_ABORT();
+  std::unique_lock<std::mutex> _{response->linger->mutex};
+  if (idx >= response->linger->events.size()) MKUDNS_ABORT();
+  return response->linger->events[idx].c_str();
+}
+
 void mkudns_response_delete(mkudns_response_t *response) { delete response; }
 
+// mkudns_responses
+// ----------------
+
+// mkudns_responses is the private data of mkudns_responses_t.
+struct mkudns_responses {
+  // responses contains a response per fan-out server.
+  std::vector<mkudns_response_uptr> responses;
+};
+
+size_t mkudns_responses_get_size(const mkudns_responses_t *responses) {
+  if (responses == nullptr) MKUDNS_ABORT();
+  return responses->responses.size();
+}
+
+const mkudns_response_t *mkudns_responses_get_at(
+    const mkudns_responses_t *responses, size_t idx) {
+  if (responses == nullptr || idx >= responses->responses.size()) {
+    MKUDNS_ABORT();
+  }
+  return responses->responses[idx].get();
+}
+
+void mkudns_responses_delete(mkudns_responses_t *responses) {
+  delete responses;
+}
+
 // mkudns_query_perform
 // --------------------
 
@@ -404,12 +1932,59 @@ static int64_t mkudns_now() {
 #define MKUDNS_CLOSESOCKET close
 #endif
 
+// mkudns_last_error returns the last system error. Call it immediately after
+// the failed system call, because other calls may overwrite the error.
+static int mkudns_last_error() {
+#ifdef _WIN32
+  return WSAGetLastError();
+#else
+  return errno;
+#endif
+}
+
+// mkudns_error_string maps the system error @p err to an error string. We
+// assume UDP sockets: use mkudns_tcp_error_string for TCP sockets.
+static std::string mkudns_error_string(int err) {
+  switch (err) {
+#ifdef _WIN32
+    case WSAECONNREFUSED: return "connection_refused";
+    case WSAECONNRESET: return "connection_refused";  // ICMP port unreachable
+    case WSAEHOSTUNREACH: return "host_unreachable";
+    case WSAENETUNREACH: return "network_unreachable";
+    case WSAETIMEDOUT: return "timed_out";
+#else
+    case ECONNREFUSED: return "connection_refused";
+    case ECONNRESET: return "connection_reset";
+    case EHOSTUNREACH: return "host_unreachable";
+    case ENETUNREACH: return "network_unreachable";
+    case ETIMEDOUT: return "timed_out";
+#endif
+    default: break;
+  }
+  return "io_error";
+}
+
+// mkudns_tcp_error_string is like mkudns_error_string for the system error
+// @p err of a TCP socket, where a reset is a reset rather than the ICMP port
+// unreachable that Windows reports as a reset on UDP sockets.
+static std::string mkudns_tcp_error_string(int err) {
+#ifdef _WIN32
+  if (err == WSAECONNRESET) return "connection_reset";
+#endif
+  return mkudns_error_string(err);
+}
+
 // mkudns_maybe_errno returns the error that occurred if retval is
-// negative and `"no_error"` otherwise.
-static std::string mkudns_maybe_errno(int64_t retval) {
+// negative and `"no_error"` otherwise. @p err is the system error.
+static std::string mkudns_maybe_errno(int64_t retval, int err) {
   if (retval >= 0) return "no_error";
-  // TODO(bassosimone): map interesting system errors.
-  return "io_error";
+  return mkudns_error_string(err);
+}
+
+// mkudns_tcp_maybe_errno is like mkudns_maybe_errno for TCP sockets.
+static std::string mkudns_tcp_maybe_errno(int64_t retval, int err) {
+  if (retval >= 0) return "no_error";
+  return mkudns_tcp_error_string(err);
 }
 
 // mkudns_maybe_base64 returns buff as a base64 string if count is
@@ -423,45 +1998,208 @@ static std::string mkudns_maybe_base64(const void *buff, int64_t count) {
                   static_cast<size_t>(count)});
 }
 
-// mkudns_generic_event_new creates a new generic event.
+// mkudns_generic_event_new creates a new generic event. The @p extra object
+// contains additional, event specific, values.
 static std::string mkudns_generic_event_new(
     const mkudns_query_t *query, std::string event_key, std::string event_data,
-    std::string event_errno, int64_t retval) {
+    std::string event_errno, int64_t retval,
+    const nlohmann::json &extra = nlohmann::json::object()) {
   if (query == nullptr) MKUDNS_ABORT();
   nlohmann::json json;
+  for (auto &item : extra.items()) json["value"][item.key()] = item.value();
   json["key"] = event_key;
   json["value"]["data"] = event_data;
   json["value"]["error"] = event_errno;
+  json["value"]["query_id"] = query->id;
+  json["value"]["query_type"] = query->type;
   json["value"]["ret"] = retval;
   json["value"]["server_address"] = query->server_address;
   json["value"]["server_port"] = query->server_port;
   json["value"]["t"] = mkudns_now();
   json["value"]["timeout"] = query->timeout;
+  json["value"]["transport"] = query->tcp ? "tcp" : "udp";
   json["value"]["ttl"] = query->ttl;
   return json.dump();
 }
 
-// mkudns_recv_event_new creates a new recv event.
+// mkudns_recv_event_new creates a new recv event. @p recv_ttl is the TTL
+// (or hop limit) of the received datagram, or -1 if unknown.
 static std::string mkudns_recv_event_new(
-    const mkudns_query_t *query, const void *data, int64_t retval) {
+    const mkudns_query_t *query, const void *data, int64_t retval, int err,
+    int64_t recv_ttl) {
   if (query == nullptr || data == nullptr) MKUDNS_ABORT();
+  nlohmann::json extra;
+  extra["recv_ttl"] = recv_ttl;
   return mkudns_generic_event_new(
       query, "mkudns.recv",
       mkudns_maybe_base64(data, retval),
-      mkudns_maybe_errno(retval),
-      retval);
+      mkudns_maybe_errno(retval, err),
+      retval, extra);
+}
+
+// mkudns_late_recv_event_new creates a new late recv event, i.e., the recv
+// event of a datagram received after the first response.
+static std::string mkudns_late_recv_event_new(
+    const mkudns_query_t *query, const void *data, int64_t retval, int err,
+    int64_t recv_ttl) {
+  if (query == nullptr || data == nullptr) MKUDNS_ABORT();
+  nlohmann::json extra;
+  extra["recv_ttl"] = recv_ttl;
+  return mkudns_generic_event_new(
+      query, "mkudns.late_recv",
+      mkudns_maybe_base64(data, retval),
+      mkudns_maybe_errno(retval, err),
+      retval, extra);
 }
 
-// mkudns_send_event_new creates a new send event.
+// mkudns_send_event_new creates a new send event. The @p extra object
+// contains additional values (see mkudns_generic_event_new).
 static std::string mkudns_send_event_new(
     const mkudns_query_t *query, const void *data,
-    size_t count, int64_t retval) {
+    size_t count, int64_t retval, int err,
+    const nlohmann::json &extra = nlohmann::json::object()) {
   if (query == nullptr || data == nullptr || count > INT64_MAX) MKUDNS_ABORT();
   return mkudns_generic_event_new(
       query, "mkudns.send",
       mkudns_maybe_base64(data, static_cast<int64_t>(count)),
-      mkudns_maybe_errno(retval),
-      retval);
+      mkudns_maybe_errno(retval, err),
+      retval, extra);
+}
+
+// mkudns_icmp contains information on a received ICMP error.
+struct mkudns_icmp {
+  // code is the ICMP code.
+  int64_t code = 0;
+
+  // origin is the address of the host that sent the ICMP error.
+  std::string origin;
+
+  // type is the ICMP type.
+  int64_t type = 0;
+
+  // v6 indicates whether this is an ICMPv6 error.
+  bool v6 = false;
+};
+
+// mkudns_recv_icmp reads the oldest ICMP error queued on @p sock, if any,
+// into @p icmp, and returns whether it did. This is only implemented on
+// Linux, where mkudns_connect enables IP_RECVERR (or IPV6_RECVERR).
+static bool mkudns_recv_icmp(mkudns_socket_t sock, mkudns_icmp *icmp) {
+  if (sock == mkudns_socket_invalid || icmp == nullptr) MKUDNS_ABORT();
+#ifdef __linux__
+  std::array<char, 512> control;
+  std::array<char, 512> data;  // the datagram that caused the ICMP error
+  iovec iov{};
+  iov.iov_base = data.data();
+  iov.iov_len = data.size();
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t n = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+  MKUDNS_HOOK(recvmsg, n);
+  if (n < 0) return false;
+  for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+       cm = CMSG_NXTHDR(&msg, cm)) {
+    if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+        !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+      continue;
+    }
+    if (cm->cmsg_len < CMSG_LEN(sizeof(sock_extended_err))) continue;
+    sock_extended_err ee{};
+    memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+    if (ee.ee_origin != SO_EE_ORIGIN_ICMP &&
+        ee.ee_origin != SO_EE_ORIGIN_ICMP6) {
+      continue;
+    }
+    icmp->code = ee.ee_code;
+    icmp->type = ee.ee_type;
+    icmp->v6 = (ee.ee_origin == SO_EE_ORIGIN_ICMP6);
+    // The offender address immediately follows the extended error.
+    sockaddr_storage ss{};
+    size_t len = cm->cmsg_len - CMSG_LEN(sizeof(ee));
+    memcpy(&ss, CMSG_DATA(cm) + sizeof(ee), (std::min)(len, sizeof(ss)));
+    char host[NI_MAXHOST];
+    if (ss.ss_family != AF_UNSPEC &&
+        getnameinfo(reinterpret_cast<sockaddr *>(&ss), sizeof(ss), host,
+                    sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0) {
+      icmp->origin = host;
+    }
+    return true;
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+
+// mkudns_icmp_error returns the error string describing @p icmp.
+static std::string mkudns_icmp_error(const mkudns_icmp &icmp) {
+  if (!icmp.v6 && icmp.type == 3) {  // destination unreachable
+    switch (icmp.code) {
+      case 0: case 6: return "network_unreachable";
+      case 1: case 7: return "host_unreachable";
+      case 3: return "connection_refused";
+      case 9: case 10: case 13: return "administratively_prohibited";
+      default: break;
+    }
+  } else if (!icmp.v6 && icmp.type == 11) {
+    return "ttl_exceeded";
+  } else if (icmp.v6 && icmp.type == 1) {  // destination unreachable
+    switch (icmp.code) {
+      case 0: return "network_unreachable";
+      case 1: return "administratively_prohibited";
+      case 3: return "host_unreachable";
+      case 4: return "connection_refused";
+      default: break;
+    }
+  } else if (icmp.v6 && icmp.type == 3) {
+    return "ttl_exceeded";
+  }
+  return "icmp_error";
+}
+
+// mkudns_recv_icmp_event_new creates the recv event for a recv that failed
+// because we received the @p icmp error.
+static std::string mkudns_recv_icmp_event_new(
+    const mkudns_query_t *query, const mkudns_icmp &icmp, int64_t retval) {
+  if (query == nullptr) MKUDNS_ABORT();
+  nlohmann::json extra;
+  extra["icmp_code"] = icmp.code;
+  extra["icmp_origin"] = icmp.origin;
+  extra["icmp_type"] = icmp.type;
+  return mkudns_generic_event_new(
+      query, "mkudns.recv", "", mkudns_icmp_error(icmp), retval, extra);
+}
+
+// mkudns_forget_answer forgets what we parsed into @p response, so that
+// we can use another response instead.
+static void mkudns_forget_answer(mkudns_response_t *response) {
+  if (response == nullptr) MKUDNS_ABORT();
+  response->addresses.clear();
+  response->address_ttls.clear();
+  response->cname.clear();
+  response->cnames.clear();
+  response->messages.clear();
+  response->primary = -1;
+  response->records.clear();
+  response->records_json.clear();
+}
+
+// mkudns_move_answer replaces what we parsed into @p dst with what we parsed
+// into @p src, and forgets the latter.
+static void mkudns_move_answer(mkudns_response_t *src, mkudns_response_t *dst) {
+  if (src == nullptr || dst == nullptr) MKUDNS_ABORT();
+  dst->addresses = std::move(src->addresses);
+  dst->address_ttls = std::move(src->address_ttls);
+  dst->cname = std::move(src->cname);
+  dst->cnames = std::move(src->cnames);
+  dst->messages = std::move(src->messages);
+  dst->primary = src->primary;
+  dst->records = std::move(src->records);
+  dst->records_json = std::move(src->records_json);
+  mkudns_forget_answer(src);
 }
 
 // mkudns_parse_hostent parses @p host into @p response.
@@ -488,6 +2226,52 @@ static bool mkudns_parse_hostent(mkudns_response_t *response, hostent *host) {
   return true;
 }
 
+// mkudns_wire_name_equal returns whether the names @p a and @p b, which
+// are in presentation format, are equal, ignoring the case.
+static bool mkudns_wire_name_equal(const std::string &a, const std::string &b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return tolower(static_cast<unsigned char>(x)) ==
+                  tolower(static_cast<unsigned char>(y));
+         });
+}
+
+// mkudns_parse_cnames follows the CNAME records of the answer section of
+// the message @p data of @p count bytes, starting from the query name, and
+// stores the chain into @p response. The records of the message are the
+// ones of @p response starting at index @p first.
+static void mkudns_parse_cnames(
+    mkudns_response_t *response, const uint8_t *data, size_t count,
+    size_t first) {
+  if (response == nullptr || data == nullptr) MKUDNS_ABORT();
+  std::string current;
+  size_t off = 12;  // the question follows the header
+  if (!mkudns_wire_name(data, count, &off, &current)) return;
+  // Each record can extend the chain at most once, which stops loops.
+  for (size_t i = first; i < response->records.size(); ++i) {
+    bool found = false;
+    for (size_t j = first; j < response->records.size() && !found; ++j) {
+      const mkudns_rr &rr = response->records[j];
+      if (rr.section != mkudns_section::answer || rr.type != ns_t_cname) {
+        continue;
+      }
+      std::string owner;
+      off = rr.name;
+      if (!mkudns_wire_name(data, count, &off, &owner) ||
+          !mkudns_wire_name_equal(owner, current)) {
+        continue;
+      }
+      std::string target;
+      off = rr.rdata;
+      if (!mkudns_wire_name(data, count, &off, &target)) return;
+      response->cnames.push_back(target);
+      current = target;
+      found = true;
+    }
+    if (!found) break;
+  }
+}
+
 // mkudns_parse parses the response.
 static bool mkudns_parse(
     const mkudns_query_t *query, mkudns_response_t *response,
@@ -496,62 +2280,257 @@ static bool mkudns_parse(
       count <= 0 || count > INT_MAX) {
     MKUDNS_ABORT();
   }
+  size_t first = response->records.size();
+  size_t message = response->messages.size();
+  size_t answered = 0;
+  bool valid = mkudns_wire_walk(data, count, [&](mkudns_rr rr) {
+    rr.message = message;
+    if (rr.section == mkudns_section::answer &&
+        (rr.type == query->type || query->type == ns_t_any)) {
+      ++answered;
+    }
+    response->records.push_back(rr);
+    return true;
+  });
+  if (!valid) {
+    response->records.resize(first);
+    return false;
+  }
+  response->messages.emplace_back(reinterpret_cast<const char *>(data), count);
+  // The AAAA twin of a dual stack query does not answer the query.
+  bool primary = !(query->dual_stack && query->type == ns_t_aaaa);
+  if (primary && response->primary < 0) {
+    response->primary = static_cast<int64_t>(message);
+    mkudns_parse_cnames(response, data, count, first);
+  }
   hostent *host = nullptr;
   int ret = 0;
+  std::vector<ares_addrttl> ttls(std::max<size_t>(answered, 1));
+  std::vector<ares_addr6ttl> ttls6(std::max<size_t>(answered, 1));
+  int nttls = static_cast<int>(std::min<size_t>(ttls.size(), INT_MAX));
   switch (query->type) {
     case ns_t_a:
       ret = ares_parse_a_reply(
-          data, static_cast<int>(count), &host, nullptr, nullptr);
+          data, static_cast<int>(count), &host, ttls.data(), &nttls);
       MKUDNS_HOOK(ares_parse_a_reply, ret);
       break;
     case ns_t_aaaa:
       ret = ares_parse_aaaa_reply(
-          data, static_cast<int>(count), &host, nullptr, nullptr);
+          data, static_cast<int>(count), &host, ttls6.data(), &nttls);
       MKUDNS_HOOK(ares_parse_aaaa_reply, ret);
       break;
-    default: MKUDNS_ABORT();  // should not happen
+    default:
+      return (data[3] & 0x0f) == ns_r_noerror && answered > 0;
   }
   if (ret != ARES_SUCCESS) return false;
+  size_t before = response->addresses.size();
   bool good = mkudns_parse_hostent(response, host);
   ares_free_hostent(host);
+  response->address_ttls.resize(before, -1);
+  for (size_t i = 0; before + i < response->addresses.size(); ++i) {
+    int64_t ttl = -1;
+    if (i < static_cast<size_t>(nttls)) {
+      ttl = (query->type == ns_t_a) ? ttls[i].ttl : ttls6[i].ttl;
+    }
+    response->address_ttls.push_back(ttl);
+  }
   return good;
 }
 
-// mkudns_recv receives the query using @p sock.
-static bool mkudns_recv(
-    const mkudns_query_t *query, mkudns_response_t *response,
-    mkudns_socket_t sock) {
-  if (query == nullptr || response == nullptr ||
-      sock == mkudns_socket_invalid) {
-    MKUDNS_ABORT();
-  }
-  pollfd pfd{};
-  pfd.events = POLLIN;
-  pfd.fd = sock;
-  int64_t t = query->timeout;
-  t = (t < 0) ? -1 : (t < INT_MAX) ? t : INT_MAX;
+// mkudns_poll is a portable wrapper for poll. A negative @p timeout means
+// that we should block until one of the @p fds is ready.
+static int mkudns_poll(pollfd *fds, size_t nfds, int64_t timeout) {
+  if (fds == nullptr || nfds <= 0 || nfds > INT_MAX) MKUDNS_ABORT();
+  timeout = (timeout < 0) ? -1 : (timeout < INT_MAX) ? timeout : INT_MAX;
+#ifdef _WIN32
+  return WSAPoll(fds, static_cast<ULONG>(nfds), static_cast<int>(timeout));
+#else
+  return poll(fds, static_cast<nfds_t>(nfds), static_cast<int>(timeout));
+#endif
+}
+
+#ifndef _WIN32
+// mkudns_cmsg_ttl returns the TTL (or hop limit) contained in the control
+// messages of @p msg, or -1 if there is none.
+static int64_t mkudns_cmsg_ttl(msghdr *msg) {
+  if (msg == nullptr) MKUDNS_ABORT();
+  int64_t recv_ttl = -1;
+  for (cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != nullptr;
+       cm = CMSG_NXTHDR(msg, cm)) {
+    bool is_ttl = (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TTL);
+#ifdef IP_RECVTTL
+    is_ttl = is_ttl || (cm->cmsg_level == IPPROTO_IP &&
+                        cm->cmsg_type == IP_RECVTTL);  // BSD
+#endif
+#ifdef IPV6_HOPLIMIT
+    is_ttl = is_ttl || (cm->cmsg_level == IPPROTO_IPV6 &&
+                        cm->cmsg_type == IPV6_HOPLIMIT);
+#endif
+    if (!is_ttl) continue;
+    if (cm->cmsg_len == CMSG_LEN(sizeof(uint8_t))) {
+      uint8_t ttl = 0;  // BSD uses a single byte for IP_RECVTTL
+      memcpy(&ttl, CMSG_DATA(cm), sizeof(ttl));
+      recv_ttl = ttl;
+    } else if (cm->cmsg_len >= CMSG_LEN(sizeof(int))) {
+      int ttl = 0;
+      memcpy(&ttl, CMSG_DATA(cm), sizeof(ttl));
+      recv_ttl = ttl;
+    }
+  }
+  return recv_ttl;
+}
+#endif
+
+// mkudns_recvmsg is like recv except that it also stores into @p recv_ttl
+// the TTL (or hop limit) of the received datagram, or -1 if unknown. The
+// TTL is only available where mkudns_connect enables IP_RECVTTL (or
+// IPV6_RECVHOPLIMIT). It also sets @p msg_trunc if the datagram was larger
+// than @p count and the kernel truncated it. If @p from is not null, we
+// store the source address into it, which is useful with unconnected
+// sockets. This function preserves the system error.
+static int64_t mkudns_recvmsg(
+    mkudns_socket_t sock, char *buff, size_t count, int64_t *recv_ttl,
+    bool *msg_trunc, sockaddr_storage *from = nullptr) {
+  if (sock == mkudns_socket_invalid || buff == nullptr ||
+      recv_ttl == nullptr || msg_trunc == nullptr) {
+    MKUDNS_ABORT();
+  }
+  *recv_ttl = -1;
+  *msg_trunc = false;
 #ifdef _WIN32
-  int ret = WSAPoll(&pfd, 1, static_cast<int>(t));
+  if (count > INT_MAX) MKUDNS_ABORT();
+  int fromlen = (from != nullptr) ? sizeof(*from) : 0;
+  int n = recvfrom(sock, buff, static_cast<int>(count), 0,
+                   reinterpret_cast<sockaddr *>(from),
+                   (from != nullptr) ? &fromlen : nullptr);
+  if (n < 0 && WSAGetLastError() == WSAEMSGSIZE) {
+    *msg_trunc = true;  // buff contains the first count bytes
+    return static_cast<int64_t>(count);
+  }
+  return n;
 #else
-  int ret = poll(&pfd, 1, static_cast<int>(t));
+  std::array<char, 256> control;
+  iovec iov{};
+  iov.iov_base = buff;
+  iov.iov_len = count;
+  msghdr msg{};
+  msg.msg_name = from;
+  msg.msg_namelen = (from != nullptr) ? sizeof(*from) : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t n = recvmsg(sock, &msg, 0);
+  if (n < 0) return n;
+  *msg_trunc = (msg.msg_flags & MSG_TRUNC) != 0;
+  *recv_ttl = mkudns_cmsg_ttl(&msg);
+  return n;
 #endif
+}
+
+// mkudns_get_id returns the ID of the DNS message in @p buff, which is
+// @p n bytes long, or -1 if the message is too short to have an ID.
+static int64_t mkudns_get_id(const char *buff, int64_t n) {
+  if (buff == nullptr) MKUDNS_ABORT();
+  if (n < 2) return -1;
+  return (static_cast<int64_t>(static_cast<uint8_t>(buff[0])) << 8) |
+         static_cast<uint8_t>(buff[1]);
+}
+
+// mkudns_recv_bufsiz returns the size of the buffer for receiving the
+// UDP response to @p query, which depends on the EDNS0 payload size.
+static size_t mkudns_recv_bufsiz(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  return static_cast<size_t>(std::max<int64_t>(query->edns_payload_size, 512));
+}
+
+// mkudns_is_truncated returns whether the DNS message in @p buff, which is
+// @p n bytes long, has the TC (truncated) bit set.
+static bool mkudns_is_truncated(const char *buff, int64_t n) {
+  if (buff == nullptr) MKUDNS_ABORT();
+  return n >= 3 && (static_cast<uint8_t>(buff[2]) & 0x02) != 0;
+}
+
+// mkudns_recv_process records the result of receiving @p n bytes into
+// @p buff using @p sock, and parses them into @p response. @p err is the
+// system error, which is meaningful only if @p n is negative. @p recv_ttl
+// is the TTL of the received datagram, or -1 if unknown. @p msg_trunc
+// indicates whether the datagram did not fit into @p buff.
+static bool mkudns_recv_process(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    mkudns_socket_t sock, const char *buff, int64_t n, int err,
+    int64_t recv_ttl, bool msg_trunc) {
+  if (query == nullptr || response == nullptr ||
+      sock == mkudns_socket_invalid || buff == nullptr) {
+    MKUDNS_ABORT();
+  }
+  if (response->rtt < 0) response->rtt = mkudns_now() - response->sent_at;
+  mkudns_icmp icmp;
+  if (n < 0 && mkudns_recv_icmp(sock, &icmp)) {
+    response->icmp_origin = icmp.origin;
+    response->recv_event = mkudns_recv_icmp_event_new(query, icmp, n);
+  } else {
+    response->recv_event = mkudns_recv_event_new(query, buff, n, err,
+                                                 recv_ttl);
+    response->recv_ttl = recv_ttl;
+  }
+  response->events.push_back(response->recv_event);
+  if (n <= 0) return false;
+  response->received = true;
+  if (msg_trunc || mkudns_is_truncated(buff, n)) {
+    response->truncated = true;  // the caller should retry over TCP
+    return false;
+  }
+  return mkudns_parse(query, response, reinterpret_cast<const uint8_t *>(buff),
+                      static_cast<size_t>(n));
+}
+
+// mkudns_recvbuf receives the response using @p sock, which should be
+// readable, and parses it into @p response.
+static bool mkudns_recvbuf(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    mkudns_socket_t sock) {
+  if (query == nullptr || response == nullptr ||
+      sock == mkudns_socket_invalid) {
+    MKUDNS_ABORT();
+  }
+  std::vector<char> buff(mkudns_recv_bufsiz(query));
+  int64_t recv_ttl = -1;
+  bool msg_trunc = false;
+  auto n = mkudns_recvmsg(
+      sock, buff.data(), buff.size(), &recv_ttl, &msg_trunc);
+  int err = mkudns_last_error();
+  MKUDNS_HOOK(recvmsg, n);
+  return mkudns_recv_process(
+      query, response, sock, buff.data(), n, err, recv_ttl, msg_trunc);
+}
+
+// mkudns_recv receives the query using @p sock.
+static bool mkudns_recv(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    mkudns_socket_t sock) {
+  if (query == nullptr || response == nullptr ||
+      sock == mkudns_socket_invalid) {
+    MKUDNS_ABORT();
+  }
+  pollfd pfd{};
+  pfd.events = POLLIN;
+  pfd.fd = sock;
+  int ret = mkudns_poll(&pfd, 1, query->timeout);
+  int err = mkudns_last_error();
   MKUDNS_HOOK(poll, ret);
   if (ret < 0) {
-    response->recv_event = mkudns_recv_event_new(query, "", -1);
+    response->recv_event = mkudns_recv_event_new(query, "", -1, err, -1);
+    response->events.push_back(response->recv_event);
     return false;
   }
   if (ret == 0) {
     response->recv_event = mkudns_generic_event_new(
         query, "mkudns.recv", "", "timed_out", -1);
+    response->events.push_back(response->recv_event);
     return false;
   }
-  std::array<char, 2048> buff;
-  auto n = recv(sock, buff.data(), buff.max_size(), 0);
-  MKUDNS_HOOK(recv, n);
-  response->recv_event = mkudns_recv_event_new(query, buff.data(), n);
-  if (n <= 0) return false;
-  return mkudns_parse(query, response, reinterpret_cast<uint8_t *>(buff.data()),
-                      static_cast<size_t>(n));
+  return mkudns_recvbuf(query, response, sock);
 }
 
 // mkudns_sendbuf sends the specified buffer using @p sock.
@@ -569,72 +2548,95 @@ static bool mkudns_sendbuf(
 #else
   ssize_t n = send(sock, base, count, 0);
 #endif
+  int err = mkudns_last_error();
   MKUDNS_HOOK(send, n);
-  response->send_event = mkudns_send_event_new(query, base, count, n);
+  response->send_event = mkudns_send_event_new(query, base, count, n, err);
+  response->events.push_back(response->send_event);
+  if (n > 0) response->sent_at = mkudns_now();
   return n > 0 && static_cast<size_t>(n) == count;
 }
 
-// mkudns_send sends the query using @p sock.
-static bool mkudns_send(
-    const mkudns_query_t *query, mkudns_response_t *response,
-    mkudns_socket_t sock) {
-  if (query == nullptr || response == nullptr ||
-      sock == mkudns_socket_invalid) {
-    MKUDNS_ABORT();
-  }
+// mkudns_create_query serializes @p query into @p msg.
+static bool mkudns_create_query(const mkudns_query_t *query, std::string *msg) {
+  if (query == nullptr || msg == nullptr) MKUDNS_ABORT();
   uint8_t *buff = nullptr;
   int bufsiz = 0;
   int ret = ares_create_query(query->name.c_str(), query->dnsclass, query->type,
-                              query->id, 1, &buff, &bufsiz, 0);
+                              query->id, 1, &buff, &bufsiz,
+                              static_cast<int>(query->edns_payload_size));
   MKUDNS_HOOK(ares_create_query, ret);
   if (ret != 0) return false;
   if (buff == nullptr || bufsiz < 0 || static_cast<size_t>(bufsiz) > SIZE_MAX) {
     MKUDNS_ABORT();
   }
-  bool good = mkudns_sendbuf(
-      query, response, sock, buff, static_cast<size_t>(bufsiz));
+  msg->assign(reinterpret_cast<char *>(buff), static_cast<size_t>(bufsiz));
   ares_free_string(buff);
-  return good;
+  return true;
 }
 
-// mkudns_sendrecv_ainfo sends the query and receives a response using
-// the specified @p sock for sending and receiving.
-static bool mkudns_sendrecv_sock(
+// mkudns_send sends the query using @p sock.
+static bool mkudns_send(
     const mkudns_query_t *query, mkudns_response_t *response,
-    addrinfo *aip, mkudns_socket_t sock) {
-  if (query == nullptr || response == nullptr || aip == nullptr ||
+    mkudns_socket_t sock) {
+  if (query == nullptr || response == nullptr ||
       sock == mkudns_socket_invalid) {
     MKUDNS_ABORT();
   }
+  std::string msg;
+  if (!mkudns_create_query(query, &msg)) return false;
+  return mkudns_sendbuf(query, response, sock,
+                        reinterpret_cast<const uint8_t *>(msg.data()),
+                        msg.size());
+}
+
+// mkudns_connect connects @p sock to @p aip and configures the TTL.
+static bool mkudns_connect(
+    const mkudns_query_t *query, addrinfo *aip, mkudns_socket_t sock) {
+  if (query == nullptr || aip == nullptr || sock == mkudns_socket_invalid) {
+    MKUDNS_ABORT();
+  }
   int ret = connect(sock, aip->ai_addr, aip->ai_addrlen);
   MKUDNS_HOOK(connect, ret);
   if (ret != 0) return false;
+#ifdef __linux__
+  {
+    // Queue ICMP errors, so we can fail fast and know who sent them.
+    int on = 1;
+    ret = (aip->ai_family == AF_INET6)
+        ? setsockopt(sock, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on))
+        : setsockopt(sock, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+    MKUDNS_HOOK(setsockopt_recverr, ret);
+    if (ret != 0) return false;
+  }
+#endif
+#if defined IP_RECVTTL && defined IPV6_RECVHOPLIMIT
+  {
+    // Receive the TTL of responses, which helps to spot injection.
+    int on = 1;
+    ret = (aip->ai_family == AF_INET6)
+        ? setsockopt(sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on))
+        : setsockopt(sock, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on));
+    MKUDNS_HOOK(setsockopt_recvttl, ret);
+    if (ret != 0) return false;
+  }
+#endif
   if (query->ttl >= 0) {
     int ttl = (query->ttl < 255) ? static_cast<int>(query->ttl) : 255;
-    ret = setsockopt(sock, IPPROTO_IP, IP_TTL,
+    ret = (aip->ai_family == AF_INET6)
+        ? setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+                     reinterpret_cast<char *>(&ttl), sizeof(ttl))
+        : setsockopt(sock, IPPROTO_IP, IP_TTL,
                      reinterpret_cast<char *>(&ttl), sizeof(ttl));
+    MKUDNS_HOOK(setsockopt_ttl, ret);
     if (ret != 0) return false;
   }
-  bool good = mkudns_send(query, response, sock);
-  if (!good) return false;
-  return mkudns_recv(query, response, sock);
-}
-
-// mkudns_sendrecv_ainfo sends the query and receives a response using
-// @p aip to create and connect a datagram socket.
-static bool mkudns_sendrecv_ainfo(
-    const mkudns_query_t *query, mkudns_response_t *response, addrinfo *aip) {
-  if (query == nullptr || response == nullptr || aip == nullptr) MKUDNS_ABORT();
-  mkudns_socket_t sock = socket(aip->ai_family, SOCK_DGRAM, 0);
-  MKUDNS_HOOK(socket, sock);
-  if (sock == mkudns_socket_invalid) return false;
-  bool good = mkudns_sendrecv_sock(query, response, aip, sock);
-  MKUDNS_CLOSESOCKET(sock);
-  return good;
+  return true;
 }
 
-// mkudns_sendrecv sends the query and receives the response.
-static bool mkudns_sendrecv(
+// mkudns_open returns a datagram socket connected to the server of @p query
+// or mkudns_socket_invalid on failure. In the latter case, @p response may
+// contain a send event describing the error.
+static mkudns_socket_t mkudns_open(
     const mkudns_query_t *query, mkudns_response_t *response) {
   if (query == nullptr || response == nullptr) MKUDNS_ABORT();
   addrinfo hints{};
@@ -647,20 +2649,4200 @@ static bool mkudns_sendrecv(
   if (ret != 0) {
     response->send_event = mkudns_generic_event_new(
         query, "mkudns.send", "", "invalid_server_endpoint", -1);
-    return false;
+    response->events.push_back(response->send_event);
+    return mkudns_socket_invalid;
   }
   if (rp == nullptr || rp->ai_next != nullptr) MKUDNS_ABORT();
-  bool good = mkudns_sendrecv_ainfo(query, response, rp);
+  mkudns_socket_t sock = socket(rp->ai_family, SOCK_DGRAM, 0);
+  MKUDNS_HOOK(socket, sock);
+  if (sock != mkudns_socket_invalid && !mkudns_connect(query, rp, sock)) {
+    MKUDNS_CLOSESOCKET(sock);
+    sock = mkudns_socket_invalid;
+  }
   freeaddrinfo(rp);
-  return good;
+  return sock;
 }
 
-mkudns_response_t *mkudns_query_perform_nonnull(const mkudns_query_t *query) {
+// mkudns_cache
+// ------------
+
+// mkudns_cache_shards is the number of cache shards. Each shard has its own
+// lock, so that concurrent lookups for distinct keys rarely contend.
+constexpr size_t mkudns_cache_shards = 16;
+
+// mkudns_cache_max_entries is the maximum number of entries per shard.
+constexpr size_t mkudns_cache_max_entries = 1024;
+
+// mkudns_cache_entry is a cached answer.
+struct mkudns_cache_entry {
+  // addresses contains the resolved addresses.
+  std::vector<std::string> addresses;
+
+  // address_ttls contains the TTL of each address when stored.
+  std::vector<int64_t> address_ttls;
+
+  // cname contains the response CNAME.
+  std::string cname;
+
+  // cnames contains the CNAME chain.
+  std::vector<std::string> cnames;
+
+  // expires_at is when the entry expires.
+  int64_t expires_at = 0;
+
+  // messages contains the DNS messages.
+  std::vector<std::string> messages;
+
+  // negative indicates whether this is a NXDOMAIN or NODATA answer.
+  bool negative = false;
+
+  // primary is the index of the message that answers the query.
+  int64_t primary = -1;
+
+  // records contains the records of the messages.
+  std::vector<mkudns_rr> records;
+
+  // stored_at is when we stored the entry.
+  int64_t stored_at = 0;
+};
+
+// mkudns_cache_shard is a shard of the cache.
+struct mkudns_cache_shard {
+  // entries maps a key to the corresponding entry.
+  std::map<std::string, mkudns_cache_entry> entries;
+
+  // mutex protects entries against concurrent accesses.
+  std::mutex mutex;
+};
+
+// mkudns_cache contains the cached answers.
+struct mkudns_cache {
+  // hits is the number of positive cache hits.
+  std::atomic<int64_t> hits{0};
+
+  // misses is the number of cache misses.
+  std::atomic<int64_t> misses{0};
+
+  // negative_hits is the number of negative cache hits.
+  std::atomic<int64_t> negative_hits{0};
+
+  // shards contains the cache shards.
+  std::array<mkudns_cache_shard, mkudns_cache_shards> shards;
+};
+
+// mkudns_cache_singleton_nonnull returns the cache singleton. We never
+// destroy the singleton, since detached threads resolving may outlive main.
+// This function will never return a null pointer.
+static mkudns_cache *mkudns_cache_singleton_nonnull() {
+  static std::mutex mutex;
+  static mkudns_cache *singleton = nullptr;
+  std::unique_lock<std::mutex> _{mutex};
+  if (singleton == nullptr) singleton = new mkudns_cache;
+  return singleton;
+}
+
+// mkudns_cache_key returns the cache key of @p query.
+static std::string mkudns_cache_key(const mkudns_query_t *query) {
   if (query == nullptr) MKUDNS_ABORT();
-  mkudns_response_uptr response{new mkudns_response_t};
-  if (!mkudns_sendrecv(query, response.get())) return response.release();
-  response->good = true;
-  return response.release();
+  std::string key = mkudns_rtts_key(query->server_address, query->server_port);
+  key += " ";
+  for (char ch : query->name) {
+    key += static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+  }
+  key += " ";
+  key += query->dual_stack ? "dual_stack" : std::to_string(query->type);
+  return key;
+}
+
+// mkudns_cache_shard_for returns the shard containing @p key.
+static mkudns_cache_shard *mkudns_cache_shard_for(const std::string &key) {
+  mkudns_cache *cache = mkudns_cache_singleton_nonnull();
+  return &cache->shards[std::hash<std::string>{}(key) % cache->shards.size()];
+}
+
+// mkudns_cache_message_negative_ttl returns the number of seconds for which
+// we can cache the negative answer in the message at index @p message of
+// @p response, which is the smaller of the TTL and of the minimum field of
+// the authority SOA, or -1 if the message is not a negative answer (i.e.
+// NXDOMAIN or NODATA) or it does not have a SOA.
+static int64_t mkudns_cache_message_negative_ttl(
+    const mkudns_response_t *response, size_t message) {
+  if (response == nullptr || message >= response->messages.size()) {
+    MKUDNS_ABORT();
+  }
+  int64_t rcode = mkudns_message_rcode(response, message);
+  if (rcode != ns_r_nxdomain && rcode != ns_r_noerror) return -1;
+  const std::string &data = response->messages[message];
+  for (const mkudns_rr &rr : response->records) {
+    if (rr.message != message || rr.section != mkudns_section::authority ||
+        rr.type != ns_t_soa || rr.rdlength < 4) {
+      continue;
+    }
+    size_t off = rr.rdata + rr.rdlength - 4;  // minimum is the last field
+    uint32_t minimum = 0;
+    if (!mkudns_wire_u32(reinterpret_cast<const uint8_t *>(data.data()),
+                         data.size(), &off, &minimum)) {
+      return -1;
+    }
+    return std::min(rr.ttl, minimum);
+  }
+  return -1;
+}
+
+// mkudns_cache_negative_ttl returns the number of seconds for which we can
+// cache the negative answer in @p response to @p query, or -1 if it is not
+// a negative answer. A dual stack answer is negative only if both the A and
+// the AAAA replies are, in which case we use the smaller TTL, since we would
+// otherwise cache a failure of one query as the name having no data.
+static int64_t mkudns_cache_negative_ttl(
+    const mkudns_query_t *query, const mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  if (!query->dual_stack) {
+    if (response->primary < 0) return -1;
+    return mkudns_cache_message_negative_ttl(
+        response, static_cast<size_t>(response->primary));
+  }
+  if (response->messages.size() != 2) return -1;
+  int64_t ttl = mkudns_cache_message_negative_ttl(response, 0);
+  int64_t other = mkudns_cache_message_negative_ttl(response, 1);
+  return (ttl < 0 || other < 0) ? -1 : std::min(ttl, other);
+}
+
+// mkudns_cache_ttl returns the number of seconds for which we can cache
+// @p response. For good responses, this is the smallest TTL of the answer
+// records, otherwise it is the negative answer TTL. Either way, the result
+// is clamped within the bounds configured in @p query.
+static int64_t mkudns_cache_ttl(
+    const mkudns_query_t *query, const mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  int64_t ttl = -1;
+  if (response->good) {
+    for (const mkudns_rr &rr : response->records) {
+      if (rr.section != mkudns_section::answer) continue;
+      if (ttl < 0 || rr.ttl < ttl) ttl = rr.ttl;
+    }
+  } else {
+    ttl = mkudns_cache_negative_ttl(query, response);
+  }
+  if (ttl < 0) return 0;
+  ttl = std::max(ttl, query->cache_min_ttl);
+  return std::min(ttl, query->cache_max_ttl);
+}
+
+// mkudns_cache_store stores the answer in @p response into the cache, unless
+// it is neither good nor negative, or the TTL does not allow it.
+static void mkudns_cache_store(
+    const mkudns_query_t *query, const mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  int64_t ttl = mkudns_cache_ttl(query, response);
+  if (ttl <= 0) return;
+  mkudns_cache_entry entry;
+  entry.negative = !response->good;
+  entry.addresses = response->addresses;
+  entry.address_ttls = response->address_ttls;
+  entry.cname = response->cname;
+  entry.cnames = response->cnames;
+  entry.messages = response->messages;
+  entry.primary = response->primary;
+  entry.records = response->records;
+  entry.stored_at = mkudns_now();
+  entry.expires_at = entry.stored_at + ttl * 1000;
+  std::string key = mkudns_cache_key(query);
+  mkudns_cache_shard *shard = mkudns_cache_shard_for(key);
+  std::unique_lock<std::mutex> _{shard->mutex};
+  if (shard->entries.size() >= mkudns_cache_max_entries &&
+      shard->entries.count(key) <= 0) {
+    // Make room by removing the expired entries or the closest to expiry.
+    auto victim = shard->entries.end();
+    for (auto it = shard->entries.begin(); it != shard->entries.end();) {
+      if (it->second.expires_at <= entry.stored_at) {
+        it = shard->entries.erase(it);
+        continue;
+      }
+      if (victim == shard->entries.end() ||
+          it->second.expires_at < victim->second.expires_at) {
+        victim = it;
+      }
+      ++it;
+    }
+    if (shard->entries.size() >= mkudns_cache_max_entries) {
+      shard->entries.erase(victim);
+    }
+  }
+  shard->entries[key] = std::move(entry);
+}
+
+// mkudns_cache_lookup fills @p response with the cached answer to @p query,
+// if any, with the TTLs decreased by the time spent in the cache, and adds a
+// `"mkudns.cache_hit"` event. Returns whether there was a cached answer.
+static bool mkudns_cache_lookup(
+    const mkudns_query_t *query, mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  mkudns_cache *cache = mkudns_cache_singleton_nonnull();
+  std::string key = mkudns_cache_key(query);
+  mkudns_cache_shard *shard = mkudns_cache_shard_for(key);
+  int64_t now = mkudns_now();
+  mkudns_cache_entry entry;
+  {
+    std::unique_lock<std::mutex> _{shard->mutex};
+    auto it = shard->entries.find(key);
+    if (it != shard->entries.end() && it->second.expires_at <= now) {
+      shard->entries.erase(it);
+      it = shard->entries.end();
+    }
+    if (it == shard->entries.end()) {
+      cache->misses += 1;
+      return false;
+    }
+    entry = it->second;
+  }
+  if (entry.negative) {
+    cache->negative_hits += 1;
+  } else {
+    cache->hits += 1;
+  }
+  int64_t age = (now - entry.stored_at) / 1000;
+  for (int64_t &ttl : entry.address_ttls) {
+    if (ttl >= 0) ttl = std::max<int64_t>(ttl - age, 0);
+  }
+  for (mkudns_rr &rr : entry.records) {
+    if (rr.type == ns_t_opt) continue;  // its TTL field is not a TTL
+    rr.ttl = static_cast<uint32_t>(std::max<int64_t>(rr.ttl - age, 0));
+    std::string &message = entry.messages[rr.message];
+    size_t off = rr.rdata - 6;  // TTL and RDLENGTH precede the data
+    message[off] = static_cast<char>((rr.ttl >> 24) & 0xff);
+    message[off + 1] = static_cast<char>((rr.ttl >> 16) & 0xff);
+    message[off + 2] = static_cast<char>((rr.ttl >> 8) & 0xff);
+    message[off + 3] = static_cast<char>(rr.ttl & 0xff);
+  }
+  response->addresses = std::move(entry.addresses);
+  response->address_ttls = std::move(entry.address_ttls);
+  response->cname = std::move(entry.cname);
+  response->cnames = std::move(entry.cnames);
+  response->messages = std::move(entry.messages);
+  response->primary = entry.primary;
+  response->records = std::move(entry.records);
+  response->good = !entry.negative;
+  nlohmann::json extra;
+  extra["cache_age"] = now - entry.stored_at;
+  extra["cache_expires_in"] = entry.expires_at - now;
+  extra["negative"] = entry.negative;
+  response->events.push_back(mkudns_generic_event_new(
+      query, "mkudns.cache_hit", "", "no_error", 0, extra));
+  return true;
+}
+
+int64_t mkudns_cache_get_hits() {
+  return mkudns_cache_singleton_nonnull()->hits;
+}
+
+int64_t mkudns_cache_get_negative_hits() {
+  return mkudns_cache_singleton_nonnull()->negative_hits;
+}
+
+int64_t mkudns_cache_get_misses() {
+  return mkudns_cache_singleton_nonnull()->misses;
+}
+
+// mkudns_tcp
+// ----------
+
+// MKUDNS_MSG_NOSIGNAL prevents send from raising SIGPIPE, where possible.
+#ifdef MSG_NOSIGNAL
+#define MKUDNS_MSG_NOSIGNAL MSG_NOSIGNAL
+#else
+#define MKUDNS_MSG_NOSIGNAL 0
+#endif
+
+// mkudns_tcp_idle_timeout is the number of milliseconds after which we close
+// a pooled TCP connection that has no outstanding queries.
+constexpr int64_t mkudns_tcp_idle_timeout = 10000;
+
+// mkudns_tcp_conn is a persistent TCP connection to a DNS server, which
+// may be shared by several outstanding queries (see RFC 7766).
+struct mkudns_tcp_conn {
+  // ~mkudns_tcp_conn closes the socket.
+  ~mkudns_tcp_conn() {
+    if (sock != mkudns_socket_invalid) MKUDNS_CLOSESOCKET(sock);
+  }
+
+  // broken indicates that the connection cannot be used anymore.
+  bool broken = false;
+
+  // cond allows to wait for replies or for the reader role to be free.
+  std::condition_variable cond;
+
+  // error is the error that broke the connection.
+  std::string error;
+
+  // idle_deadline is when the connection becomes idle if unused.
+  int64_t idle_deadline = 0;
+
+  // mutex protects the fields that follow, with the exception of sock.
+  std::mutex mutex;
+
+  // pending contains the IDs of the outstanding queries.
+  std::set<uint16_t> pending;
+
+  // rbuf contains the bytes read but not yet split into messages.
+  std::string rbuf;
+
+  // reading indicates that a thread is reading from sock.
+  bool reading = false;
+
+  // replies contains the replies not yet collected, by query ID.
+  std::map<uint16_t, std::string> replies;
+
+  // sock is the connection socket. It is set before sharing the connection
+  // and it is not modified afterwards.
+  mkudns_socket_t sock = mkudns_socket_invalid;
+
+  // write_mutex serializes writing messages on sock.
+  std::mutex write_mutex;
+};
+
+// mkudns_tcp_pool contains the persistent TCP connections.
+struct mkudns_tcp_pool {
+  // conns maps a server endpoint to its connection.
+  std::map<std::string, std::shared_ptr<mkudns_tcp_conn>> conns;
+
+  // mutex protects this structure against concurrent accesses.
+  std::mutex mutex;
+
+  // reaping indicates whether the background thread that closes the idle
+  // connections is running, which happens as long as there are connections.
+  bool reaping = false;
+};
+
+// mkudns_tcp_pool_singleton_nonnull returns the TCP pool singleton. We never
+// destroy the singleton, since the reaping thread may outlive main. This
+// function will never return a null pointer.
+static mkudns_tcp_pool *mkudns_tcp_pool_singleton_nonnull() {
+  static std::mutex mutex;
+  static mkudns_tcp_pool *singleton = nullptr;
+  std::unique_lock<std::mutex> _{mutex};
+  if (singleton == nullptr) singleton = new mkudns_tcp_pool;
+  return singleton;
+}
+
+// mkudns_tcp_pool_reap is the main loop of the background thread that
+// removes the broken and idle connections from @p pool, which closes them
+// unless a query is still using them. The thread exits when the pool is
+// empty. We sleep until the earliest idle deadline, and we wake up at least
+// once per idle timeout to check the connections with outstanding queries.
+static void mkudns_tcp_pool_reap(mkudns_tcp_pool *pool) {
+  if (pool == nullptr) MKUDNS_ABORT();
+  for (;;) {
+    std::unique_lock<std::mutex> lock{pool->mutex};
+    int64_t now = mkudns_now();
+    int64_t next = now + mkudns_tcp_idle_timeout;
+    for (auto it = pool->conns.begin(); it != pool->conns.end();) {
+      std::unique_lock<std::mutex> conn_lock{it->second->mutex};
+      bool idle = it->second->pending.empty();
+      bool expired = it->second->broken ||
+                     (idle && now >= it->second->idle_deadline);
+      if (!expired && idle) next = std::min(next, it->second->idle_deadline);
+      conn_lock.unlock();
+      it = expired ? pool->conns.erase(it) : std::next(it);
+    }
+    if (pool->conns.empty()) {
+      pool->reaping = false;
+      return;
+    }
+    lock.unlock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(next - now));
+  }
+}
+
+// mkudns_set_nonblocking makes @p sock nonblocking.
+static bool mkudns_set_nonblocking(mkudns_socket_t sock) {
+  if (sock == mkudns_socket_invalid) MKUDNS_ABORT();
+#ifdef _WIN32
+  u_long on = 1;
+  return ioctlsocket(sock, FIONBIO, &on) == 0;
+#else
+  int flags = fcntl(sock, F_GETFL);
+  return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// mkudns_would_block returns whether @p err means that a nonblocking
+// operation could not complete immediately.
+static bool mkudns_would_block(int err) {
+#ifdef _WIN32
+  return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+#else
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS;
+#endif
+}
+
+// mkudns_poll_one waits until @p sock is ready for @p events or @p deadline
+// expires (a negative deadline means no deadline). Returns like poll.
+static int mkudns_poll_one(
+    mkudns_socket_t sock, short events, int64_t deadline) {
+  if (sock == mkudns_socket_invalid) MKUDNS_ABORT();
+  pollfd pfd{};
+  pfd.events = events;
+  pfd.fd = sock;
+  int64_t now = mkudns_now();
+  if (deadline >= 0 && now >= deadline) return 0;
+  return mkudns_poll(&pfd, 1, (deadline >= 0) ? deadline - now : -1);
+}
+
+// mkudns_tcp_connect creates a new connection to the server of @p query
+// before @p deadline, and records the connect event into @p response.
+static std::shared_ptr<mkudns_tcp_conn> mkudns_tcp_connect(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    int64_t deadline) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  addrinfo hints{};
+  hints.ai_flags |= AI_NUMERICHOST | AI_NUMERICSERV;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *rp = nullptr;
+  int ret = getaddrinfo(query->server_address.c_str(),
+                        query->server_port.c_str(), &hints, &rp);
+  MKUDNS_HOOK(getaddrinfo, ret);
+  if (ret != 0) {
+    response->events.push_back(mkudns_generic_event_new(
+        query, "mkudns.connect", "", "invalid_server_endpoint", -1));
+    return nullptr;
+  }
+  if (rp == nullptr) MKUDNS_ABORT();
+  std::shared_ptr<mkudns_tcp_conn> conn{new mkudns_tcp_conn};
+  conn->sock = socket(rp->ai_family, SOCK_STREAM, 0);
+  int err = mkudns_last_error();
+  MKUDNS_HOOK(socket, conn->sock);
+  if (conn->sock != mkudns_socket_invalid) {
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    (void)setsockopt(conn->sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    ret = mkudns_set_nonblocking(conn->sock) ? 0 : -1;
+    err = mkudns_last_error();
+  }
+  if (conn->sock != mkudns_socket_invalid && ret == 0) {
+    ret = connect(conn->sock, rp->ai_addr, rp->ai_addrlen);
+    err = mkudns_last_error();
+    MKUDNS_HOOK(connect, ret);
+    if (ret != 0 && mkudns_would_block(err)) {
+      ret = mkudns_poll_one(conn->sock, POLLOUT, deadline);
+      if (ret == 0) {
+        err = 0;
+        ret = -1;
+      } else if (ret > 0) {
+        socklen_t len = sizeof(err);
+        ret = getsockopt(conn->sock, SOL_SOCKET, SO_ERROR,
+                         reinterpret_cast<char *>(&err), &len);
+        if (ret == 0 && err != 0) ret = -1;
+      }
+    }
+  }
+  freeaddrinfo(rp);
+  bool timed_out = (ret != 0 && err == 0);
+  response->events.push_back(mkudns_generic_event_new(
+      query, "mkudns.connect", "",
+      timed_out ? "timed_out" : mkudns_tcp_maybe_errno(ret, err), ret));
+  if (ret != 0) return nullptr;
+  return conn;
+}
+
+// mkudns_tcp_pool_find returns the usable connection of @p pool for @p key
+// and extends its idle deadline, or returns null. Call with pool->mutex
+// locked.
+static std::shared_ptr<mkudns_tcp_conn> mkudns_tcp_pool_find(
+    mkudns_tcp_pool *pool, const std::string &key) {
+  if (pool == nullptr) MKUDNS_ABORT();
+  auto it = pool->conns.find(key);
+  if (it == pool->conns.end()) return nullptr;
+  std::unique_lock<std::mutex> _{it->second->mutex};
+  if (it->second->broken) return nullptr;
+  // So that the reaping thread does not remove the connection before we
+  // add our query to its pending queries.
+  it->second->idle_deadline = mkudns_now() + mkudns_tcp_idle_timeout;
+  return it->second;
+}
+
+// mkudns_tcp_pool_get returns a connection to the server of @p query, either
+// from the pool or by connecting before @p deadline. On return, @p reused
+// tells whether the connection comes from the pool. When several threads
+// connect to the same server concurrently, they all end up using the first
+// connection added to the pool, and we close the others.
+static std::shared_ptr<mkudns_tcp_conn> mkudns_tcp_pool_get(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    int64_t deadline, bool *reused) {
+  if (query == nullptr || response == nullptr || reused == nullptr) {
+    MKUDNS_ABORT();
+  }
+  mkudns_tcp_pool *pool = mkudns_tcp_pool_singleton_nonnull();
+  std::string key = mkudns_rtts_key(query->server_address, query->server_port);
+  {
+    std::unique_lock<std::mutex> _{pool->mutex};
+    std::shared_ptr<mkudns_tcp_conn> conn = mkudns_tcp_pool_find(pool, key);
+    if (conn != nullptr) {
+      *reused = true;
+      return conn;
+    }
+  }
+  *reused = false;
+  std::shared_ptr<mkudns_tcp_conn> conn = mkudns_tcp_connect(
+      query, response, deadline);
+  if (conn == nullptr) return nullptr;
+  conn->idle_deadline = mkudns_now() + mkudns_tcp_idle_timeout;
+  std::unique_lock<std::mutex> _{pool->mutex};
+  std::shared_ptr<mkudns_tcp_conn> other = mkudns_tcp_pool_find(pool, key);
+  if (other != nullptr) {
+    *reused = true;
+    return other;  // our connection closes when we return
+  }
+  pool->conns[key] = conn;
+  if (!pool->reaping) {
+    pool->reaping = true;
+    std::thread{mkudns_tcp_pool_reap, pool}.detach();
+  }
+  return conn;
+}
+
+// mkudns_tcp_pool_remove removes @p conn from the pool, if it's there.
+static void mkudns_tcp_pool_remove(
+    const mkudns_query_t *query, const std::shared_ptr<mkudns_tcp_conn> &conn) {
+  if (query == nullptr || conn == nullptr) MKUDNS_ABORT();
+  mkudns_tcp_pool *pool = mkudns_tcp_pool_singleton_nonnull();
+  std::string key = mkudns_rtts_key(query->server_address, query->server_port);
+  std::unique_lock<std::mutex> _{pool->mutex};
+  auto it = pool->conns.find(key);
+  if (it != pool->conns.end() && it->second == conn) pool->conns.erase(it);
+}
+
+// mkudns_tcp_conn_break marks @p conn as broken because of @p error and wakes
+// up all the threads waiting for replies. Call with conn->mutex locked.
+static void mkudns_tcp_conn_break(
+    mkudns_tcp_conn *conn, const std::string &error) {
+  if (conn == nullptr) MKUDNS_ABORT();
+  if (!conn->broken) {
+    conn->broken = true;
+    conn->error = error;
+  }
+  conn->cond.notify_all();
+}
+
+// mkudns_tcp_send sends @p msg, prefixed by its length, over @p conn before
+// @p deadline, records the send event, and returns whether it succeeded.
+static bool mkudns_tcp_send(
+    const mkudns_query_t *query, mkudns_response_t *response,
+    mkudns_tcp_conn *conn, const std::string &msg, int64_t deadline) {
+  if (query == nullptr || response == nullptr || conn == nullptr ||
+      msg.size() > UINT16_MAX) {
+    MKUDNS_ABORT();
+  }
+  {
+    std::unique_lock<std::mutex> _{conn->mutex};
+    conn->pending.insert(query->id);
+  }
+  std::string frame;
+  frame += static_cast<char>((msg.size() >> 8) & 0xff);
+  frame += static_cast<char>(msg.size() & 0xff);
+  frame += msg;
+  size_t off = 0;
+  int64_t ret = 0;
+  int err = 0;
+  {
+    std::unique_lock<std::mutex> _{conn->write_mutex};
+    while (off < frame.size()) {
+#ifdef _WIN32
+      ret = send(conn->sock, frame.data() + off,
+                 static_cast<int>(frame.size() - off), 0);
+#else
+      ret = send(conn->sock, frame.data() + off, frame.size() - off,
+                 MKUDNS_MSG_NOSIGNAL);
+#endif
+      err = mkudns_last_error();
+      MKUDNS_HOOK(send, ret);
+      if (ret > 0) {
+        off += static_cast<size_t>(ret);
+        continue;
+      }
+      if (ret < 0 && mkudns_would_block(err) &&
+          mkudns_poll_one(conn->sock, POLLOUT, deadline) > 0) {
+        continue;
+      }
+      break;
+    }
+  }
+  bool good = (off == frame.size());
+  if (!good) {
+    std::unique_lock<std::mutex> _{conn->mutex};
+    conn->pending.erase(query->id);
+    // A partially written message would corrupt the stream.
+    if (off > 0 || ret >= 0 || !mkudns_would_block(err)) {
+      mkudns_tcp_conn_break(conn, (ret < 0) ? mkudns_tcp_error_string(err)
+                                            : "timed_out");
+    }
+  }
+  int64_t retval = good ? static_cast<int64_t>(msg.size()) : -1;
+  response->send_event = mkudns_generic_event_new(
+      query, "mkudns.send",
+      mkudns_maybe_base64(msg.data(), static_cast<int64_t>(msg.size())),
+      mkudns_tcp_maybe_errno(retval, err), retval);
+  response->events.push_back(response->send_event);
+  if (good) response->sent_at = mkudns_now();
+  return good;
+}
+
+// mkudns_tcp_read reads from @p conn until @p deadline and moves the complete
+// messages into the replies. Call with conn->mutex locked, through @p lock,
+// and after having acquired the reader role. Returns with @p lock locked.
+static void mkudns_tcp_read(
+    mkudns_tcp_conn *conn, std::unique_lock<std::mutex> &lock,
+    int64_t deadline) {
+  if (conn == nullptr || !conn->reading) MKUDNS_ABORT();
+  lock.unlock();
+  std::array<char, 4096> buff;
+  int64_t n = -1;
+  int err = 0;
+  int ret = mkudns_poll_one(conn->sock, POLLIN, deadline);
+  err = mkudns_last_error();
+  MKUDNS_HOOK(poll, ret);
+  if (ret > 0) {
+#ifdef _WIN32
+    n = recv(conn->sock, buff.data(), static_cast<int>(buff.size()), 0);
+#else
+    n = recv(conn->sock, buff.data(), buff.size(), 0);
+#endif
+    err = mkudns_last_error();
+    MKUDNS_HOOK(recv, n);
+  }
+  lock.lock();
+  conn->reading = false;
+  conn->cond.notify_all();
+  if (ret < 0) {
+    mkudns_tcp_conn_break(conn, mkudns_tcp_error_string(err));
+    return;
+  }
+  if (ret == 0 || (n < 0 && mkudns_would_block(err))) return;
+  if (n <= 0) {
+    mkudns_tcp_conn_break(conn, (n == 0) ? "eof_error"
+                                         : mkudns_tcp_error_string(err));
+    return;
+  }
+  conn->rbuf.append(buff.data(), static_cast<size_t>(n));
+  while (conn->rbuf.size() >= 2) {
+    size_t len = (static_cast<size_t>(static_cast<uint8_t>(conn->rbuf[0]))
+                  << 8) | static_cast<uint8_t>(conn->rbuf[1]);
+    if (conn->rbuf.size() < len + 2) break;
+    std::string msg = conn->rbuf.substr(2, len);
+    conn->rbuf.erase(0, len + 2);
+    int64_t id = mkudns_get_id(msg.data(), static_cast<int64_t>(msg.size()));
+    if (id < 0 || conn->pending.count(static_cast<uint16_t>(id)) <= 0) {
+      continue;  // nobody is waiting for this reply
+    }
+    conn->replies[static_cast<uint16_t>(id)] = std::move(msg);
+  }
+}
+
+// mkudns_tcp_wait waits until @p deadline for the reply to @p query over
+// @p conn. Returns "no_error" and fills @p reply on success, and returns the
+// error that occurred otherwise. Any thread waiting for a reply may read on
+// behalf of the others, so replies may arrive in any order.
+static std::string mkudns_tcp_wait(
+    const mkudns_query_t *query, mkudns_tcp_conn *conn, int64_t deadline,
+    std::string *reply) {
+  if (query == nullptr || conn == nullptr || reply == nullptr) MKUDNS_ABORT();
+  std::unique_lock<std::mutex> lock{conn->mutex};
+  std::string error = "no_error";
+  for (;;) {
+    auto it = conn->replies.find(query->id);
+    if (it != conn->replies.end()) {
+      *reply = std::move(it->second);
+      conn->replies.erase(it);
+      break;
+    }
+    if (conn->broken) {
+      error = conn->error;
+      break;
+    }
+    int64_t now = mkudns_now();
+    if (deadline >= 0 && now >= deadline) {
+      error = "timed_out";
+      break;
+    }
+    if (!conn->reading) {
+      conn->reading = true;
+      mkudns_tcp_read(conn, lock, deadline);
+      continue;
+    }
+    if (deadline >= 0) {
+      conn->cond.wait_for(lock, std::chrono::milliseconds(deadline - now));
+    } else {
+      conn->cond.wait(lock);
+    }
+  }
+  conn->pending.erase(query->id);
+  conn->idle_deadline = mkudns_now() + mkudns_tcp_idle_timeout;
+  return error;
+}
+
+// mkudns_sendrecv_tcp sends @p queries, which share the same server, using
+// a pipelined persistent TCP connection, and receives their responses into
+// @p response. Returns whether at least one query succeeded. If a reused
+// connection fails before we receive any reply, we retry once using a new
+// connection, since the server may have closed the idle connection.
+static bool mkudns_sendrecv_tcp(
+    const std::vector<mkudns_query_t> &queries, mkudns_response_t *response) {
+  if (queries.empty() || response == nullptr) MKUDNS_ABORT();
+  const mkudns_query_t *query = &queries[0];
+  int64_t start = mkudns_now();
+  int64_t deadline = (query->timeout >= 0) ? start + query->timeout : -1;
+  bool good = false;
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    bool reused = false;
+    std::shared_ptr<mkudns_tcp_conn> conn = mkudns_tcp_pool_get(
+        query, response, deadline, &reused);
+    if (conn == nullptr) return false;
+    std::vector<bool> sent;
+    std::string send_event;
+    for (const mkudns_query_t &q : queries) {
+      std::string msg;
+      sent.push_back(mkudns_create_query(&q, &msg) &&
+                     mkudns_tcp_send(&q, response, conn.get(), msg, deadline));
+      if (send_event.empty()) send_event = response->send_event;
+    }
+    response->send_event = send_event;
+    bool received = false;
+    bool retry = false;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      if (!sent[i]) {
+        retry = true;
+        continue;
+      }
+      std::string reply;
+      std::string error = mkudns_tcp_wait(
+          &queries[i], conn.get(), deadline, &reply);
+      if (error != "no_error") {
+        std::string event = mkudns_generic_event_new(
+            &queries[i], "mkudns.recv", "", error, -1);
+        if (i == 0) response->recv_event = event;
+        response->events.push_back(event);
+        retry = retry || error != "timed_out";
+        continue;
+      }
+      received = true;
+      if (response->rtt < 0) response->rtt = mkudns_now() - response->sent_at;
+      std::string event = mkudns_recv_event_new(
+          &queries[i], reply.data(), static_cast<int64_t>(reply.size()), 0,
+          -1);
+      if (i == 0) response->recv_event = event;
+      response->events.push_back(event);
+      if (!reply.empty() &&
+          mkudns_parse(&queries[i], response,
+                       reinterpret_cast<const uint8_t *>(reply.data()),
+                       reply.size())) {
+        good = true;
+      }
+    }
+    if (received || !reused || !retry) break;
+    mkudns_tcp_pool_remove(query, conn);
+  }
+  if (good) {
+    mkudns_rtts_add(query->server_address, query->server_port, response->rtt);
+  }
+  return good;
+}
+
+// mkudns_sendrecv_tcp_query sends @p query, and possibly its AAAA twin for
+// dual stack queries, over TCP and receives the responses into @p response.
+static bool mkudns_sendrecv_tcp_query(
+    const mkudns_query_t *query, mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  if (!query->dual_stack) {
+    return mkudns_sendrecv_tcp({*query}, response);
+  }
+  std::vector<mkudns_query_t> queries{*query, *query};
+  queries[0].type = ns_t_a;
+  queries[1].type = ns_t_aaaa;
+  queries[1].id = mkudns_ids_get();
+  bool good = mkudns_sendrecv_tcp(queries, response);
+  mkudns_ids_put(queries[1].id);
+  return good && !response->addresses.empty();
+}
+
+// mkudns_tcp_fallback retries @p query over TCP because we received a
+// truncated UDP response, using the time left since @p start.
+static bool mkudns_tcp_fallback(
+    const mkudns_query_t *query, mkudns_response_t *response, int64_t start) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  mkudns_query_t tcp_query = *query;
+  tcp_query.tcp = true;
+  if (query->timeout >= 0) {
+    tcp_query.timeout = query->timeout - (mkudns_now() - start);
+  }
+  if (query->timeout >= 0 && tcp_query.timeout <= 0) {
+    response->events.push_back(mkudns_generic_event_new(
+        &tcp_query, "mkudns.tcp_fallback", "", "timed_out", -1));
+    return false;
+  }
+  response->events.push_back(mkudns_generic_event_new(
+      &tcp_query, "mkudns.tcp_fallback", "", "no_error", 0));
+  mkudns_forget_answer(response);
+  response->rtt = -1;
+  return mkudns_sendrecv_tcp_query(&tcp_query, response);
+}
+
+// mkudns_lingerer
+// ---------------
+
+// mkudns_lingering is a socket whose linger window is open.
+struct mkudns_lingering {
+  // deadline is when the linger window closes.
+  int64_t deadline = 0;
+
+  // linger is where we store the late events.
+  std::shared_ptr<mkudns_linger> linger;
+
+  // queries contains the queries sent using sock.
+  std::vector<mkudns_query_t> queries;
+
+  // sock is the socket on which we keep receiving.
+  mkudns_socket_t sock = mkudns_socket_invalid;
+};
+
+// mkudns_lingerer receives late responses in a background thread, which
+// runs as long as there are open linger windows.
+struct mkudns_lingerer {
+  // incoming contains the sockets not yet seen by the background thread.
+  std::vector<mkudns_lingering> incoming;
+
+  // mutex protects this structure against concurrent accesses.
+  std::mutex mutex;
+
+  // running indicates whether the background thread is running.
+  bool running = false;
+
+  // wakeup is a datagram socket connected to itself that we use to wake
+  // up the background thread when there are incoming sockets.
+  mkudns_socket_t wakeup = mkudns_socket_invalid;
+};
+
+// mkudns_lingerer_max_wait is the maximum number of milliseconds for which
+// the background thread blocks when we could not create the wakeup socket.
+constexpr int64_t mkudns_lingerer_max_wait = 50;
+
+// mkudns_wakeup_new_or_invalid returns a datagram socket connected to itself
+// or mkudns_socket_invalid on failure.
+static mkudns_socket_t mkudns_wakeup_new_or_invalid() {
+  mkudns_socket_t sock = socket(AF_INET, SOCK_DGRAM, 0);
+  MKUDNS_HOOK(socket, sock);
+  if (sock == mkudns_socket_invalid) return sock;
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (bind(sock, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) != 0 ||
+      getsockname(sock, reinterpret_cast<sockaddr *>(&sin), &len) != 0 ||
+      connect(sock, reinterpret_cast<sockaddr *>(&sin), len) != 0) {
+    MKUDNS_CLOSESOCKET(sock);
+    return mkudns_socket_invalid;
+  }
+  return sock;
+}
+
+// mkudns_lingerer_singleton_nonnull returns the lingerer singleton. We never
+// destroy the singleton, since the background thread may outlive main. This
+// function will never return a null pointer.
+static mkudns_lingerer *mkudns_lingerer_singleton_nonnull() {
+  static std::mutex mutex;
+  static mkudns_lingerer *singleton = nullptr;
+  std::unique_lock<std::mutex> _{mutex};
+  if (singleton == nullptr) {
+    singleton = new mkudns_lingerer;
+    singleton->wakeup = mkudns_wakeup_new_or_invalid();
+  }
+  return singleton;
+}
+
+// mkudns_lingering_recv receives a datagram from @p lingering and, if it
+// is a response to one of its queries, records it as a late event.
+static void mkudns_lingering_recv(mkudns_lingering *lingering) {
+  if (lingering == nullptr) MKUDNS_ABORT();
+  if (lingering->queries.empty()) MKUDNS_ABORT();
+  std::vector<char> buff(mkudns_recv_bufsiz(&lingering->queries[0]));
+  int64_t recv_ttl = -1;
+  bool msg_trunc = false;
+  auto n = mkudns_recvmsg(
+      lingering->sock, buff.data(), buff.size(), &recv_ttl, &msg_trunc);
+  int err = mkudns_last_error();
+  MKUDNS_HOOK(recvmsg, n);
+  if (n < 0) {
+    // Drain the error queue, otherwise the socket stays readable.
+    mkudns_icmp icmp;
+    (void)mkudns_recv_icmp(lingering->sock, &icmp);
+    return;
+  }
+  int64_t id = mkudns_get_id(buff.data(), n);
+  for (const mkudns_query_t &query : lingering->queries) {
+    if (id != query.id) continue;
+    std::string event = mkudns_late_recv_event_new(
+        &query, buff.data(), n, err, recv_ttl);
+    std::unique_lock<std::mutex> _{lingering->linger->mutex};
+    lingering->linger->events.push_back(std::move(event));
+    break;
+  }
+}
+
+// mkudns_lingering_close closes the linger window of @p lingering.
+static void mkudns_lingering_close(mkudns_lingering *lingering) {
+  if (lingering == nullptr) MKUDNS_ABORT();
+  MKUDNS_CLOSESOCKET(lingering->sock);
+  lingering->sock = mkudns_socket_invalid;
+  std::unique_lock<std::mutex> _{lingering->linger->mutex};
+  lingering->linger->done = true;
+  lingering->linger->cond.notify_all();
+}
+
+// mkudns_lingerer_loop is the main loop of the background thread.
+static void mkudns_lingerer_loop(mkudns_lingerer *lingerer) {
+  if (lingerer == nullptr) MKUDNS_ABORT();
+  std::vector<mkudns_lingering> active;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> _{lingerer->mutex};
+      for (mkudns_lingering &lingering : lingerer->incoming) {
+        active.push_back(std::move(lingering));
+      }
+      lingerer->incoming.clear();
+      if (active.empty()) {
+        lingerer->running = false;
+        return;
+      }
+    }
+    int64_t now = mkudns_now();
+    int64_t deadline = active[0].deadline;
+    std::vector<pollfd> pfds;
+    for (mkudns_lingering &lingering : active) {
+      pollfd pfd{};
+      pfd.events = POLLIN;
+      pfd.fd = lingering.sock;
+      pfds.push_back(pfd);
+      deadline = (std::min)(deadline, lingering.deadline);
+    }
+    int64_t timeout = (deadline > now) ? deadline - now : 0;
+    if (lingerer->wakeup != mkudns_socket_invalid) {
+      pollfd pfd{};
+      pfd.events = POLLIN;
+      pfd.fd = lingerer->wakeup;
+      pfds.push_back(pfd);
+    } else {
+      timeout = (std::min)(timeout, mkudns_lingerer_max_wait);
+    }
+    int ret = mkudns_poll(pfds.data(), pfds.size(), timeout);
+    MKUDNS_HOOK(poll, ret);
+    for (size_t i = 0; ret > 0 && i < active.size(); ++i) {
+      if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0) continue;
+      mkudns_lingering_recv(&active[i]);
+    }
+    if (ret > 0 && lingerer->wakeup != mkudns_socket_invalid &&
+        (pfds.back().revents & POLLIN) != 0) {
+      char ch = 0;
+      (void)recv(lingerer->wakeup, &ch, sizeof(ch), 0);
+    }
+    now = mkudns_now();
+    std::vector<mkudns_lingering> still_active;
+    for (mkudns_lingering &lingering : active) {
+      if (now >= lingering.deadline) {
+        mkudns_lingering_close(&lingering);
+        continue;
+      }
+      still_active.push_back(std::move(lingering));
+    }
+    std::swap(active, still_active);
+  }
+}
+
+// mkudns_linger_or_close closes @p sock, unless @p queries, which we sent
+// using @p sock, have a linger window and we received a first datagram into
+// @p response. In such case, the lingerer takes ownership of @p sock, and
+// adds the late responses to @p response. We do not linger after a failed
+// send or a timeout, since there was no first response.
+static void mkudns_linger_or_close(
+    std::vector<mkudns_query_t> queries, mkudns_response_t *response,
+    mkudns_socket_t sock) {
+  if (queries.empty() || response == nullptr ||
+      sock == mkudns_socket_invalid) {
+    MKUDNS_ABORT();
+  }
+  if (queries[0].linger <= 0 || !response->received) {
+    MKUDNS_CLOSESOCKET(sock);
+    return;
+  }
+  mkudns_lingering lingering;
+  lingering.deadline = mkudns_now() + queries[0].linger;
+  if (response->linger == nullptr) response->linger.reset(new mkudns_linger);
+  lingering.linger = response->linger;
+  lingering.queries = std::move(queries);
+  lingering.sock = sock;
+  mkudns_lingerer *lingerer = mkudns_lingerer_singleton_nonnull();
+  std::unique_lock<std::mutex> _{lingerer->mutex};
+  lingerer->incoming.push_back(std::move(lingering));
+  if (!lingerer->running) {
+    lingerer->running = true;
+    std::thread{mkudns_lingerer_loop, lingerer}.detach();
+    return;
+  }
+  if (lingerer->wakeup != mkudns_socket_invalid) {
+    char ch = 0;
+    (void)send(lingerer->wakeup, &ch, sizeof(ch), 0);
+  }
+}
+
+// mkudns_sendrecv sends the query and receives the response.
+static bool mkudns_sendrecv(
+    const mkudns_query_t *query, mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  mkudns_socket_t sock = mkudns_open(query, response);
+  if (sock == mkudns_socket_invalid) return false;
+  int64_t sent_at = mkudns_now();
+  bool good = mkudns_send(query, response, sock) &&
+              mkudns_recv(query, response, sock);
+  if (good) {
+    mkudns_rtts_add(query->server_address, query->server_port,
+                    mkudns_now() - sent_at);
+  }
+  mkudns_linger_or_close({*query}, response, sock);
+  if (response->truncated) good = mkudns_tcp_fallback(query, response, sent_at);
+  return good;
+}
+
+// mkudns_hedge_default_delay is the hedge delay in milliseconds we use when
+// we know neither the server p95 RTT nor the query timeout.
+constexpr int64_t mkudns_hedge_default_delay = 1000;
+
+// mkudns_hedge_delay returns the delay in milliseconds after which we
+// should send @p query to the hedge server.
+static int64_t mkudns_hedge_delay(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  if (query->hedge_delay >= 0) return query->hedge_delay;
+  int64_t p95 = mkudns_rtts_p95(query->server_address, query->server_port);
+  if (p95 >= 0) return p95;
+  return (query->timeout >= 0) ? query->timeout / 2
+                               : mkudns_hedge_default_delay;
+}
+
+// mkudns_attempt is an attempt at sending a query to a specific server.
+struct mkudns_attempt {
+  // mkudns_attempt creates an attempt using the settings of @p q.
+  explicit mkudns_attempt(const mkudns_query_t &q) : query{q} {}
+
+  // query contains the settings used by this attempt.
+  mkudns_query_t query;
+
+  // send_event is the send event of this attempt.
+  std::string send_event;
+
+  // sent_at is the time when we sent the query.
+  int64_t sent_at = 0;
+
+  // sock is the socket used by this attempt. It is valid only as long as
+  // we are waiting for the response to this attempt.
+  mkudns_socket_t sock = mkudns_socket_invalid;
+};
+
+// mkudns_attempt_start creates the socket of @p attempt and sends its query.
+static void mkudns_attempt_start(
+    mkudns_attempt *attempt, mkudns_response_t *response) {
+  if (attempt == nullptr || response == nullptr) MKUDNS_ABORT();
+  attempt->sock = mkudns_open(&attempt->query, response);
+  if (attempt->sock == mkudns_socket_invalid) return;
+  attempt->sent_at = mkudns_now();
+  if (!mkudns_send(&attempt->query, response, attempt->sock)) {
+    MKUDNS_CLOSESOCKET(attempt->sock);
+    attempt->sock = mkudns_socket_invalid;
+    return;
+  }
+  attempt->send_event = response->send_event;
+}
+
+// mkudns_attempt_stop closes the socket of @p attempt, if still open.
+static void mkudns_attempt_stop(mkudns_attempt *attempt) {
+  if (attempt == nullptr) MKUDNS_ABORT();
+  if (attempt->sock != mkudns_socket_invalid) {
+    MKUDNS_CLOSESOCKET(attempt->sock);
+    attempt->sock = mkudns_socket_invalid;
+  }
+}
+
+// mkudns_attempt_linger hands over the socket of @p attempt, if still open,
+// to mkudns_linger_or_close, which will add late events to @p response.
+static void mkudns_attempt_linger(
+    mkudns_attempt *attempt, mkudns_response_t *response) {
+  if (attempt == nullptr || response == nullptr) MKUDNS_ABORT();
+  if (attempt->sock != mkudns_socket_invalid) {
+    mkudns_linger_or_close({attempt->query}, response, attempt->sock);
+    attempt->sock = mkudns_socket_invalid;
+  }
+}
+
+// mkudns_sendrecv_hedged is like mkudns_sendrecv except that, if the server
+// does not answer within the hedge delay, or if sending to it fails, we also
+// send the query to the hedge server. The first good response wins and we
+// cancel the other attempt. We record the events of both attempts. If no
+// attempt wins, the response contains the last valid answer, if any, so
+// that one can still tell NXDOMAIN, SERVFAIL, and NODATA apart.
+static bool mkudns_sendrecv_hedged(
+    const mkudns_query_t *query, mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  mkudns_response_t kept;  // the last valid answer that is not good
+  std::vector<mkudns_attempt> attempts;
+  attempts.emplace_back(*query);
+  attempts.emplace_back(*query);
+  attempts[1].query.server_address = query->hedge_server_address;
+  attempts[1].query.server_port = query->hedge_server_port;
+  int64_t start = mkudns_now();
+  int64_t hedge_at = start + mkudns_hedge_delay(query);
+  int64_t deadline = (query->timeout >= 0) ? start + query->timeout : -1;
+  size_t started = 0;
+  mkudns_attempt *truncated = nullptr;
+  mkudns_attempt *winner = nullptr;
+  while (winner == nullptr && truncated == nullptr) {
+    std::vector<pollfd> pfds;
+    std::vector<mkudns_attempt *> polled;
+    for (size_t i = 0; i < started; ++i) {
+      if (attempts[i].sock == mkudns_socket_invalid) continue;
+      pollfd pfd{};
+      pfd.events = POLLIN;
+      pfd.fd = attempts[i].sock;
+      pfds.push_back(pfd);
+      polled.push_back(&attempts[i]);
+    }
+    int64_t now = mkudns_now();
+    if (started < attempts.size() && (pfds.empty() || now >= hedge_at)) {
+      if (started > 0) {
+        response->events.push_back(mkudns_generic_event_new(
+            &attempts[started].query, "mkudns.hedge", "", "no_error", 0));
+      }
+      mkudns_attempt_start(&attempts[started++], response);
+      continue;
+    }
+    if (pfds.empty()) break;  // all attempts failed
+    if (deadline >= 0 && now >= deadline) {
+      response->recv_event = mkudns_generic_event_new(
+          query, "mkudns.recv", "", "timed_out", -1);
+      response->events.push_back(response->recv_event);
+      break;
+    }
+    int64_t wakeup = (started < attempts.size()) ? hedge_at : deadline;
+    if (deadline >= 0 && deadline < wakeup) wakeup = deadline;
+    int ret = mkudns_poll(pfds.data(), pfds.size(),
+                          (wakeup >= 0) ? wakeup - now : -1);
+    int err = mkudns_last_error();
+    MKUDNS_HOOK(poll, ret);
+    if (ret < 0) {
+      response->recv_event = mkudns_recv_event_new(query, "", -1, err, -1);
+      response->events.push_back(response->recv_event);
+      break;
+    }
+    for (size_t i = 0;
+         i < pfds.size() && winner == nullptr && truncated == nullptr; ++i) {
+      if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0) continue;
+      mkudns_attempt *attempt = polled[i];
+      if (mkudns_recvbuf(&attempt->query, response, attempt->sock)) {
+        response->rtt = mkudns_now() - attempt->sent_at;
+        mkudns_rtts_add(attempt->query.server_address,
+                        attempt->query.server_port, response->rtt);
+        winner = attempt;
+      } else if (response->truncated) {
+        truncated = attempt;
+      } else if (response->primary >= 0) {
+        mkudns_move_answer(response, &kept);
+      } else {
+        mkudns_forget_answer(response);
+      }
+      mkudns_attempt_linger(attempt, response);
+    }
+  }
+  for (mkudns_attempt &attempt : attempts) {
+    if ((winner != nullptr || truncated != nullptr) &&
+        attempt.sock != mkudns_socket_invalid) {
+      response->events.push_back(mkudns_generic_event_new(
+          &attempt.query, "mkudns.cancel", "", "no_error", 0));
+    }
+    mkudns_attempt_stop(&attempt);
+  }
+  if (truncated != nullptr) {
+    return mkudns_tcp_fallback(&truncated->query, response, start);
+  }
+  if (winner == nullptr) {
+    if (kept.primary >= 0) mkudns_move_answer(&kept, response);
+    return false;
+  }
+  response->send_event = winner->send_event;
+  return true;
+}
+
+// mkudns_sendrecv_dual_stack sends the A and AAAA queries back to back using
+// a single socket and receives both responses concurrently.
+static bool mkudns_sendrecv_dual_stack(
+    const mkudns_query_t *query, mkudns_response_t *response) {
+  if (query == nullptr || response == nullptr) MKUDNS_ABORT();
+  std::array<mkudns_query_t, 2> queries{{*query, *query}};
+  queries[0].type = ns_t_a;
+  queries[1].type = ns_t_aaaa;
+  queries[1].id = mkudns_ids_get();
+  std::array<bool, 2> pending{{false, false}};
+  std::array<std::string, 2> send_events;
+  std::array<std::string, 2> recv_events;
+  bool good = false;
+  int64_t start = mkudns_now();
+  mkudns_socket_t sock = mkudns_open(query, response);
+  if (sock != mkudns_socket_invalid) {
+    for (size_t i = 0; i < queries.size(); ++i) {
+      pending[i] = mkudns_send(&queries[i], response, sock);
+      send_events[i] = response->send_event;
+    }
+    int64_t deadline = (query->timeout >= 0) ? start + query->timeout : -1;
+    while (pending[0] || pending[1]) {
+      int64_t now = mkudns_now();
+      if (deadline >= 0 && now >= deadline) {
+        for (size_t i = 0; i < queries.size(); ++i) {
+          if (!pending[i]) continue;
+          recv_events[i] = mkudns_generic_event_new(
+              &queries[i], "mkudns.recv", "", "timed_out", -1);
+          response->events.push_back(recv_events[i]);
+        }
+        break;
+      }
+      pollfd pfd{};
+      pfd.events = POLLIN;
+      pfd.fd = sock;
+      int ret = mkudns_poll(&pfd, 1, (deadline >= 0) ? deadline - now : -1);
+      int err = mkudns_last_error();
+      MKUDNS_HOOK(poll, ret);
+      if (ret < 0) {
+        response->recv_event = mkudns_recv_event_new(query, "", -1, err, -1);
+        response->events.push_back(response->recv_event);
+        break;
+      }
+      if (ret == 0) continue;
+      std::vector<char> buff(mkudns_recv_bufsiz(query));
+      int64_t recv_ttl = -1;
+      bool msg_trunc = false;
+      auto n = mkudns_recvmsg(
+          sock, buff.data(), buff.size(), &recv_ttl, &msg_trunc);
+      err = mkudns_last_error();
+      MKUDNS_HOOK(recvmsg, n);
+      int64_t id = mkudns_get_id(buff.data(), n);
+      size_t idx = (id == queries[1].id) ? 1 : 0;
+      if (n > 0 && id != queries[0].id && id != queries[1].id) {
+        // Not for us, so record it without parsing and keep waiting.
+        response->events.push_back(
+            mkudns_recv_event_new(query, buff.data(), n, err, recv_ttl));
+        continue;
+      }
+      if (n <= 0) {
+        (void)mkudns_recv_process(
+            query, response, sock, buff.data(), n, err, recv_ttl, msg_trunc);
+        break;
+      }
+      if (!pending[idx]) {
+        if (query->linger > 0) {
+          // The lingerer is going to close the linger window.
+          if (response->linger == nullptr) {
+            response->linger.reset(new mkudns_linger);
+          }
+          std::string event = mkudns_late_recv_event_new(
+              &queries[idx], buff.data(), n, err, recv_ttl);
+          std::unique_lock<std::mutex> _{response->linger->mutex};
+          response->linger->events.push_back(std::move(event));
+        }
+        continue;
+      }
+      pending[idx] = false;
+      if (mkudns_recv_process(&queries[idx], response, sock, buff.data(), n,
+                              err, recv_ttl, msg_trunc)) {
+        mkudns_rtts_add(query->server_address, query->server_port,
+                        mkudns_now() - start);
+        good = true;
+      }
+      recv_events[idx] = response->recv_event;
+    }
+    mkudns_linger_or_close({queries[0], queries[1]}, response, sock);
+  }
+  mkudns_ids_put(queries[1].id);
+  if (!send_events[0].empty()) response->send_event = send_events[0];
+  if (!recv_events[0].empty()) response->recv_event = recv_events[0];
+  if (response->truncated) return mkudns_tcp_fallback(query, response, start);
+  return good && !response->addresses.empty();
+}
+
+// mkudns_perform performs @p query without coalescing it.
+static mkudns_response_t *mkudns_perform(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  mkudns_response_uptr response{new mkudns_response_t};
+  if (query->cache && mkudns_cache_lookup(query, response.get())) {
+    return response.release();
+  }
+  bool good = false;
+  if (query->tcp) {
+    good = mkudns_sendrecv_tcp_query(query, response.get());
+  } else if (query->dual_stack) {
+    good = mkudns_sendrecv_dual_stack(query, response.get());
+  } else if (query->hedge_server_address.empty()) {
+    good = mkudns_sendrecv(query, response.get());
+  } else {
+    good = mkudns_sendrecv_hedged(query, response.get());
+  }
+  response->good = good;
+  if (query->cache) mkudns_cache_store(query, response.get());
+  return response.release();
+}
+
+// mkudns_flight is a query in flight, to which identical queries attach.
+struct mkudns_flight {
+  // cond allows to wait for the response.
+  std::condition_variable cond;
+
+  // leader_id is the ID of the query in flight.
+  uint16_t leader_id = 0;
+
+  // mutex protects response against concurrent accesses.
+  std::mutex mutex;
+
+  // response is the response, or null while the query is in flight.
+  mkudns_response_uptr response;
+};
+
+// mkudns_flights contains the queries in flight.
+struct mkudns_flights {
+  // flights maps a query key to the corresponding query in flight.
+  std::map<std::string, std::shared_ptr<mkudns_flight>> flights;
+
+  // mutex protects flights against concurrent accesses.
+  std::mutex mutex;
+};
+
+// mkudns_flights_singleton_nonnull returns the queries in flight singleton.
+// We never destroy the singleton, since detached threads resolving may
+// outlive main. This function will never return a null pointer.
+static mkudns_flights *mkudns_flights_singleton_nonnull() {
+  static std::mutex mutex;
+  static mkudns_flights *singleton = nullptr;
+  std::unique_lock<std::mutex> _{mutex};
+  if (singleton == nullptr) singleton = new mkudns_flights;
+  return singleton;
+}
+
+// mkudns_flight_key returns a key that is equal for queries that would
+// produce the same result, except for the query ID.
+static std::string mkudns_flight_key(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  nlohmann::json json;
+  json["cache"] = query->cache;
+  json["cache_max_ttl"] = query->cache_max_ttl;
+  json["cache_min_ttl"] = query->cache_min_ttl;
+  json["dnsclass"] = query->dnsclass;
+  json["edns_payload_size"] = query->edns_payload_size;
+  json["hedge_delay"] = query->hedge_delay;
+  json["hedge_server_address"] = query->hedge_server_address;
+  json["hedge_server_port"] = query->hedge_server_port;
+  json["key"] = mkudns_cache_key(query);
+  json["linger"] = query->linger;
+  json["tcp"] = query->tcp;
+  json["timeout"] = query->timeout;
+  json["ttl"] = query->ttl;
+  return json.dump();
+}
+
+// mkudns_response_copy copies @p src into @p dst. The late events, if any,
+// are shared by the two responses.
+static void mkudns_response_copy(
+    const mkudns_response_t *src, mkudns_response_t *dst) {
+  if (src == nullptr || dst == nullptr) MKUDNS_ABORT();
+  dst->addresses = src->addresses;
+  dst->address_ttls = src->address_ttls;
+  dst->cnames = src->cnames;
+  dst->events = src->events;
+  dst->cname = src->cname;
+  dst->good = src->good;
+  dst->icmp_origin = src->icmp_origin;
+  dst->linger = src->linger;
+  dst->messages = src->messages;
+  dst->primary = src->primary;
+  dst->recv_event = src->recv_event;
+  dst->recv_ttl = src->recv_ttl;
+  dst->records = src->records;
+  dst->rtt = src->rtt;
+  dst->send_event = src->send_event;
+  dst->sent_at = src->sent_at;
+  dst->truncated = src->truncated;
+}
+
+// mkudns_perform_coalesced performs @p query, unless an identical query is
+// already in flight, in which case it waits for its response and returns a
+// copy of it, preceded by a `"mkudns.coalesced"` event.
+static mkudns_response_t *mkudns_perform_coalesced(
+    const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  mkudns_flights *flights = mkudns_flights_singleton_nonnull();
+  std::string key = mkudns_flight_key(query);
+  std::shared_ptr<mkudns_flight> flight;
+  bool leader = false;
+  {
+    std::unique_lock<std::mutex> _{flights->mutex};
+    auto it = flights->flights.find(key);
+    if (it == flights->flights.end()) {
+      flight.reset(new mkudns_flight);
+      flight->leader_id = query->id;
+      flights->flights[key] = flight;
+      leader = true;
+    } else {
+      flight = it->second;
+    }
+  }
+  if (leader) {
+    mkudns_response_uptr response{mkudns_perform(query)};
+    {
+      std::unique_lock<std::mutex> _{flights->mutex};
+      flights->flights.erase(key);
+    }
+    {
+      std::unique_lock<std::mutex> _{flight->mutex};
+      flight->response.reset(new mkudns_response_t);
+      mkudns_response_copy(response.get(), flight->response.get());
+    }
+    flight->cond.notify_all();
+    return response.release();
+  }
+  mkudns_response_uptr response{new mkudns_response_t};
+  {
+    std::unique_lock<std::mutex> lock{flight->mutex};
+    flight->cond.wait(lock, [&]() { return flight->response != nullptr; });
+    mkudns_response_copy(flight->response.get(), response.get());
+  }
+  nlohmann::json extra;
+  extra["leader_query_id"] = flight->leader_id;
+  response->events.insert(response->events.begin(), mkudns_generic_event_new(
+      query, "mkudns.coalesced", "", "no_error", 0, extra));
+  return response.release();
+}
+
+mkudns_response_t *mkudns_query_perform_nonnull(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  return query->coalesce ? mkudns_perform_coalesced(query)
+                         : mkudns_perform(query);
+}
+
+// mkudns_sendrecv_attempts starts all the @p attempts at the same time, and
+// receives their responses into @p responses, which has the same size as
+// @p attempts, until all have been answered or the @p timeout expires.
+static void mkudns_sendrecv_attempts(
+    std::vector<mkudns_attempt> *attempts, mkudns_responses_t *responses,
+    int64_t timeout) {
+  if (attempts == nullptr || responses == nullptr ||
+      attempts->size() != responses->responses.size()) {
+    MKUDNS_ABORT();
+  }
+  int64_t start = mkudns_now();
+  for (size_t i = 0; i < attempts->size(); ++i) {
+    mkudns_attempt_start(&(*attempts)[i], responses->responses[i].get());
+  }
+  int64_t deadline = (timeout >= 0) ? start + timeout : -1;
+  for (;;) {
+    std::vector<pollfd> pfds;
+    std::vector<size_t> polled;
+    for (size_t i = 0; i < attempts->size(); ++i) {
+      if ((*attempts)[i].sock == mkudns_socket_invalid) continue;
+      pollfd pfd{};
+      pfd.events = POLLIN;
+      pfd.fd = (*attempts)[i].sock;
+      pfds.push_back(pfd);
+      polled.push_back(i);
+    }
+    if (pfds.empty()) break;
+    int64_t now = mkudns_now();
+    int ret = 0;
+    int err = 0;
+    if (deadline < 0 || now < deadline) {
+      ret = mkudns_poll(pfds.data(), pfds.size(),
+                        (deadline >= 0) ? deadline - now : -1);
+      err = mkudns_last_error();
+      MKUDNS_HOOK(poll, ret);
+    }
+    if (ret <= 0) {
+      for (size_t idx : polled) {
+        mkudns_attempt *attempt = &(*attempts)[idx];
+        mkudns_response_t *response = responses->responses[idx].get();
+        response->recv_event = (ret < 0)
+            ? mkudns_recv_event_new(&attempt->query, "", -1, err, -1)
+            : mkudns_generic_event_new(&attempt->query, "mkudns.recv",
+                                       "", "timed_out", -1);
+        response->events.push_back(response->recv_event);
+        mkudns_attempt_stop(attempt);
+      }
+      break;
+    }
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0) continue;
+      mkudns_attempt *attempt = &(*attempts)[polled[i]];
+      mkudns_response_t *response = responses->responses[polled[i]].get();
+      if (mkudns_recvbuf(&attempt->query, response, attempt->sock)) {
+        mkudns_rtts_add(attempt->query.server_address,
+                        attempt->query.server_port, response->rtt);
+        response->good = true;
+      }
+      mkudns_attempt_linger(attempt, response);
+    }
+  }
+}
+
+// mkudns_sendrecv_fanout sends the query to all the fan-out servers at the
+// same time and receives their responses into @p responses.
+static void mkudns_sendrecv_fanout(
+    const mkudns_query_t *query, mkudns_responses_t *responses) {
+  if (query == nullptr || responses == nullptr) MKUDNS_ABORT();
+  std::vector<mkudns_attempt> attempts;
+  for (auto &server : query->fanout_servers) {
+    attempts.emplace_back(*query);
+    attempts.back().query.server_address = server.first;
+    attempts.back().query.server_port = server.second;
+    responses->responses.emplace_back(new mkudns_response_t);
+  }
+  int64_t start = mkudns_now();
+  mkudns_sendrecv_attempts(&attempts, responses, query->timeout);
+  for (size_t i = 0; i < attempts.size(); ++i) {
+    mkudns_response_t *response = responses->responses[i].get();
+    if (!response->truncated) continue;
+    attempts[i].query.dual_stack = false;
+    response->good = mkudns_tcp_fallback(&attempts[i].query, response, start);
+  }
+}
+
+// mkudns_sendrecv_traceroute sends the query with all the TTLs from 1 to
+// @p max_ttl at the same time and receives their responses into @p responses.
+static void mkudns_sendrecv_traceroute(
+    const mkudns_query_t *query, int64_t max_ttl,
+    mkudns_responses_t *responses) {
+  if (query == nullptr || responses == nullptr) MKUDNS_ABORT();
+  std::vector<mkudns_attempt> attempts;
+  for (int64_t ttl = 1; ttl <= max_ttl && ttl <= 255; ++ttl) {
+    attempts.emplace_back(*query);
+    attempts.back().query.ttl = ttl;
+    responses->responses.emplace_back(new mkudns_response_t);
+  }
+  mkudns_sendrecv_attempts(&attempts, responses, query->timeout);
+}
+
+mkudns_responses_t *mkudns_query_perform_fanout_nonnull(
+    const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  mkudns_responses_uptr responses{new mkudns_responses_t};
+  mkudns_sendrecv_fanout(query, responses.get());
+  return responses.release();
+}
+
+mkudns_responses_t *mkudns_query_perform_traceroute_nonnull(
+    const mkudns_query_t *query, int64_t max_ttl) {
+  if (query == nullptr) MKUDNS_ABORT();
+  mkudns_responses_uptr responses{new mkudns_responses_t};
+  mkudns_sendrecv_traceroute(query, max_ttl, responses.get());
+  return responses.release();
+}
+
+// mkudns_operation
+// ----------------
+
+// mkudns_operation is the private data of mkudns_operation_t.
+struct mkudns_operation {
+  // mkudns_operation creates an operation performing a copy of @p q.
+  explicit mkudns_operation(const mkudns_query_t &q) : query{q} {}
+
+  // cached indicates whether the response comes from the cache.
+  bool cached = false;
+
+  // deadline is when the query times out, or -1 if it never does.
+  int64_t deadline = -1;
+
+  // done indicates whether the operation is complete.
+  bool done = false;
+
+  // query is the query we are performing.
+  mkudns_query_t query;
+
+  // response is the response, until the caller finishes the operation.
+  mkudns_response_uptr response{new mkudns_response_t};
+
+  // sent_at is the time when we sent the query.
+  int64_t sent_at = 0;
+
+  // sock is the socket, which is valid until the operation is done.
+  mkudns_socket_t sock = mkudns_socket_invalid;
+};
+
+// mkudns_operation_complete marks @p operation as done and closes its
+// socket, unless its linger window is open.
+static void mkudns_operation_complete(mkudns_operation_t *operation) {
+  if (operation == nullptr || operation->done) MKUDNS_ABORT();
+  operation->done = true;
+  if (operation->sock != mkudns_socket_invalid) {
+    mkudns_linger_or_close({operation->query}, operation->response.get(),
+                           operation->sock);
+    operation->sock = mkudns_socket_invalid;
+  }
+}
+
+mkudns_operation_t *mkudns_query_start_nonnull(const mkudns_query_t *query) {
+  if (query == nullptr) MKUDNS_ABORT();
+  mkudns_operation_uptr operation{new mkudns_operation_t{*query}};
+  mkudns_response_t *response = operation->response.get();
+  if (query->cache && mkudns_cache_lookup(query, response)) {
+    operation->cached = true;
+    operation->done = true;
+    return operation.release();
+  }
+  operation->sock = mkudns_open(query, response);
+  if (operation->sock == mkudns_socket_invalid) {
+    operation->done = true;
+    return operation.release();
+  }
+  operation->sent_at = mkudns_now();
+  // We send before making the socket nonblocking: a UDP send never blocks
+  // for long, and this way we don't need to handle EAGAIN here.
+  if (!mkudns_send(query, response, operation->sock) ||
+      !mkudns_set_nonblocking(operation->sock)) {
+    MKUDNS_CLOSESOCKET(operation->sock);
+    operation->sock = mkudns_socket_invalid;
+    operation->done = true;
+    return operation.release();
+  }
+  if (query->timeout >= 0) {
+    operation->deadline = operation->sent_at + query->timeout;
+  }
+  return operation.release();
+}
+
+int64_t mkudns_operation_get_socket(const mkudns_operation_t *operation) {
+  if (operation == nullptr) MKUDNS_ABORT();
+  return (operation->sock != mkudns_socket_invalid)
+             ? static_cast<int64_t>(operation->sock) : -1;
+}
+
+int64_t mkudns_operation_get_timeout(const mkudns_operation_t *operation) {
+  if (operation == nullptr) MKUDNS_ABORT();
+  if (operation->done || operation->deadline < 0) return -1;
+  return std::max<int64_t>(operation->deadline - mkudns_now(), 0);
+}
+
+void mkudns_operation_on_readable(mkudns_operation_t *operation) {
+  if (operation == nullptr) MKUDNS_ABORT();
+  if (operation->done) return;
+  const mkudns_query_t *query = &operation->query;
+  mkudns_response_t *response = operation->response.get();
+  std::vector<char> buff(mkudns_recv_bufsiz(query));
+  int64_t recv_ttl = -1;
+  bool msg_trunc = false;
+  auto n = mkudns_recvmsg(
+      operation->sock, buff.data(), buff.size(), &recv_ttl, &msg_trunc);
+  int err = mkudns_last_error();
+  MKUDNS_HOOK(recvmsg, n);
+  if (n < 0 && mkudns_would_block(err)) return;  // spurious wakeup
+  if (mkudns_recv_process(query, response, operation->sock, buff.data(), n,
+                          err, recv_ttl, msg_trunc)) {
+    response->good = true;
+    mkudns_rtts_add(query->server_address, query->server_port,
+                    mkudns_now() - operation->sent_at);
+  }
+  mkudns_operation_complete(operation);
+}
+
+void mkudns_operation_on_timeout(mkudns_operation_t *operation) {
+  if (operation == nullptr) MKUDNS_ABORT();
+  if (operation->done) return;
+  mkudns_response_t *response = operation->response.get();
+  response->recv_event = mkudns_generic_event_new(
+      &operation->query, "mkudns.recv", "", "timed_out", -1);
+  response->events.push_back(response->recv_event);
+  mkudns_operation_complete(operation);
+}
+
+int64_t mkudns_operation_done(const mkudns_operation_t *operation) {
+  if (operation == nullptr) MKUDNS_ABORT();
+  return operation->done;
+}
+
+mkudns_response_t *mkudns_operation_finish_nonnull(
+    mkudns_operation_t *operation) {
+  if (operation == nullptr || operation->response == nullptr) MKUDNS_ABORT();
+  if (!operation->done) {
+    operation->response->events.push_back(mkudns_generic_event_new(
+        &operation->query, "mkudns.cancel", "", "operation_canceled", -1));
+    mkudns_operation_complete(operation);
+  }
+  if (operation->query.cache && !operation->cached) {
+    mkudns_cache_store(&operation->query, operation->response.get());
+  }
+  return operation->response.release();
+}
+
+void mkudns_operation_delete(mkudns_operation_t *operation) {
+  if (operation != nullptr) {
+    if (operation->sock != mkudns_socket_invalid) {
+      MKUDNS_CLOSESOCKET(operation->sock);
+    }
+    delete operation;
+  }
+}
+
+// mkudns_wheel
+// ------------
+
+// mkudns_wheel_bits is the base two logarithm of the number of slots of each
+// level of a timer wheel.
+constexpr unsigned mkudns_wheel_bits = 8;
+
+// mkudns_wheel_slots is the number of slots of each level of a timer wheel.
+constexpr size_t mkudns_wheel_slots = size_t{1} << mkudns_wheel_bits;
+
+// mkudns_wheel_levels is the number of levels of a timer wheel. The wheel
+// covers 2^32 ticks, i.e., about 49 days with millisecond ticks. Timers that
+// expire later wait in the last level, and cascade more than once.
+constexpr size_t mkudns_wheel_levels = 4;
+
+// mkudns_wheel_timer is a timer of a mkudns_wheel, which is embedded into
+// the structure owning it, so that the wheel does not allocate memory.
+struct mkudns_wheel_timer {
+  // deadline is the tick when the timer expires.
+  int64_t deadline = 0;
+
+  // next is the next timer in the same slot, or null if the timer is not in
+  // any wheel.
+  mkudns_wheel_timer *next = nullptr;
+
+  // prev is the previous timer in the same slot.
+  mkudns_wheel_timer *prev = nullptr;
+
+  // slot is the index of the slot containing the timer.
+  size_t slot = 0;
+
+  // value identifies the owner of the timer.
+  size_t value = 0;
+};
+
+// mkudns_wheel is a hierarchical timer wheel (see Varghese and Lauck), where
+// inserting and cancelling timers costs O(1), and we expire the timers one
+// tick at a time, by emptying the slot of the tick. Each slot of level L
+// covers 256^L ticks. Every 256 ticks, we cascade the timers in the next
+// slot of level 1 into level 0, and so on for the higher levels.
+struct mkudns_wheel {
+  // mkudns_wheel creates an empty wheel.
+  mkudns_wheel() {
+    for (auto &head : heads) head.next = head.prev = &head;
+  }
+
+  // mkudns_wheel is not copyable, since the slots point to themselves.
+  mkudns_wheel(const mkudns_wheel &) = delete;
+  mkudns_wheel &operator=(const mkudns_wheel &) = delete;
+
+  // count is the number of timers in the wheel.
+  size_t count = 0;
+
+  // current is the next tick to expire.
+  int64_t current = 0;
+
+  // heads contains the heads of the circular lists of timers of the slots,
+  // level after level.
+  std::array<mkudns_wheel_timer, mkudns_wheel_levels * mkudns_wheel_slots>
+      heads;
+
+  // occupied contains a bit per slot, which is set if the slot has timers.
+  std::array<uint64_t, mkudns_wheel_levels * mkudns_wheel_slots / 64>
+      occupied{};
+};
+
+// mkudns_wheel_link adds @p timer to the slot of @p wheel where it belongs
+// given the current tick.
+static void mkudns_wheel_link(mkudns_wheel *wheel, mkudns_wheel_timer *timer) {
+  if (wheel == nullptr || timer == nullptr) MKUDNS_ABORT();
+  int64_t delta = timer->deadline - wheel->current;
+  int64_t tick = (delta < 0) ? wheel->current : timer->deadline;
+  size_t level = 0;
+  if (delta >= (int64_t{1} << (mkudns_wheel_bits * mkudns_wheel_levels))) {
+    level = mkudns_wheel_levels - 1;
+    tick = wheel->current +
+           (int64_t{1} << (mkudns_wheel_bits * mkudns_wheel_levels)) - 1;
+  } else {
+    while (level < mkudns_wheel_levels - 1 &&
+           delta >= (int64_t{1} << (mkudns_wheel_bits * (level + 1)))) {
+      ++level;
+    }
+  }
+  size_t slot = level * mkudns_wheel_slots +
+                (static_cast<size_t>(tick >> (mkudns_wheel_bits * level)) &
+                 (mkudns_wheel_slots - 1));
+  mkudns_wheel_timer *head = &wheel->heads[slot];
+  timer->slot = slot;
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+  wheel->occupied[slot / 64] |= uint64_t{1} << (slot % 64);
+}
+
+// mkudns_wheel_unlink removes @p timer, which must be in @p wheel, from its
+// slot.
+static void mkudns_wheel_unlink(
+    mkudns_wheel *wheel, mkudns_wheel_timer *timer) {
+  if (wheel == nullptr || timer == nullptr || timer->next == nullptr) {
+    MKUDNS_ABORT();
+  }
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = nullptr;
+  mkudns_wheel_timer *head = &wheel->heads[timer->slot];
+  if (head->next == head) {
+    wheel->occupied[timer->slot / 64] &= ~(uint64_t{1} << (timer->slot % 64));
+  }
+}
+
+// mkudns_wheel_insert adds @p timer, which must not be in any wheel, to
+// @p wheel, so that it expires at tick @p deadline. @p now is the current
+// tick, which allows an empty wheel to skip the ticks that have passed.
+static void mkudns_wheel_insert(mkudns_wheel *wheel, mkudns_wheel_timer *timer,
+                                int64_t deadline, int64_t now) {
+  if (wheel == nullptr || timer == nullptr || timer->next != nullptr) {
+    MKUDNS_ABORT();
+  }
+  if (wheel->count <= 0 && wheel->current < now) wheel->current = now;
+  timer->deadline = deadline;
+  mkudns_wheel_link(wheel, timer);
+  wheel->count += 1;
+}
+
+// mkudns_wheel_cancel removes @p timer from @p wheel, if it is there.
+static void mkudns_wheel_cancel(
+    mkudns_wheel *wheel, mkudns_wheel_timer *timer) {
+  if (wheel == nullptr || timer == nullptr) MKUDNS_ABORT();
+  if (timer->next == nullptr) return;
+  mkudns_wheel_unlink(wheel, timer);
+  wheel->count -= 1;
+}
+
+// mkudns_wheel_cascade moves the timers in the slots of @p wheel that we
+// reach at the current tick, which is a multiple of the number of slots,
+// into the lower levels.
+static void mkudns_wheel_cascade(mkudns_wheel *wheel) {
+  if (wheel == nullptr) MKUDNS_ABORT();
+  for (size_t level = 1; level < mkudns_wheel_levels; ++level) {
+    size_t index = static_cast<size_t>(
+        wheel->current >> (mkudns_wheel_bits * level)) &
+        (mkudns_wheel_slots - 1);
+    size_t slot = level * mkudns_wheel_slots + index;
+    mkudns_wheel_timer *head = &wheel->heads[slot];
+    // Detach the whole list at once, so that we do not need to update the
+    // neighbors of each timer we move.
+    mkudns_wheel_timer *timer = head->next;
+    head->prev->next = nullptr;
+    head->next = head->prev = head;
+    wheel->occupied[slot / 64] &= ~(uint64_t{1} << (slot % 64));
+    while (timer != nullptr && timer != head) {
+      mkudns_wheel_timer *next = timer->next;
+      mkudns_wheel_link(wheel, timer);
+      timer = next;
+    }
+    if (index != 0) break;
+  }
+}
+
+// mkudns_wheel_pop removes from @p wheel and returns a timer that expired at
+// or before tick @p now, or returns null if there is none.
+static mkudns_wheel_timer *mkudns_wheel_pop(mkudns_wheel *wheel, int64_t now) {
+  if (wheel == nullptr) MKUDNS_ABORT();
+  while (wheel->current <= now) {
+    if (wheel->count <= 0) {
+      wheel->current = now + 1;
+      break;
+    }
+    mkudns_wheel_timer *head = &wheel->heads[
+        static_cast<size_t>(wheel->current) & (mkudns_wheel_slots - 1)];
+    if (head->next != head) {
+      mkudns_wheel_timer *timer = head->next;
+      mkudns_wheel_cancel(wheel, timer);
+      return timer;
+    }
+    wheel->current += 1;
+    if ((static_cast<size_t>(wheel->current) &
+         (mkudns_wheel_slots - 1)) == 0) {
+      mkudns_wheel_cascade(wheel);
+    }
+  }
+  return nullptr;
+}
+
+// mkudns_wheel_next returns the tick at which we should call mkudns_wheel_pop
+// on @p wheel, or -1 if @p wheel is empty. When level 0 does not contain any
+// timer, this is the next cascade, which may not expire any timer.
+static int64_t mkudns_wheel_next(const mkudns_wheel *wheel) {
+  if (wheel == nullptr) MKUDNS_ABORT();
+  if (wheel->count <= 0) return -1;
+  size_t base = static_cast<size_t>(wheel->current) & (mkudns_wheel_slots - 1);
+  for (size_t offset = 0; offset < mkudns_wheel_slots - base; ++offset) {
+    size_t slot = base + offset;
+    if ((wheel->occupied[slot / 64] & (uint64_t{1} << (slot % 64))) != 0) {
+      return wheel->current + static_cast<int64_t>(offset);
+    }
+  }
+  return wheel->current + static_cast<int64_t>(mkudns_wheel_slots - base);
+}
+
+// mkudns_mpsc
+// -----------
+
+// mkudns_mpsc_node is a node of a mkudns_mpsc queue.
+template <typename Value> struct mkudns_mpsc_node {
+  // next is the node pushed after this one, if any.
+  std::atomic<mkudns_mpsc_node *> next{nullptr};
+
+  // value is the value of the node.
+  Value value{};
+};
+
+// mkudns_mpsc is a lock-free multi-producer single-consumer queue, where a
+// push costs an exchange and a store, and a pop costs a load (see Dmitry
+// Vyukov's intrusive MPSC queue). The oldest node is a stub, whose value
+// has already been popped, so that the producers and the consumer never
+// modify the same node.
+template <typename Value> struct mkudns_mpsc {
+  // mkudns_mpsc creates an empty queue.
+  mkudns_mpsc() : head{new mkudns_mpsc_node<Value>}, tail{head.load()} {}
+
+  // ~mkudns_mpsc destroys the queue and the values that were not popped.
+  ~mkudns_mpsc() {
+    while (tail != nullptr) {
+      mkudns_mpsc_node<Value> *next = tail->next.load();
+      delete tail;
+      tail = next;
+    }
+  }
+
+  // head is the newest node, which only the producers modify.
+  std::atomic<mkudns_mpsc_node<Value> *> head;
+
+  // tail is the stub node, which only the consumer uses.
+  mkudns_mpsc_node<Value> *tail;
+};
+
+// mkudns_mpsc_push pushes @p node, that the queue will own, into @p queue.
+// Any thread may push. The store is sequentially consistent, so that the
+// producers may use the Dekker pattern to know whether to wake the consumer.
+template <typename Value>
+static void mkudns_mpsc_push(
+    mkudns_mpsc<Value> *queue, mkudns_mpsc_node<Value> *node) {
+  if (queue == nullptr || node == nullptr) MKUDNS_ABORT();
+  node->next.store(nullptr, std::memory_order_relaxed);
+  mkudns_mpsc_node<Value> *prev = queue->head.exchange(node);
+  // Until we link the previous node, the consumer does not see this node
+  // and the ones pushed after it.
+  prev->next.store(node);
+}
+
+// mkudns_mpsc_pop moves the oldest value of @p queue into @p value and
+// returns true, or returns false if there is no value, or if the oldest
+// push is still linking its node. Only the consumer may pop.
+template <typename Value>
+static bool mkudns_mpsc_pop(mkudns_mpsc<Value> *queue, Value *value) {
+  if (queue == nullptr || value == nullptr) MKUDNS_ABORT();
+  mkudns_mpsc_node<Value> *next = queue->tail->next.load();
+  if (next == nullptr) return false;
+  *value = std::move(next->value);
+  delete queue->tail;
+  queue->tail = next;
+  return true;
+}
+
+// mkudns_mpsc_empty returns whether mkudns_mpsc_pop would fail. Only the
+// consumer may call this function.
+template <typename Value>
+static bool mkudns_mpsc_empty(const mkudns_mpsc<Value> *queue) {
+  if (queue == nullptr) MKUDNS_ABORT();
+  return queue->tail->next.load() == nullptr;
+}
+
+// mkudns_pool
+// -----------
+
+// mkudns_pool_worker is a worker thread of a pool, with its own tasks.
+struct mkudns_pool_worker {
+  // mutex protects tasks.
+  std::mutex mutex;
+
+  // tasks contains the tasks of the worker. The worker runs them oldest
+  // first, while the other workers steal them newest first.
+  std::deque<std::function<void()>> tasks;
+
+  // thread is the worker thread.
+  std::thread thread;
+};
+
+// mkudns_pool is a work-stealing pool of threads.
+struct mkudns_pool {
+  // cond allows the idle workers to wait for tasks.
+  std::condition_variable cond;
+
+  // mutex protects stop, and allows to wait on cond.
+  std::mutex mutex;
+
+  // next is the index of the worker that will receive the next task.
+  std::atomic<size_t> next{0};
+
+  // queued is the number of queued tasks. It may be transiently negative,
+  // since we increment it after queueing a task.
+  std::atomic<int64_t> queued{0};
+
+  // sleeping is the number of workers waiting on cond.
+  std::atomic<size_t> sleeping{0};
+
+  // stop indicates that the workers should exit when there are no tasks.
+  bool stop = false;
+
+  // workers contains the workers.
+  std::vector<std::unique_ptr<mkudns_pool_worker>> workers;
+};
+
+// mkudns_pool_take moves a task of @p pool into @p task, looking first at
+// the tasks of the worker at index @p self and then stealing from the other
+// workers, skipping the busy ones. Returns whether it found a task.
+static bool mkudns_pool_take(
+    mkudns_pool *pool, size_t self, std::function<void()> *task) {
+  if (pool == nullptr || task == nullptr) MKUDNS_ABORT();
+  size_t count = pool->workers.size();
+  for (size_t i = 0; i < count; ++i) {
+    mkudns_pool_worker *worker = pool->workers[(self + i) % count].get();
+    std::unique_lock<std::mutex> lock{worker->mutex, std::defer_lock};
+    if (i == 0) {
+      lock.lock();
+    } else if (!lock.try_lock()) {
+      continue;
+    }
+    if (worker->tasks.empty()) continue;
+    if (i == 0) {
+      *task = std::move(worker->tasks.front());
+      worker->tasks.pop_front();
+    } else {
+      *task = std::move(worker->tasks.back());
+      worker->tasks.pop_back();
+    }
+    pool->queued -= 1;
+    return true;
+  }
+  return false;
+}
+
+// mkudns_pool_loop is the main loop of the worker at index @p self.
+static void mkudns_pool_loop(mkudns_pool *pool, size_t self) {
+  if (pool == nullptr) MKUDNS_ABORT();
+  for (;;) {
+    std::function<void()> task;
+    if (mkudns_pool_take(pool, self, &task)) {
+      task();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock{pool->mutex};
+    pool->sleeping += 1;
+    pool->cond.wait(lock, [&]() { return pool->queued > 0 || pool->stop; });
+    pool->sleeping -= 1;
+    if (pool->stop && pool->queued <= 0) return;
+  }
+}
+
+// mkudns_pool_submit queues @p task into @p pool. We only take the pool
+// mutex when a worker is sleeping: since both counters are sequentially
+// consistent, either we see the sleeping worker, or it sees the task.
+static void mkudns_pool_submit(mkudns_pool *pool, std::function<void()> task) {
+  if (pool == nullptr || pool->workers.empty()) MKUDNS_ABORT();
+  mkudns_pool_worker *worker =
+      pool->workers[pool->next++ % pool->workers.size()].get();
+  {
+    std::unique_lock<std::mutex> _{worker->mutex};
+    worker->tasks.push_back(std::move(task));
+  }
+  pool->queued += 1;
+  if (pool->sleeping > 0) {
+    std::unique_lock<std::mutex> _{pool->mutex};
+    pool->cond.notify_one();
+  }
+}
+
+// mkudns_pool_delete runs the queued tasks of @p pool, stops its workers,
+// and destroys it. @p pool may be null.
+static void mkudns_pool_delete(mkudns_pool *pool) {
+  if (pool == nullptr) return;
+  {
+    std::unique_lock<std::mutex> _{pool->mutex};
+    pool->stop = true;
+    pool->cond.notify_all();
+  }
+  for (auto &worker : pool->workers) worker->thread.join();
+  delete pool;
+}
+
+// mkudns_pool_new_nonnull creates a pool with @p workers workers.
+static mkudns_pool *mkudns_pool_new_nonnull(size_t workers) {
+  if (workers <= 0) MKUDNS_ABORT();
+  std::unique_ptr<mkudns_pool> pool{new mkudns_pool};
+  for (size_t i = 0; i < workers; ++i) {
+    pool->workers.emplace_back(new mkudns_pool_worker);
+  }
+  for (size_t i = 0; i < workers; ++i) {
+    pool->workers[i]->thread = std::thread{mkudns_pool_loop, pool.get(), i};
+  }
+  return pool.release();
+}
+
+// mkudns_bucket
+// -------------
+
+// mkudns_bucket_token is the number of millitokens in a token. We count
+// millitokens, so that we can refill the bucket every millisecond.
+constexpr int64_t mkudns_bucket_token = 1000;
+
+// mkudns_bucket_burst is the number of milliseconds worth of tokens that a
+// bucket holds at most.
+constexpr int64_t mkudns_bucket_burst = 10;
+
+// mkudns_bucket is a token bucket limiting the rate of some operation.
+struct mkudns_bucket {
+  // rate is the number of tokens added per second, which is also the number
+  // of millitokens added per millisecond. Zero means no limit.
+  int64_t rate = 0;
+
+  // tokens is the number of millitokens in the bucket.
+  int64_t tokens = 0;
+
+  // updated is when we last added tokens, according to the monotonic clock.
+  int64_t updated = 0;
+};
+
+// mkudns_bucket_reset sets the rate of @p bucket to @p rate tokens per
+// second, and fills the bucket.
+static void mkudns_bucket_reset(mkudns_bucket *bucket, int64_t rate) {
+  if (bucket == nullptr) MKUDNS_ABORT();
+  bucket->rate = std::max<int64_t>(rate, 0);
+  bucket->tokens = std::max(bucket->rate * mkudns_bucket_burst,
+                            mkudns_bucket_token);
+  bucket->updated = mkudns_now();
+}
+
+// mkudns_bucket_ready returns whether @p bucket contains a token at @p now.
+static bool mkudns_bucket_ready(mkudns_bucket *bucket, int64_t now) {
+  if (bucket == nullptr) MKUDNS_ABORT();
+  if (bucket->rate <= 0) return true;
+  if (now > bucket->updated) {
+    int64_t capacity = std::max(bucket->rate * mkudns_bucket_burst,
+                                mkudns_bucket_token);
+    bucket->tokens = std::min(
+        capacity, bucket->tokens + (now - bucket->updated) * bucket->rate);
+    bucket->updated = now;
+  }
+  return bucket->tokens >= mkudns_bucket_token;
+}
+
+// mkudns_bucket_take removes a token from @p bucket, which must be ready.
+static void mkudns_bucket_take(mkudns_bucket *bucket) {
+  if (bucket == nullptr) MKUDNS_ABORT();
+  if (bucket->rate > 0) bucket->tokens -= mkudns_bucket_token;
+}
+
+// mkudns_bucket_when returns when @p bucket, which is not ready at @p now,
+// will contain a token, according to the monotonic clock.
+static int64_t mkudns_bucket_when(const mkudns_bucket *bucket, int64_t now) {
+  if (bucket == nullptr || bucket->rate <= 0) MKUDNS_ABORT();
+  int64_t missing = std::max<int64_t>(mkudns_bucket_token - bucket->tokens, 0);
+  return now + (missing + bucket->rate - 1) / bucket->rate;
+}
+
+// mkudns_engine
+// -------------
+
+// mkudns_engine_max_inflight is the maximum number of queries in flight on
+// each engine socket. We keep it well below the number of query IDs, so that
+// a random ID is very likely to be free.
+constexpr size_t mkudns_engine_max_inflight = 16384;
+
+// mkudns_engine_max_starts is the maximum number of queries that we start
+// before checking for responses and timeouts again.
+constexpr size_t mkudns_engine_max_starts = 512;
+
+// mkudns_engine_max_batch is the maximum number of datagrams that we read
+// from a socket before checking the other socket and the timeouts again.
+constexpr size_t mkudns_engine_max_batch = 256;
+
+// mkudns_engine_bufsiz is the size of the largest response that the engine
+// is able to receive.
+constexpr size_t mkudns_engine_bufsiz = 4096;
+
+// mkudns_engine_rcvbuf is the receive buffer size that we request for the
+// engine sockets.
+constexpr int mkudns_engine_rcvbuf = 1 << 22;
+
+// mkudns_engine_idle_poll is how often, in milliseconds, an engine serving
+// posted queries checks for new queries, when it could not create its wakeup
+// socket and therefore cannot sleep until a thread posts a query.
+constexpr int64_t mkudns_engine_idle_poll = 10;
+
+// mkudns_engine_wakeup_index is the index that identifies the wakeup socket
+// among the engine sockets when waiting for events.
+constexpr size_t mkudns_engine_wakeup_index = 2;
+
+// mkudns_engine_initial_window is the initial number of queries in flight to
+// each server when the engine adapts it.
+constexpr size_t mkudns_engine_initial_window = 10;
+
+// mkudns_engine_backend is the I/O backend of an engine.
+enum class mkudns_engine_backend { poll, epoll, io_uring };
+
+// mkudns_engine_server contains what an engine knows about a server, which
+// it only tracks when there are per-server limits.
+struct mkudns_engine_server {
+  // acked is the number of responses received since the window last changed.
+  size_t acked = 0;
+
+  // bucket limits the rate of the queries sent to the server.
+  mkudns_bucket bucket;
+
+  // cut_at is when we last halved the window, according to the monotonic
+  // clock, or -1 if we never did.
+  int64_t cut_at = -1;
+
+  // inflight is the number of queries in flight to the server.
+  size_t inflight = 0;
+
+  // queued indicates that the server is in the engine queued servers.
+  bool queued = false;
+
+  // waiting contains the indexes of the queries that wait for the server,
+  // because it has too many queries in flight or it exceeded its rate.
+  std::deque<size_t> waiting;
+
+  // window is the maximum number of queries in flight to the server, when
+  // the engine adapts it.
+  size_t window = mkudns_engine_initial_window;
+};
+
+// mkudns_engine_op is a query performed by an engine.
+struct mkudns_engine_op {
+  // mkudns_engine_op creates an operation using the settings of @p q.
+  explicit mkudns_engine_op(const mkudns_query_t &q) : query{q} {}
+
+  // addr is the server address.
+  sockaddr_storage addr{};
+
+  // addrlen is the length of addr, or zero if we did not parse it yet.
+  socklen_t addrlen = 0;
+
+  // blocked indicates that the query is in the engine blocked queue.
+  bool blocked = false;
+
+  // callback receives the response, if the query has been submitted using
+  // mkudns_engine_submit_callback.
+  mkudns_engine_callback callback;
+
+  // deadline is when the query must complete, according to the monotonic
+  // clock, or a negative value if there is no deadline besides the timeout.
+  int64_t deadline = -1;
+
+  // done indicates that the query is complete.
+  bool done = false;
+
+#ifdef MKUDNS_HAVE_IO_URING
+  // hdr is the message header of the io_uring send.
+  msghdr hdr{};
+#endif
+
+  // inflight indicates whether the query ID is in the engine inflight map.
+  bool inflight = false;
+
+#ifdef MKUDNS_HAVE_IO_URING
+  // iov is the buffer of the io_uring send.
+  iovec iov{};
+#endif
+
+  // msg is the serialized query.
+  std::string msg;
+
+  // pooled indicates that a pool worker processes the response.
+  bool pooled = false;
+
+  // posted indicates that the query has been submitted using
+  // mkudns_engine_post.
+  bool posted = false;
+
+  // query contains the settings of the query. The engine sets its ID.
+  mkudns_query_t query;
+
+  // queued indicates that the query is in the queue of its server.
+  bool queued = false;
+
+  // queued_at is when we added the query to the engine, according to the
+  // monotonic clock.
+  int64_t queued_at = 0;
+
+  // released indicates that the engine should free the operation as soon as
+  // the send in flight completes.
+  bool released = false;
+
+  // response is the response to the query.
+  mkudns_response_uptr response{new mkudns_response_t};
+
+  // sending indicates that the send is in flight (io_uring only).
+  bool sending = false;
+
+  // serial is the serial number that identifies the query.
+  uint64_t serial = 0;
+
+  // server is the server of the query, if we track the servers.
+  mkudns_engine_server *server = nullptr;
+
+  // sock is the index of the engine socket used by the query.
+  size_t sock = 0;
+
+  // started indicates whether we started the query.
+  bool started = false;
+
+  // tag is the tag of a posted query.
+  uint64_t tag = 0;
+
+  // timer is the timer of the query deadline in the engine timers.
+  mkudns_wheel_timer timer;
+};
+
+#ifdef MKUDNS_HAVE_IO_URING
+
+// mkudns_uring_entries is the size of the io_uring submission queue. The
+// completion queue is twice as large, which is enough for the sends we start
+// between two waits plus a completion per provided buffer.
+constexpr unsigned mkudns_uring_entries = 1024;
+
+// mkudns_uring_buffers is the number of provided buffers, which must be a
+// power of two.
+constexpr unsigned mkudns_uring_buffers = 512;
+
+// mkudns_uring_control is the space for control messages in each buffer.
+constexpr size_t mkudns_uring_control = 64;
+
+// mkudns_uring_slot is the size of each provided buffer, which begins with
+// the io_uring_recvmsg_out header, the source address, and the control
+// messages, followed by the datagram.
+constexpr size_t mkudns_uring_slot = sizeof(io_uring_recvmsg_out) +
+    sizeof(sockaddr_storage) + mkudns_uring_control + mkudns_engine_bufsiz;
+
+// mkudns_uring_recv tags the user data of receive operations, whose lower
+// bits are the socket index.
+constexpr uint64_t mkudns_uring_recv = uint64_t{1} << 32;
+
+// mkudns_uring_send tags the user data of send operations, whose lower
+// bits are the query index.
+constexpr uint64_t mkudns_uring_send = uint64_t{2} << 32;
+
+// mkudns_uring_wake is the user data of the poll of the wakeup socket.
+constexpr uint64_t mkudns_uring_wake = uint64_t{3} << 32;
+
+// mkudns_uring is an io_uring instance. We use the system calls directly,
+// so that we do not depend on liburing.
+struct mkudns_uring {
+  // buf_ring is the ring of provided buffers shared with the kernel. We use
+  // it as an array of io_uring_buf, whose first resv field is the ring tail
+  // (see io_uring_buf_ring), because in C++ the io_uring_buf_ring flexible
+  // array does not start at the beginning of the structure.
+  io_uring_buf *buf_ring = nullptr;
+
+  // buf_tail is the tail of buf_ring, which only we modify.
+  uint16_t buf_tail = 0;
+
+  // buffers contains the memory of the provided buffers.
+  std::vector<char> buffers;
+
+  // cq_head is the head of the completion queue.
+  unsigned *cq_head = nullptr;
+
+  // cq_mask is the mask of the completion queue indexes.
+  unsigned cq_mask = 0;
+
+  // cq_tail is the tail of the completion queue.
+  unsigned *cq_tail = nullptr;
+
+  // cqes contains the completion queue entries.
+  io_uring_cqe *cqes = nullptr;
+
+  // fd is the io_uring file descriptor.
+  int fd = -1;
+
+  // maps contains the address and size of the memory mappings.
+  std::vector<std::pair<void *, size_t>> maps;
+
+  // recv_armed indicates whether each socket has an active receive.
+  std::array<bool, 2> recv_armed{{false, false}};
+
+  // recv_hdr contains the message header of the receive of each socket.
+  std::array<msghdr, 2> recv_hdr{};
+
+  // sq_entries is the size of the submission queue.
+  unsigned sq_entries = 0;
+
+  // sq_head is the head of the submission queue.
+  unsigned *sq_head = nullptr;
+
+  // sq_mask is the mask of the submission queue indexes.
+  unsigned sq_mask = 0;
+
+  // sq_tail is the tail of the submission queue.
+  unsigned *sq_tail = nullptr;
+
+  // sqes contains the submission queue entries.
+  io_uring_sqe *sqes = nullptr;
+
+  // wake_armed indicates whether the wakeup socket has an active poll.
+  bool wake_armed = false;
+};
+
+// mkudns_uring_mmap maps @p size bytes at @p offset of @p fd, or anonymous
+// memory if @p fd is negative, and remembers the mapping into @p uring, so
+// that mkudns_uring_close unmaps it. Returns null on failure.
+static char *mkudns_uring_mmap(
+    mkudns_uring *uring, size_t size, int fd, off_t offset) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   (fd >= 0) ? (MAP_SHARED | MAP_POPULATE)
+                             : (MAP_PRIVATE | MAP_ANONYMOUS),
+                   fd, offset);
+  MKUDNS_HOOK(mmap, (ptr != MAP_FAILED));
+  if (ptr == MAP_FAILED) return nullptr;
+  uring->maps.emplace_back(ptr, size);
+  return static_cast<char *>(ptr);
+}
+
+// mkudns_uring_close releases the resources of @p uring. Closing the file
+// descriptor also unregisters the sockets and the provided buffers.
+static void mkudns_uring_close(mkudns_uring *uring) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  if (uring->fd >= 0) close(uring->fd);
+  uring->fd = -1;
+  for (auto &map : uring->maps) munmap(map.first, map.second);
+  uring->maps.clear();
+}
+
+// mkudns_uring_enter submits the pending SQEs of @p uring and, if @p wait is
+// true, waits for a completion for up to @p timeout milliseconds (a negative
+// timeout means no timeout). Returns like io_uring_enter.
+static int mkudns_uring_enter(mkudns_uring *uring, bool wait, int64_t timeout) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  unsigned to_submit = *uring->sq_tail -
+                       __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  if (!wait && to_submit <= 0) return 0;
+  __kernel_timespec ts{};
+  io_uring_getevents_arg arg{};
+  if (wait && timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+  }
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (wait) flags |= IORING_ENTER_GETEVENTS;
+  // We don't hook io_uring_enter and the other per-batch system calls of the
+  // engine, because printing would dominate the cost of the engine loop.
+  return static_cast<int>(syscall(__NR_io_uring_enter, uring->fd, to_submit,
+                                  wait ? 1U : 0U, flags, &arg, sizeof(arg)));
+}
+
+// mkudns_uring_sqe returns a zeroed SQE of @p uring, submitting the pending
+// SQEs first if the submission queue is full, or null on failure. Use
+// mkudns_uring_push to pass the returned SQE to the kernel.
+static io_uring_sqe *mkudns_uring_sqe(mkudns_uring *uring) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  unsigned tail = *uring->sq_tail;
+  if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+      uring->sq_entries) {
+    mkudns_uring_enter(uring, false, -1);
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+        uring->sq_entries) {
+      return nullptr;
+    }
+  }
+  io_uring_sqe *sqe = &uring->sqes[tail & uring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// mkudns_uring_push passes to the kernel the SQE that mkudns_uring_sqe has
+// returned, which will be submitted by the next mkudns_uring_enter.
+static void mkudns_uring_push(mkudns_uring *uring) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+// mkudns_uring_put_buffer gives back to the kernel the provided buffer
+// @p bid of @p uring.
+static void mkudns_uring_put_buffer(mkudns_uring *uring, uint16_t bid) {
+  if (uring == nullptr || bid >= mkudns_uring_buffers) MKUDNS_ABORT();
+  io_uring_buf *buf =
+      &uring->buf_ring[uring->buf_tail & (mkudns_uring_buffers - 1)];
+  buf->addr = reinterpret_cast<uint64_t>(
+      uring->buffers.data() + size_t{bid} * mkudns_uring_slot);
+  buf->len = static_cast<uint32_t>(mkudns_uring_slot);
+  buf->bid = bid;
+  ++uring->buf_tail;
+  __atomic_store_n(&uring->buf_ring[0].resv, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// mkudns_uring_arm_recv starts a multishot receive on the socket at index
+// @p sock of @p uring, which receives datagrams into the provided buffers
+// until it runs out of buffers or fails. Returns false on failure.
+static bool mkudns_uring_arm_recv(mkudns_uring *uring, size_t sock) {
+  if (uring == nullptr || sock >= uring->recv_hdr.size()) MKUDNS_ABORT();
+  io_uring_sqe *sqe = mkudns_uring_sqe(uring);
+  if (sqe == nullptr) return false;
+  msghdr *hdr = &uring->recv_hdr[sock];
+  *hdr = msghdr{};
+  hdr->msg_namelen = sizeof(sockaddr_storage);
+  hdr->msg_controllen = mkudns_uring_control;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = static_cast<int32_t>(sock);
+  sqe->flags = static_cast<uint8_t>(IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT);
+  sqe->ioprio = static_cast<uint16_t>(IORING_RECV_MULTISHOT);
+  sqe->addr = reinterpret_cast<uint64_t>(hdr);
+  sqe->len = 1;
+  sqe->buf_group = 0;
+  sqe->user_data = mkudns_uring_recv | sock;
+  mkudns_uring_push(uring);
+  uring->recv_armed[sock] = true;
+  return true;
+}
+
+// mkudns_uring_arm_wake starts a multishot poll of the wakeup socket @p sock
+// using @p uring. Returns false on failure.
+static bool mkudns_uring_arm_wake(mkudns_uring *uring, mkudns_socket_t sock) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  io_uring_sqe *sqe = mkudns_uring_sqe(uring);
+  if (sqe == nullptr) return false;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = sock;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = mkudns_uring_wake;
+  mkudns_uring_push(uring);
+  uring->wake_armed = true;
+  return true;
+}
+
+// mkudns_uring_open sets up @p uring, registers @p socks, and starts to
+// receive from them. Returns false if io_uring, or any io_uring feature
+// that we need, is not available.
+static bool mkudns_uring_open(
+    mkudns_uring *uring, const std::array<mkudns_socket_t, 2> &socks) {
+  if (uring == nullptr) MKUDNS_ABORT();
+  io_uring_params params{};
+  long ret = syscall(__NR_io_uring_setup, mkudns_uring_entries, &params);
+  MKUDNS_HOOK(io_uring_setup, ret);
+  if (ret < 0) return false;
+  uring->fd = static_cast<int>(ret);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_EXT_ARG) == 0) {
+    return false;
+  }
+  size_t ring_size = std::max<size_t>(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  char *ring = mkudns_uring_mmap(uring, ring_size, uring->fd,
+                                 IORING_OFF_SQ_RING);
+  char *sqes = mkudns_uring_mmap(
+      uring, params.sq_entries * sizeof(io_uring_sqe), uring->fd,
+      static_cast<off_t>(IORING_OFF_SQES));
+  if (ring == nullptr || sqes == nullptr) return false;
+  uring->sq_head = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+  uring->sq_tail = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+  uring->sq_mask = *reinterpret_cast<unsigned *>(
+      ring + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  unsigned *sq_array = reinterpret_cast<unsigned *>(
+      ring + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; ++i) sq_array[i] = i;
+  uring->sqes = reinterpret_cast<io_uring_sqe *>(sqes);
+  uring->cq_head = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+  uring->cq_tail = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+  uring->cq_mask = *reinterpret_cast<unsigned *>(
+      ring + params.cq_off.ring_mask);
+  uring->cqes = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+  std::array<int, 2> fds{{socks[0], socks[1]}};  // -1 is a sparse entry
+  ret = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES,
+                fds.data(), static_cast<unsigned>(fds.size()));
+  MKUDNS_HOOK(io_uring_register_files, ret);
+  if (ret < 0) return false;
+  char *buf_ring = mkudns_uring_mmap(
+      uring, mkudns_uring_buffers * sizeof(io_uring_buf), -1, 0);
+  if (buf_ring == nullptr) return false;
+  uring->buf_ring = reinterpret_cast<io_uring_buf *>(buf_ring);
+  io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+  reg.ring_entries = mkudns_uring_buffers;
+  reg.bgid = 0;
+  ret = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1);
+  MKUDNS_HOOK(io_uring_register_pbuf_ring, ret);
+  if (ret < 0) return false;
+  uring->buffers.resize(mkudns_uring_buffers * mkudns_uring_slot);
+  for (unsigned i = 0; i < mkudns_uring_buffers; ++i) {
+    mkudns_uring_put_buffer(uring, static_cast<uint16_t>(i));
+  }
+  for (size_t i = 0; i < socks.size(); ++i) {
+    if (socks[i] == mkudns_socket_invalid) continue;
+    if (!mkudns_uring_arm_recv(uring, i)) return false;
+  }
+  ret = mkudns_uring_enter(uring, false, -1);
+  MKUDNS_HOOK(io_uring_enter, ret);
+  if (ret < 0) return false;
+  // Kernels that do not support multishot receives fail them immediately,
+  // while otherwise they only complete when we receive a datagram.
+  unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  for (unsigned head = *uring->cq_head; head != tail; ++head) {
+    if (uring->cqes[head & uring->cq_mask].res < 0) return false;
+  }
+  return true;
+}
+
+#endif  // MKUDNS_HAVE_IO_URING
+
+struct mkudns_engine_shard;
+
+// mkudns_engine_request is a query posted to an engine.
+struct mkudns_engine_request {
+  // query contains the settings of the query.
+  mkudns_query_t query;
+
+  // tag is the tag passed to mkudns_engine_post.
+  uint64_t tag = 0;
+};
+
+// mkudns_engine_result is the result of a posted query.
+struct mkudns_engine_result {
+  // response is the response to the query.
+  mkudns_response_uptr response;
+
+  // tag is the tag passed to mkudns_engine_post.
+  uint64_t tag = 0;
+};
+
+// mkudns_engine_results contains the results of the posted queries, and is
+// shared by the shards of a sharded engine.
+struct mkudns_engine_results {
+  // cond allows the thread reaping results to wait for them.
+  std::condition_variable cond;
+
+  // mutex allows to wait on cond.
+  std::mutex mutex;
+
+  // outstanding is the number of posted queries that were not reaped.
+  std::atomic<int64_t> outstanding{0};
+
+  // queue contains the results that were not reaped.
+  mkudns_mpsc<mkudns_engine_result> queue;
+
+  // waiting indicates that the thread reaping results waits on cond.
+  std::atomic<bool> waiting{false};
+};
+
+// mkudns_engine is the private data of mkudns_engine_t.
+struct mkudns_engine {
+  // adaptive indicates that we adapt the window of each server.
+  bool adaptive = false;
+
+  // backend is the backend in use.
+  mkudns_engine_backend backend = mkudns_engine_backend::poll;
+
+  // batch contains the indexes of the queries that mkudns_engine_run_nonnull
+  // should return, in submission order.
+  std::vector<size_t> batch;
+
+  // blocked contains the indexes of the queries whose send would have
+  // blocked, which we will send again later. Only used without io_uring.
+  std::deque<size_t> blocked;
+
+  // bucket limits the rate of the queries sent by the engine.
+  mkudns_bucket bucket;
+
+  // buffer is the buffer for receiving without io_uring.
+  std::vector<char> buffer = std::vector<char>(mkudns_engine_bufsiz);
+
+  // cancels contains the serial numbers of the queries canceled with
+  // mkudns_engine_cancel_async.
+  mkudns_mpsc<uint64_t> cancels;
+
+  // completed contains the indexes of the complete queries whose callback
+  // we did not call yet.
+  std::deque<size_t> completed;
+
+  // epoll_fd is the epoll file descriptor, if we use epoll.
+  int epoll_fd = -1;
+
+  // free_slots contains the indexes of the free slots of ops.
+  std::vector<size_t> free_slots;
+
+  // inbox contains the queries posted to the engine, which the engine thread
+  // has not added to its queries yet.
+  mkudns_mpsc<mkudns_engine_request> inbox;
+
+  // inflight maps the socket index and the query ID of the queries in
+  // flight to their indexes.
+  std::unordered_map<uint32_t, size_t> inflight;
+
+  // inflight_count contains the number of queries in flight per socket.
+  std::array<size_t, 2> inflight_count{{0, 0}};
+
+  // next_serial is the serial number of the next submitted query.
+  uint64_t next_serial = 1;
+
+  // next_post is the index of the shard of the next posted query.
+  std::atomic<size_t> next_post{0};
+
+  // next_shard is the index of the shard of the next submitted query.
+  size_t next_shard = 0;
+
+  // next_start is when we can start queries again, according to the
+  // monotonic clock, if we are waiting for a bucket, and -1 otherwise.
+  int64_t next_start = -1;
+
+  // ops contains the submitted queries. A slot is free when it is null.
+  std::vector<std::unique_ptr<mkudns_engine_op>> ops;
+
+  // pending is the number of submitted queries that are not complete.
+  size_t pending = 0;
+
+  // pool is the pool processing the responses, if any, which is shared by
+  // the shards of a sharded engine.
+  std::shared_ptr<mkudns_pool> pool;
+
+  // processed_cond allows to wait for the pool to process our responses.
+  std::condition_variable processed_cond;
+
+  // processed_mutex allows to wait on processed_cond.
+  std::mutex processed_mutex;
+
+  // processing is the number of responses that the pool is processing.
+  std::atomic<size_t> processing{0};
+
+  // queued_servers contains the servers with waiting queries.
+  std::vector<mkudns_engine_server *> queued_servers;
+
+  // random_ids contains random query IDs, which we generate in batches.
+  std::vector<uint16_t> random_ids;
+
+  // results contains the results of the posted queries, which are shared
+  // by the shards of a sharded engine.
+  std::shared_ptr<mkudns_engine_results> results{new mkudns_engine_results};
+
+  // routes contains the index of the shard of each submitted query, in
+  // submission order. Only used by sharded engines.
+  std::vector<size_t> routes;
+
+  // rtts contains the RTTs observed since the beginning of the run for each
+  // server, which we add to the global RTTs at the end of the run, so that
+  // engines running in parallel do not contend for the RTTs mutex.
+  std::unordered_map<std::string, std::vector<int64_t>> rtts;
+
+  // serials maps the serial numbers of the queries to their indexes.
+  std::unordered_map<uint64_t, size_t> serials;
+
+  // serve_once ensures that we start serving posted queries once.
+  std::once_flag serve_once;
+
+  // server_max_inflight is the maximum number of queries in flight to each
+  // server, or zero if there is no limit.
+  size_t server_max_inflight = 0;
+
+  // server_max_qps is the maximum rate of the queries sent to each server,
+  // or zero if there is no limit.
+  int64_t server_max_qps = 0;
+
+  // servers maps the address and port of the servers to what we know about
+  // them. We only track the servers when there are per-server limits.
+  std::unordered_map<std::string, mkudns_engine_server> servers;
+
+  // serving indicates that the engine serves posted queries.
+  bool serving = false;
+
+  // sending is the number of sends submitted to io_uring and not completed.
+  size_t sending = 0;
+
+  // shards contains the shards of a sharded engine, which performs all its
+  // queries using them, and is empty otherwise.
+  std::vector<std::unique_ptr<mkudns_engine_shard>> shards;
+
+  // sleeping indicates that the engine thread may sleep until a thread
+  // posts a query and wakes it up using the wakeup socket.
+  std::atomic<bool> sleeping{false};
+
+  // sock_errors contains the error that occurred creating each socket.
+  std::array<int, 2> sock_errors{{0, 0}};
+
+  // socks contains the IPv4 and the IPv6 sockets.
+  std::array<mkudns_socket_t, 2> socks{
+      {mkudns_socket_invalid, mkudns_socket_invalid}};
+
+  // stopping tells the engine thread to stop serving posted queries.
+  std::atomic<bool> stopping{false};
+
+  // thread is the thread serving the queries posted to a plain engine.
+  std::thread thread;
+
+  // timers contains the query deadlines. The value of each timer is the
+  // index of its query.
+  mkudns_wheel timers;
+
+  // waiting contains the indexes of the queries to start.
+  std::deque<size_t> waiting;
+
+  // wakeup is a datagram socket connected to itself, which wakes up the
+  // engine thread when we post or cancel a query while it sleeps.
+  mkudns_socket_t wakeup = mkudns_socket_invalid;
+
+  // watched indicates that we tried to create the wakeup socket.
+  bool watched = false;
+
+#ifdef MKUDNS_HAVE_IO_URING
+  // uring is the io_uring instance, if we use io_uring.
+  std::unique_ptr<mkudns_uring> uring;
+#endif
+};
+
+// mkudns_engine_shard is a shard of a sharded engine, i.e., an engine
+// running in its own thread.
+struct mkudns_engine_shard {
+  // cond allows to wait for changes of running and stop.
+  std::condition_variable cond;
+
+  // engine is the engine of the shard. While running is true, only the
+  // shard thread uses it.
+  mkudns_engine_uptr engine;
+
+  // mutex protects running, responses, serving, and stop.
+  std::mutex mutex;
+
+  // responses contains the responses of the latest run.
+  mkudns_responses_uptr responses;
+
+  // running indicates that the shard thread should run the engine, and is
+  // reset by the shard thread when the run is complete.
+  bool running = false;
+
+  // serving indicates that the shard thread should serve the queries posted
+  // to the engine until the engine stops.
+  bool serving = false;
+
+  // stop indicates that the shard thread should exit.
+  bool stop = false;
+
+  // thread is the shard thread.
+  std::thread thread;
+};
+
+// mkudns_engine_socket returns a nonblocking datagram socket for @p family
+// bound to an ephemeral port, or mkudns_socket_invalid on failure, in which
+// case @p err is the system error.
+static mkudns_socket_t mkudns_engine_socket(int family, int *err) {
+  if (err == nullptr) MKUDNS_ABORT();
+  mkudns_socket_t sock = socket(family, SOCK_DGRAM, 0);
+  *err = mkudns_last_error();
+  MKUDNS_HOOK(socket, sock);
+  if (sock == mkudns_socket_invalid) return mkudns_socket_invalid;
+  sockaddr_storage ss{};
+  socklen_t sslen = 0;
+  if (family == AF_INET6) {
+    sockaddr_in6 sin6{};
+    sin6.sin6_family = AF_INET6;
+    memcpy(&ss, &sin6, sizeof(sin6));
+    sslen = sizeof(sin6);
+  } else {
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    memcpy(&ss, &sin, sizeof(sin));
+    sslen = sizeof(sin);
+  }
+  bool ok = mkudns_set_nonblocking(sock) &&
+            bind(sock, reinterpret_cast<sockaddr *>(&ss), sslen) == 0;
+  {
+    // Make room for many responses. The kernel may use a smaller buffer.
+    int bufsiz = mkudns_engine_rcvbuf;
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                     reinterpret_cast<char *>(&bufsiz), sizeof(bufsiz));
+  }
+#if defined IP_RECVTTL && defined IPV6_RECVHOPLIMIT
+  {
+    // Receive the TTL of responses, which helps to spot injection.
+    int on = 1;
+    ok = ok && ((family == AF_INET6)
+        ? setsockopt(sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on))
+        : setsockopt(sock, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on))) == 0;
+  }
+#endif
+  if (!ok) {
+    *err = mkudns_last_error();
+    MKUDNS_CLOSESOCKET(sock);
+    return mkudns_socket_invalid;
+  }
+  return sock;
+}
+
+// mkudns_engine_key returns the key of the inflight map for the query with
+// @p id sent using the socket at index @p sock.
+static uint32_t mkudns_engine_key(size_t sock, uint16_t id) {
+  return (static_cast<uint32_t>(sock) << 16) | id;
+}
+
+// mkudns_engine_id returns a random ID that is not in use by any query in
+// flight on the socket at index @p sock of @p engine. This function aborts
+// if it cannot gather enough entropy to generate random IDs.
+static uint16_t mkudns_engine_id(mkudns_engine *engine, size_t sock) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  for (;;) {
+    if (engine->random_ids.empty()) {
+      engine->random_ids.resize(256);
+      int ret = RAND_bytes(
+          reinterpret_cast<unsigned char *>(engine->random_ids.data()),
+          static_cast<int>(engine->random_ids.size() * sizeof(uint16_t)));
+      if (ret != 1) MKUDNS_ABORT();
+    }
+    uint16_t id = engine->random_ids.back();
+    engine->random_ids.pop_back();
+    if (engine->inflight.count(mkudns_engine_key(sock, id)) <= 0) return id;
+  }
+}
+
+// mkudns_sockaddr_equal returns whether @p a and @p b contain the same
+// address and port.
+static bool mkudns_sockaddr_equal(
+    const sockaddr_storage &a, const sockaddr_storage &b) {
+  if (a.ss_family != b.ss_family) return false;
+  if (a.ss_family == AF_INET) {
+    const sockaddr_in *sa = reinterpret_cast<const sockaddr_in *>(&a);
+    const sockaddr_in *sb = reinterpret_cast<const sockaddr_in *>(&b);
+    return sa->sin_port == sb->sin_port &&
+           memcmp(&sa->sin_addr, &sb->sin_addr, sizeof(sa->sin_addr)) == 0;
+  }
+  if (a.ss_family == AF_INET6) {
+    const sockaddr_in6 *sa = reinterpret_cast<const sockaddr_in6 *>(&a);
+    const sockaddr_in6 *sb = reinterpret_cast<const sockaddr_in6 *>(&b);
+    return sa->sin6_port == sb->sin6_port &&
+           memcmp(&sa->sin6_addr, &sb->sin6_addr, sizeof(sa->sin6_addr)) == 0;
+  }
+  return false;
+}
+
+// mkudns_engine_complete marks the query at index @p idx of @p engine as
+// complete, and forgets about its ID and deadline. If the query has a
+// callback, or has been posted, mkudns_engine_dispatch will deliver it.
+static void mkudns_engine_complete(mkudns_engine *engine, size_t idx) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+  if (op->done) return;
+  if (op->inflight) {
+    engine->inflight.erase(mkudns_engine_key(op->sock, op->query.id));
+    engine->inflight_count[op->sock] -= 1;
+    op->inflight = false;
+  }
+  mkudns_wheel_cancel(&engine->timers, &op->timer);
+  if (op->started && op->server != nullptr) op->server->inflight -= 1;
+  op->done = true;
+  engine->pending -= 1;
+  if (op->callback || (op->posted && !op->pooled)) {
+    engine->completed.push_back(idx);
+  }
+}
+
+// mkudns_engine_free frees the slot of the complete query at index @p idx
+// of @p engine or, if its send is in flight, arranges for the slot to be
+// freed when the send completes.
+static void mkudns_engine_free(mkudns_engine *engine, size_t idx) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+  if (op == nullptr || !op->done) MKUDNS_ABORT();
+  if (op->sending) {
+    op->released = true;
+    return;
+  }
+  engine->serials.erase(op->serial);
+  engine->ops[idx].reset();
+  engine->free_slots.push_back(idx);
+}
+
+// mkudns_engine_deliver makes the result of the posted query tagged @p tag,
+// whose response is @p response, available to mkudns_engine_reap using
+// @p results. Any thread may deliver.
+static void mkudns_engine_deliver(mkudns_engine_results *results, uint64_t tag,
+                                  mkudns_response_uptr response) {
+  if (results == nullptr || response == nullptr) MKUDNS_ABORT();
+  std::unique_ptr<mkudns_mpsc_node<mkudns_engine_result>> node{
+      new mkudns_mpsc_node<mkudns_engine_result>};
+  node->value.response = std::move(response);
+  node->value.tag = tag;
+  mkudns_mpsc_push(&results->queue, node.release());
+  // We only take the mutex when the reaping thread waits: since the push
+  // and waiting are sequentially consistent, either we see that it waits,
+  // or it sees our result.
+  if (results->waiting) {
+    std::unique_lock<std::mutex> _{results->mutex};
+    results->cond.notify_one();
+  }
+}
+
+// mkudns_engine_adapt updates the window of the server of @p op, which is a
+// query of @p engine that got a response or, if @p lost, that timed out or
+// was refused. Like TCP congestion avoidance, we grow a window that limits
+// the queries by one query per window of responses, and we halve it on loss
+// only for the queries sent after the previous cut, which would otherwise
+// collapse the window when a burst of queries is lost.
+static void mkudns_engine_adapt(
+    mkudns_engine *engine, const mkudns_engine_op *op, bool lost) {
+  if (engine == nullptr || op == nullptr) MKUDNS_ABORT();
+  mkudns_engine_server *server = op->server;
+  if (!engine->adaptive || server == nullptr || !op->started) return;
+  if (lost) {
+    if (op->response->sent_at <= server->cut_at) return;
+    server->window = std::max<size_t>(server->window / 2, 1);
+    server->acked = 0;
+    server->cut_at = mkudns_now();
+    return;
+  }
+  if (server->inflight < server->window || ++server->acked < server->window) {
+    return;
+  }
+  server->acked = 0;
+  if (engine->server_max_inflight <= 0 ||
+      server->window < engine->server_max_inflight) {
+    server->window += 1;
+  }
+}
+
+// mkudns_engine_recv processes the @p n bytes datagram in @p buff received
+// from @p from using the socket at index @p sock of @p engine. @p recv_ttl
+// is the TTL of the datagram, or -1 if unknown, and @p msg_trunc indicates
+// whether the datagram was larger than the buffer. We ignore datagrams that
+// do not match any query in flight, or that come from another address.
+static void mkudns_engine_recv(
+    mkudns_engine *engine, size_t sock, const char *buff, int64_t n,
+    const sockaddr_storage &from, int64_t recv_ttl, bool msg_trunc) {
+  if (engine == nullptr || buff == nullptr) MKUDNS_ABORT();
+  int64_t id = mkudns_get_id(buff, n);
+  if (id < 0) return;
+  auto it = engine->inflight.find(
+      mkudns_engine_key(sock, static_cast<uint16_t>(id)));
+  if (it == engine->inflight.end()) return;
+  mkudns_engine_op *op = engine->ops[it->second].get();
+  if (!mkudns_sockaddr_equal(from, op->addr)) return;
+  mkudns_engine_adapt(
+      engine, op, n >= 4 && (buff[3] & 0x0f) == ns_r_refused);
+  mkudns_response_t *response = op->response.get();
+  if (engine->pool != nullptr && !op->callback &&
+      !(op->posted && op->sending)) {
+    // Once we submit the task, only the task uses the response until the
+    // end of the run. The op does not move, since the engine owns it by
+    // pointer, and we do not free it before the end of the run.
+    response->rtt = mkudns_now() - response->sent_at;
+    op->pooled = true;
+    size_t idx = it->second;
+    mkudns_engine_complete(engine, idx);
+    if (op->posted) {
+      // The task owns a posted op and delivers its result, so that we can
+      // reuse the slot now. Since the task cannot access our RTTs, we count
+      // the RTT of any response coming from the server.
+      engine->rtts[mkudns_rtts_key(op->query.server_address,
+                                   op->query.server_port)]
+          .push_back(response->rtt);
+      (void)engine->ops[idx].release();
+      engine->serials.erase(op->serial);
+      engine->free_slots.push_back(idx);
+    }
+    engine->processing += 1;
+    mkudns_socket_t fd = engine->socks[sock];
+    std::string data{buff, static_cast<size_t>(n)};
+    mkudns_pool_submit(engine->pool.get(), [engine, op, fd, data, recv_ttl,
+                                            msg_trunc]() {
+      op->response->good = mkudns_recv_process(
+          &op->query, op->response.get(), fd, data.data(),
+          static_cast<int64_t>(data.size()), 0, recv_ttl, msg_trunc);
+      if (op->posted) {
+        mkudns_engine_deliver(
+            engine->results.get(), op->tag, std::move(op->response));
+        delete op;
+      }
+      // We decrement while holding the mutex, so that the engine cannot be
+      // destroyed between the decrement and the notification.
+      std::unique_lock<std::mutex> _{engine->processed_mutex};
+      if (--engine->processing == 0) engine->processed_cond.notify_all();
+    });
+    return;
+  }
+  if (mkudns_recv_process(&op->query, response, engine->socks[sock], buff, n,
+                          0, recv_ttl, msg_trunc)) {
+    engine->rtts[mkudns_rtts_key(op->query.server_address,
+                                 op->query.server_port)]
+        .push_back(response->rtt);
+    response->good = true;
+  }
+  mkudns_engine_complete(engine, it->second);
+}
+
+// mkudns_engine_sent records that we sent @p n bytes of the query at index
+// @p idx of @p engine. @p err is the system error, which is meaningful only
+// if @p n is negative. On failure, the query is complete.
+static void mkudns_engine_sent(
+    mkudns_engine *engine, size_t idx, int64_t n, int err) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+  mkudns_response_t *response = op->response.get();
+  nlohmann::json extra;
+  extra["scheduler_delay"] = response->sent_at - op->queued_at;
+  response->send_event = mkudns_send_event_new(
+      &op->query, op->msg.data(), op->msg.size(), n, err, extra);
+  response->events.push_back(response->send_event);
+  if (n < 0 || static_cast<uint64_t>(n) != op->msg.size()) {
+    mkudns_engine_complete(engine, idx);
+  }
+}
+
+// mkudns_engine_send sends the query at index @p idx of @p engine. Without
+// io_uring, if the send would block, we queue the query into the blocked
+// queries, and mkudns_engine_unblock will try again later.
+static void mkudns_engine_send(mkudns_engine *engine, size_t idx) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+#ifdef MKUDNS_HAVE_IO_URING
+  if (engine->backend == mkudns_engine_backend::io_uring) {
+    io_uring_sqe *sqe = mkudns_uring_sqe(engine->uring.get());
+    if (sqe == nullptr) {
+      mkudns_engine_sent(engine, idx, -1, ENOBUFS);
+      return;
+    }
+    op->iov.iov_base = &op->msg[0];
+    op->iov.iov_len = op->msg.size();
+    op->hdr.msg_name = &op->addr;
+    op->hdr.msg_namelen = op->addrlen;
+    op->hdr.msg_iov = &op->iov;
+    op->hdr.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = static_cast<int32_t>(op->sock);
+    sqe->flags = static_cast<uint8_t>(IOSQE_FIXED_FILE);
+    sqe->addr = reinterpret_cast<uint64_t>(&op->hdr);
+    sqe->len = 1;
+    sqe->user_data = mkudns_uring_send | idx;
+    mkudns_uring_push(engine->uring.get());
+    op->sending = true;
+    engine->sending += 1;
+    return;
+  }
+#endif
+#ifdef _WIN32
+  if (op->msg.size() > INT_MAX) MKUDNS_ABORT();
+  int n = sendto(engine->socks[op->sock], op->msg.data(),
+                 static_cast<int>(op->msg.size()), 0,
+                 reinterpret_cast<sockaddr *>(&op->addr), op->addrlen);
+#else
+  ssize_t n = sendto(engine->socks[op->sock], op->msg.data(), op->msg.size(),
+                     0, reinterpret_cast<sockaddr *>(&op->addr), op->addrlen);
+#endif
+  int err = mkudns_last_error();
+  if (n < 0 && mkudns_would_block(err)) {
+    op->blocked = true;
+    engine->blocked.push_back(idx);
+    return;
+  }
+  mkudns_engine_sent(engine, idx, n, err);
+}
+
+// mkudns_engine_unblock sends again the blocked queries of @p engine, until
+// a send would block again.
+static void mkudns_engine_unblock(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  for (size_t count = engine->blocked.size(); count > 0; --count) {
+    size_t idx = engine->blocked.front();
+    engine->blocked.pop_front();
+    mkudns_engine_op *op = engine->ops[idx].get();
+    if (op == nullptr || !op->blocked) continue;  // freed slot
+    op->blocked = false;
+    if (op->done) continue;
+    mkudns_engine_send(engine, idx);
+    if (op->blocked) break;
+  }
+}
+
+// mkudns_engine_start starts the query at index @p idx of @p engine, and
+// returns true, or returns false if we must wait for queries in flight on
+// the same socket to complete before starting it.
+static bool mkudns_engine_start(mkudns_engine *engine, size_t idx) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+  mkudns_response_t *response = op->response.get();
+  if (op->deadline >= 0 && mkudns_now() >= op->deadline) {
+    // The deadline expired while the query was waiting to start.
+    response->recv_event = mkudns_generic_event_new(
+        &op->query, "mkudns.recv", "", "timed_out", -1);
+    response->events.push_back(response->recv_event);
+    mkudns_engine_complete(engine, idx);
+    return true;
+  }
+  if (op->addrlen == 0) {
+    addrinfo hints{};
+    hints.ai_flags |= AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *rp = nullptr;
+    int ret = getaddrinfo(op->query.server_address.c_str(),
+                          op->query.server_port.c_str(), &hints, &rp);
+    MKUDNS_HOOK(getaddrinfo, ret);
+    if (ret != 0) {
+      response->send_event = mkudns_generic_event_new(
+          &op->query, "mkudns.send", "", "invalid_server_endpoint", -1);
+      response->events.push_back(response->send_event);
+      mkudns_engine_complete(engine, idx);
+      return true;
+    }
+    if (rp == nullptr || rp->ai_next != nullptr ||
+        rp->ai_addrlen > sizeof(op->addr)) {
+      MKUDNS_ABORT();
+    }
+    memcpy(&op->addr, rp->ai_addr, rp->ai_addrlen);
+    op->addrlen = static_cast<socklen_t>(rp->ai_addrlen);
+    op->sock = (rp->ai_family == AF_INET6) ? 1 : 0;
+    freeaddrinfo(rp);
+  }
+  if (engine->socks[op->sock] == mkudns_socket_invalid) {
+    response->send_event = mkudns_generic_event_new(
+        &op->query, "mkudns.send", "",
+        mkudns_error_string(engine->sock_errors[op->sock]), -1);
+    response->events.push_back(response->send_event);
+    mkudns_engine_complete(engine, idx);
+    return true;
+  }
+  if (engine->inflight_count[op->sock] >= mkudns_engine_max_inflight) {
+    return false;
+  }
+  op->started = true;
+  if (op->server != nullptr) op->server->inflight += 1;
+  op->query.id = mkudns_engine_id(engine, op->sock);
+  if (!mkudns_create_query(&op->query, &op->msg)) {
+    mkudns_engine_complete(engine, idx);
+    return true;
+  }
+  engine->inflight[mkudns_engine_key(op->sock, op->query.id)] = idx;
+  engine->inflight_count[op->sock] += 1;
+  op->inflight = true;
+  response->sent_at = mkudns_now();
+  int64_t deadline = (op->query.timeout >= 0)
+                         ? response->sent_at + op->query.timeout : -1;
+  if (op->deadline >= 0 && (deadline < 0 || op->deadline < deadline)) {
+    deadline = op->deadline;
+  }
+  if (deadline >= 0) {
+    op->timer.value = idx;
+    mkudns_wheel_insert(&engine->timers, &op->timer, deadline,
+                        response->sent_at);
+  }
+  mkudns_engine_send(engine, idx);
+  return true;
+}
+
+// mkudns_engine_wait_until makes @p engine try to start queries again at
+// @p when, according to the monotonic clock, or earlier.
+static void mkudns_engine_wait_until(mkudns_engine *engine, int64_t when) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  if (engine->next_start < 0 || when < engine->next_start) {
+    engine->next_start = when;
+  }
+}
+
+// mkudns_engine_server_of returns the server of @p op, which is a query of
+// @p engine, creating it if needed.
+static mkudns_engine_server *mkudns_engine_server_of(
+    mkudns_engine *engine, const mkudns_engine_op *op) {
+  if (engine == nullptr || op == nullptr) MKUDNS_ABORT();
+  std::string key = mkudns_rtts_key(op->query.server_address,
+                                    op->query.server_port);
+  auto it = engine->servers.find(key);
+  if (it == engine->servers.end()) {
+    it = engine->servers.emplace(key, mkudns_engine_server{}).first;
+    mkudns_bucket_reset(&it->second.bucket, engine->server_max_qps);
+    if (engine->server_max_inflight > 0) {
+      it->second.window =
+          std::min(it->second.window, engine->server_max_inflight);
+    }
+  }
+  return &it->second;
+}
+
+// mkudns_engine_server_ready returns whether @p engine can start a query to
+// @p server at @p now. When the server exceeded its rate, we arrange to try
+// again when it has a token, while when it has too many queries in flight,
+// we will try again after receiving responses or expiring queries.
+static bool mkudns_engine_server_ready(
+    mkudns_engine *engine, mkudns_engine_server *server, int64_t now) {
+  if (engine == nullptr || server == nullptr) MKUDNS_ABORT();
+  size_t max = engine->server_max_inflight;
+  if (engine->adaptive) {
+    max = (max > 0) ? std::min(max, server->window) : server->window;
+  }
+  if (max > 0 && server->inflight >= max) return false;
+  if (!mkudns_bucket_ready(&server->bucket, now)) {
+    mkudns_engine_wait_until(
+        engine, mkudns_bucket_when(&server->bucket, now));
+    return false;
+  }
+  return true;
+}
+
+// mkudns_engine_launch starts the query at index @p idx of @p engine like
+// mkudns_engine_start and, if we sent it, takes the tokens it consumed.
+static bool mkudns_engine_launch(mkudns_engine *engine, size_t idx) {
+  if (engine == nullptr || idx >= engine->ops.size()) MKUDNS_ABORT();
+  mkudns_engine_op *op = engine->ops[idx].get();
+  if (!mkudns_engine_start(engine, idx)) return false;
+  if (op->started) {
+    mkudns_bucket_take(&engine->bucket);
+    if (op->server != nullptr) mkudns_bucket_take(&op->server->bucket);
+  }
+  return true;
+}
+
+// mkudns_engine_start_some starts up to mkudns_engine_max_starts waiting
+// queries of @p engine, within the engine limits, and returns whether there
+// may be more queries that we could start immediately. We start the queries
+// that wait for their server first, since they are older, one per server at
+// a time, so that the servers share the engine rate fairly.
+static bool mkudns_engine_start_some(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  engine->next_start = -1;
+  bool per_server = engine->adaptive || engine->server_max_qps > 0 ||
+                    engine->server_max_inflight > 0;
+  int64_t now = (per_server || engine->bucket.rate > 0) ? mkudns_now() : 0;
+  size_t budget = mkudns_engine_max_starts;
+  for (bool progress = true; progress && budget > 0;) {
+    progress = false;
+    for (size_t i = 0; i < engine->queued_servers.size() && budget > 0;) {
+      mkudns_engine_server *server = engine->queued_servers[i];
+      while (!server->waiting.empty()) {
+        mkudns_engine_op *op = engine->ops[server->waiting.front()].get();
+        if (op != nullptr && !op->done && op->queued && op->server == server) {
+          break;
+        }
+        server->waiting.pop_front();  // complete, freed, or reused slot
+      }
+      if (server->waiting.empty()) {
+        server->queued = false;
+        engine->queued_servers[i] = engine->queued_servers.back();
+        engine->queued_servers.pop_back();
+        continue;
+      }
+      ++i;
+      if (!mkudns_engine_server_ready(engine, server, now)) continue;
+      if (!mkudns_bucket_ready(&engine->bucket, now)) {
+        mkudns_engine_wait_until(
+            engine, mkudns_bucket_when(&engine->bucket, now));
+        return false;
+      }
+      size_t idx = server->waiting.front();
+      if (!mkudns_engine_launch(engine, idx)) return false;
+      engine->ops[idx]->queued = false;
+      server->waiting.pop_front();
+      --budget;
+      progress = true;
+    }
+  }
+  for (; budget > 0 && !engine->waiting.empty(); --budget) {
+    size_t idx = engine->waiting.front();
+    mkudns_engine_op *op = engine->ops[idx].get();
+    if (op == nullptr || op->done || op->started || op->queued) {
+      engine->waiting.pop_front();
+      continue;
+    }
+    if (per_server) {
+      if (op->server == nullptr) {
+        op->server = mkudns_engine_server_of(engine, op);
+      }
+      mkudns_engine_server *server = op->server;
+      if (!server->waiting.empty() ||
+          !mkudns_engine_server_ready(engine, server, now)) {
+        op->queued = true;
+        server->waiting.push_back(idx);
+        if (!server->queued) {
+          server->queued = true;
+          engine->queued_servers.push_back(server);
+        }
+        engine->waiting.pop_front();
+        continue;
+      }
+    }
+    if (!mkudns_bucket_ready(&engine->bucket, now)) {
+      mkudns_engine_wait_until(
+          engine, mkudns_bucket_when(&engine->bucket, now));
+      return false;
+    }
+    if (!mkudns_engine_launch(engine, idx)) return false;
+    engine->waiting.pop_front();
+  }
+  return budget <= 0;
+}
+
+// mkudns_engine_drain receives the datagrams queued on the socket at index
+// @p sock of @p engine, without using io_uring.
+static void mkudns_engine_drain(mkudns_engine *engine, size_t sock) {
+  if (engine == nullptr || sock >= engine->socks.size()) MKUDNS_ABORT();
+  for (size_t i = 0; i < mkudns_engine_max_batch; ++i) {
+    sockaddr_storage from{};
+    int64_t recv_ttl = -1;
+    bool msg_trunc = false;
+    int64_t n = mkudns_recvmsg(
+        engine->socks[sock], engine->buffer.data(), engine->buffer.size(),
+        &recv_ttl, &msg_trunc, &from);
+    if (n < 0) break;  // would block, or an error we cannot attribute
+    mkudns_engine_recv(engine, sock, engine->buffer.data(), n, from,
+                       recv_ttl, msg_trunc);
+  }
+}
+
+// mkudns_engine_drain_wakeup reads the datagrams queued on the wakeup
+// socket of @p engine, which only serve to wake up the engine thread.
+static void mkudns_engine_drain_wakeup(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  char ch = 0;
+  while (recv(engine->wakeup, &ch, sizeof(ch), 0) >= 0) continue;
+}
+
+#ifdef MKUDNS_HAVE_IO_URING
+// mkudns_engine_uring_recv processes the completion @p cqe of the receive
+// on the socket at index @p sock of @p engine.
+static void mkudns_engine_uring_recv(
+    mkudns_engine *engine, size_t sock, const io_uring_cqe &cqe) {
+  if (engine == nullptr || sock >= engine->socks.size()) MKUDNS_ABORT();
+  mkudns_uring *uring = engine->uring.get();
+  if ((cqe.flags & IORING_CQE_F_MORE) == 0) uring->recv_armed[sock] = false;
+  if (cqe.res < 0 || (cqe.flags & IORING_CQE_F_BUFFER) == 0) return;
+  uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+  if (bid >= mkudns_uring_buffers) MKUDNS_ABORT();
+  char *base = uring->buffers.data() + size_t{bid} * mkudns_uring_slot;
+  io_uring_recvmsg_out out{};
+  memcpy(&out, base, sizeof(out));
+  const msghdr &hdr = uring->recv_hdr[sock];
+  size_t offset = sizeof(out) + hdr.msg_namelen + hdr.msg_controllen;
+  size_t avail = static_cast<size_t>(cqe.res);
+  avail = (avail > offset) ? avail - offset : 0;
+  size_t n = std::min<size_t>(out.payloadlen, avail);
+  sockaddr_storage from{};
+  memcpy(&from, base + sizeof(out),
+         std::min<size_t>(out.namelen, sizeof(from)));
+  msghdr control{};
+  control.msg_control = base + sizeof(out) + hdr.msg_namelen;
+  control.msg_controllen = std::min<size_t>(out.controllen,
+                                            hdr.msg_controllen);
+  int64_t recv_ttl = mkudns_cmsg_ttl(&control);
+  bool msg_trunc = (out.flags & MSG_TRUNC) != 0 || n < out.payloadlen;
+  mkudns_engine_recv(engine, sock, base + offset, static_cast<int64_t>(n),
+                     from, recv_ttl, msg_trunc);
+  mkudns_uring_put_buffer(uring, bid);
+}
+
+// mkudns_engine_uring_wait submits the pending SQEs of @p engine, waits for
+// completions for up to @p timeout milliseconds, and processes them.
+static void mkudns_engine_uring_wait(mkudns_engine *engine, int64_t timeout) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  mkudns_uring *uring = engine->uring.get();
+  (void)mkudns_uring_enter(uring, true, timeout);  // ETIME, EINTR are fine
+  unsigned head = *uring->cq_head;
+  unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+    size_t idx = static_cast<size_t>(cqe.user_data & 0xffffffff);
+    if ((cqe.user_data & ~uint64_t{0xffffffff}) == mkudns_uring_send) {
+      if (idx >= engine->ops.size() || engine->ops[idx] == nullptr) {
+        MKUDNS_ABORT();
+      }
+      mkudns_engine_op *op = engine->ops[idx].get();
+      engine->sending -= 1;
+      op->sending = false;
+      if (op->released) {
+        mkudns_engine_free(engine, idx);
+      } else if (!op->done) {
+        mkudns_engine_sent(engine, idx, (cqe.res < 0) ? -1 : cqe.res,
+                           (cqe.res < 0) ? -cqe.res : 0);
+      }
+    } else if (cqe.user_data == mkudns_uring_wake) {
+      if ((cqe.flags & IORING_CQE_F_MORE) == 0) uring->wake_armed = false;
+      mkudns_engine_drain_wakeup(engine);
+    } else {
+      mkudns_engine_uring_recv(engine, idx, cqe);
+    }
+  }
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < engine->socks.size(); ++i) {
+    if (engine->socks[i] == mkudns_socket_invalid) continue;
+    if (!uring->recv_armed[i]) (void)mkudns_uring_arm_recv(uring, i);
+  }
+  if (engine->wakeup != mkudns_socket_invalid && !uring->wake_armed) {
+    (void)mkudns_uring_arm_wake(uring, engine->wakeup);
+  }
+}
+#endif  // MKUDNS_HAVE_IO_URING
+
+// mkudns_engine_wait waits for up to @p timeout milliseconds (a negative
+// timeout means no timeout) for events on the sockets of @p engine, and
+// processes them.
+static void mkudns_engine_wait(mkudns_engine *engine, int64_t timeout) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  switch (engine->backend) {
+#ifdef MKUDNS_HAVE_IO_URING
+    case mkudns_engine_backend::io_uring:
+      mkudns_engine_uring_wait(engine, timeout);
+      return;
+#endif
+#ifdef __linux__
+    case mkudns_engine_backend::epoll: {
+      std::array<epoll_event, 3> events{};
+      int ret = epoll_wait(
+          engine->epoll_fd, events.data(), static_cast<int>(events.size()),
+          static_cast<int>(std::min<int64_t>(timeout, INT_MAX)));
+      for (int i = 0; i < ret; ++i) {
+        size_t index = events[static_cast<size_t>(i)].data.u32;
+        if (index == mkudns_engine_wakeup_index) {
+          mkudns_engine_drain_wakeup(engine);
+          continue;
+        }
+        mkudns_engine_drain(engine, index);
+      }
+      return;
+    }
+#endif
+    default: break;
+  }
+  std::vector<pollfd> pfds;
+  std::vector<size_t> polled;
+  for (size_t i = 0; i < engine->socks.size(); ++i) {
+    if (engine->socks[i] == mkudns_socket_invalid) continue;
+    pollfd pfd{};
+    pfd.events = POLLIN;
+    pfd.fd = engine->socks[i];
+    pfds.push_back(pfd);
+    polled.push_back(i);
+  }
+  if (engine->wakeup != mkudns_socket_invalid) {
+    pollfd pfd{};
+    pfd.events = POLLIN;
+    pfd.fd = engine->wakeup;
+    pfds.push_back(pfd);
+    polled.push_back(mkudns_engine_wakeup_index);
+  }
+  if (pfds.empty()) return;
+  if (mkudns_poll(pfds.data(), pfds.size(), timeout) <= 0) return;
+  for (size_t i = 0; i < pfds.size(); ++i) {
+    if ((pfds[i].revents & (POLLIN | POLLERR)) == 0) continue;
+    if (polled[i] == mkudns_engine_wakeup_index) {
+      mkudns_engine_drain_wakeup(engine);
+      continue;
+    }
+    mkudns_engine_drain(engine, polled[i]);
+  }
+}
+
+// mkudns_engine_expire completes the queries of @p engine whose deadline
+// has expired.
+static void mkudns_engine_expire(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  int64_t now = mkudns_now();
+  mkudns_wheel_timer *timer = nullptr;
+  while ((timer = mkudns_wheel_pop(&engine->timers, now)) != nullptr) {
+    size_t idx = timer->value;
+    mkudns_engine_op *op = engine->ops[idx].get();
+    op->response->recv_event = mkudns_generic_event_new(
+        &op->query, "mkudns.recv", "", "timed_out", -1);
+    op->response->events.push_back(op->response->recv_event);
+    mkudns_engine_adapt(engine, op, true);
+    mkudns_engine_complete(engine, idx);
+  }
+}
+
+// mkudns_engine_dispatch passes the responses of the complete queries of
+// @p engine that have a callback to their callbacks, and delivers the
+// responses of the complete posted queries.
+static void mkudns_engine_dispatch(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  while (!engine->completed.empty()) {
+    size_t idx = engine->completed.front();
+    engine->completed.pop_front();
+    mkudns_engine_op *op = engine->ops[idx].get();
+    if (op->posted) {
+      uint64_t tag = op->tag;
+      mkudns_response_uptr response = std::move(op->response);
+      mkudns_engine_free(engine, idx);
+      mkudns_engine_deliver(engine->results.get(), tag, std::move(response));
+      continue;
+    }
+    mkudns_engine_callback callback = std::move(op->callback);
+    mkudns_response_uptr response = std::move(op->response);
+    mkudns_engine_free(engine, idx);  // the callback may reuse the slot
+    callback(std::move(response));
+  }
+}
+
+// mkudns_engine_add adds a copy of @p query to the queries of @p engine and
+// returns its index.
+static size_t mkudns_engine_add(
+    mkudns_engine *engine, const mkudns_query_t *query) {
+  if (engine == nullptr || query == nullptr) MKUDNS_ABORT();
+  std::unique_ptr<mkudns_engine_op> op{new mkudns_engine_op{*query}};
+  op->serial = engine->next_serial++;
+  size_t idx = engine->ops.size();
+  if (!engine->free_slots.empty()) {
+    idx = engine->free_slots.back();
+    engine->free_slots.pop_back();
+  } else {
+    engine->ops.emplace_back();
+  }
+  engine->serials[op->serial] = idx;
+  op->queued_at = mkudns_now();
+  engine->ops[idx] = std::move(op);
+  engine->waiting.push_back(idx);
+  engine->pending += 1;
+  return idx;
+}
+
+// mkudns_engine_timeout returns how long @p engine should wait for events,
+// in milliseconds, or a negative value to wait until the next event. @p more
+// indicates whether there are queries that we could start immediately.
+static int64_t mkudns_engine_timeout(mkudns_engine *engine, bool more) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  // Queries canceled or complete before we wait only need dispatching.
+  if (more || !engine->completed.empty()) return 0;
+  int64_t timeout = -1;
+  int64_t next = mkudns_wheel_next(&engine->timers);
+  if (engine->next_start >= 0 && (next < 0 || engine->next_start < next)) {
+    next = engine->next_start;
+  }
+  if (next >= 0) timeout = std::max<int64_t>(next - mkudns_now(), 0);
+  if (!engine->blocked.empty()) {
+    timeout = (timeout >= 0) ? std::min<int64_t>(timeout, 1) : 1;
+  }
+  return timeout;
+}
+
+// mkudns_engine_flush_rtts adds the RTTs observed by @p engine to the
+// global RTTs.
+static void mkudns_engine_flush_rtts(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  for (auto &rtts : engine->rtts) {
+    mkudns_rtts_add_samples(rtts.first, rtts.second);
+  }
+  engine->rtts.clear();
+}
+
+// mkudns_engine_accept adds the queries posted to @p engine to its queries.
+static void mkudns_engine_accept(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  mkudns_engine_request request;
+  while (mkudns_mpsc_pop(&engine->inbox, &request)) {
+    mkudns_engine_op *op =
+        engine->ops[mkudns_engine_add(engine, &request.query)].get();
+    op->posted = true;
+    op->tag = request.tag;
+  }
+}
+
+// mkudns_engine_accept_cancels cancels the queries of @p engine canceled
+// with mkudns_engine_cancel_async.
+static void mkudns_engine_accept_cancels(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  uint64_t serial = 0;
+  while (mkudns_mpsc_pop(&engine->cancels, &serial)) {
+    mkudns_engine_cancel(engine, serial);
+  }
+}
+
+// mkudns_engine_wake wakes up the thread of @p engine, if it sleeps.
+static void mkudns_engine_wake(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  if (engine->wakeup != mkudns_socket_invalid) {
+    char ch = 0;
+    (void)send(engine->wakeup, &ch, sizeof(ch), 0);
+  }
+}
+
+// mkudns_engine_watch creates the wakeup socket of @p engine, unless we
+// already tried, and waits for it along with the engine sockets. On failure,
+// the engine has no wakeup socket. Call this function from the engine
+// thread, or before starting it, and before other threads may wake it.
+static void mkudns_engine_watch(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  if (engine->watched) return;
+  engine->watched = true;
+  engine->wakeup = mkudns_wakeup_new_or_invalid();
+  bool ok = engine->wakeup != mkudns_socket_invalid &&
+            mkudns_set_nonblocking(engine->wakeup);
+#ifdef MKUDNS_HAVE_IO_URING
+  if (ok && engine->backend == mkudns_engine_backend::io_uring) {
+    ok = mkudns_uring_arm_wake(engine->uring.get(), engine->wakeup);
+  }
+#endif
+#ifdef __linux__
+  if (ok && engine->backend == mkudns_engine_backend::epoll) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u32 = static_cast<uint32_t>(mkudns_engine_wakeup_index);
+    ok = epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->wakeup,
+                   &event) == 0;
+  }
+#endif
+  if (!ok && engine->wakeup != mkudns_socket_invalid) {
+    MKUDNS_CLOSESOCKET(engine->wakeup);
+    engine->wakeup = mkudns_socket_invalid;
+  }
+}
+
+// mkudns_engine_serve performs the queries posted to @p engine, until
+// mkudns_engine_delete tells it to stop.
+static void mkudns_engine_serve(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  while (!engine->stopping) {
+    mkudns_engine_accept(engine);
+    mkudns_engine_unblock(engine);
+    int64_t timeout =
+        mkudns_engine_timeout(engine, mkudns_engine_start_some(engine));
+    if (engine->wakeup == mkudns_socket_invalid) {
+      timeout = (timeout >= 0)
+          ? std::min<int64_t>(timeout, mkudns_engine_idle_poll)
+          : mkudns_engine_idle_poll;
+    } else if (timeout != 0) {
+      // Posting threads only wake us when we sleep: since sleeping and the
+      // push are sequentially consistent, either they see that we sleep,
+      // or we see their queries.
+      engine->sleeping = true;
+      if (!mkudns_mpsc_empty(&engine->inbox) || engine->stopping) {
+        timeout = 0;
+      }
+    }
+    mkudns_engine_wait(engine, timeout);
+    engine->sleeping = false;
+    mkudns_engine_expire(engine);
+    mkudns_engine_dispatch(engine);
+    mkudns_engine_flush_rtts(engine);
+  }
+}
+
+// mkudns_engine_serve_start starts the threads serving the queries posted
+// to @p engine. Aborts if @p engine has queries that did not run.
+static void mkudns_engine_serve_start(mkudns_engine *engine) {
+  if (engine == nullptr || !engine->batch.empty() ||
+      !engine->routes.empty() || engine->pending > 0) {
+    MKUDNS_ABORT();
+  }
+  engine->serving = true;
+  if (engine->shards.empty()) {
+    mkudns_engine_watch(engine);
+    engine->thread = std::thread{mkudns_engine_serve, engine};
+    return;
+  }
+  for (auto &shard : engine->shards) {
+    mkudns_engine_watch(shard->engine.get());
+    std::unique_lock<std::mutex> _{shard->mutex};
+    shard->serving = true;
+    shard->cond.notify_all();
+  }
+}
+
+// mkudns_engine_backend_name returns the name of @p backend.
+static const char *mkudns_engine_backend_name(mkudns_engine_backend backend) {
+  switch (backend) {
+    case mkudns_engine_backend::io_uring: return "io_uring";
+    case mkudns_engine_backend::epoll: return "epoll";
+    default: break;
+  }
+  return "poll";
+}
+
+// mkudns_engine_shard_loop is the main loop of the thread of @p shard.
+static void mkudns_engine_shard_loop(mkudns_engine_shard *shard) {
+  if (shard == nullptr) MKUDNS_ABORT();
+  std::unique_lock<std::mutex> lock{shard->mutex};
+  for (;;) {
+    shard->cond.wait(lock, [&]() {
+      return shard->running || shard->serving || shard->stop;
+    });
+    if (shard->stop) return;
+    if (shard->serving) {
+      lock.unlock();
+      mkudns_engine_serve(shard->engine.get());
+      return;
+    }
+    lock.unlock();
+    mkudns_responses_uptr responses{
+        mkudns_engine_run_nonnull(shard->engine.get())};
+    lock.lock();
+    shard->responses = std::move(responses);
+    shard->running = false;
+    shard->cond.notify_all();
+  }
+}
+
+// mkudns_engine_run_shards runs all the shards of @p engine at the same time
+// and returns their responses in submission order.
+static mkudns_responses_t *mkudns_engine_run_shards(mkudns_engine *engine) {
+  if (engine == nullptr || engine->shards.empty()) MKUDNS_ABORT();
+  for (auto &shard : engine->shards) {
+    std::unique_lock<std::mutex> _{shard->mutex};
+    shard->running = true;
+    shard->cond.notify_all();
+  }
+  std::vector<mkudns_responses_uptr> results;
+  for (auto &shard : engine->shards) {
+    std::unique_lock<std::mutex> lock{shard->mutex};
+    shard->cond.wait(lock, [&]() { return !shard->running; });
+    results.push_back(std::move(shard->responses));
+  }
+  mkudns_responses_uptr responses{new mkudns_responses_t};
+  std::vector<size_t> cursors(results.size());
+  for (size_t shard : engine->routes) {
+    responses->responses.push_back(std::move(
+        results[shard]->responses[cursors[shard]++]));
+  }
+  engine->routes.clear();
+  engine->next_shard = 0;
+  return responses.release();
+}
+
+mkudns_engine_t *mkudns_engine_new_nonnull(const char *backend) {
+  if (backend == nullptr) MKUDNS_ABORT();
+  std::string name = backend;
+  if (name != "auto" && name != "io_uring" && name != "epoll" &&
+      name != "poll") {
+    MKUDNS_ABORT();
+  }
+  int ret = RAND_poll();
+  MKUDNS_HOOK(RAND_poll, ret);
+  if (ret != 1) MKUDNS_ABORT();
+  mkudns_engine_uptr engine{new mkudns_engine_t};
+  engine->socks[0] = mkudns_engine_socket(AF_INET, &engine->sock_errors[0]);
+  engine->socks[1] = mkudns_engine_socket(AF_INET6, &engine->sock_errors[1]);
+#ifdef MKUDNS_HAVE_IO_URING
+  if (name == "auto" || name == "io_uring") {
+    engine->uring.reset(new mkudns_uring);
+    if (mkudns_uring_open(engine->uring.get(), engine->socks)) {
+      engine->backend = mkudns_engine_backend::io_uring;
+      return engine.release();
+    }
+    mkudns_uring_close(engine->uring.get());
+    engine->uring.reset();
+  }
+#endif
+#ifdef __linux__
+  if (name != "poll") {
+    engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    MKUDNS_HOOK(epoll_create1, engine->epoll_fd);
+    bool ok = engine->epoll_fd >= 0;
+    for (size_t i = 0; ok && i < engine->socks.size(); ++i) {
+      if (engine->socks[i] == mkudns_socket_invalid) continue;
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.u32 = static_cast<uint32_t>(i);
+      ok = epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->socks[i],
+                     &event) == 0;
+    }
+    if (ok) {
+      engine->backend = mkudns_engine_backend::epoll;
+      return engine.release();
+    }
+    if (engine->epoll_fd >= 0) close(engine->epoll_fd);
+    engine->epoll_fd = -1;
+  }
+#endif
+  return engine.release();
+}
+
+mkudns_engine_t *mkudns_engine_new_sharded_nonnull(
+    const char *backend, size_t shards) {
+  if (backend == nullptr) MKUDNS_ABORT();
+  if (shards <= 0) {
+    shards = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+  mkudns_engine_uptr engine{new mkudns_engine_t};
+  for (size_t i = 0; i < shards; ++i) {
+    std::unique_ptr<mkudns_engine_shard> shard{new mkudns_engine_shard};
+    shard->engine.reset(mkudns_engine_new_nonnull(backend));
+    shard->engine->results = engine->results;
+    engine->backend = shard->engine->backend;
+    shard->thread = std::thread{mkudns_engine_shard_loop, shard.get()};
+    engine->shards.push_back(std::move(shard));
+  }
+  return engine.release();
+}
+
+void mkudns_engine_set_workers(mkudns_engine_t *engine, size_t workers) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  if (workers <= 0) {
+    workers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+  engine->pool.reset(mkudns_pool_new_nonnull(workers), mkudns_pool_delete);
+  for (auto &shard : engine->shards) shard->engine->pool = engine->pool;
+}
+
+// mkudns_engine_active_shards returns the number of shards of the sharded
+// @p engine to which we route queries. It is smaller than the number of
+// shards when a limit is, so that each shard gets a nonzero part of it.
+static size_t mkudns_engine_active_shards(const mkudns_engine *engine) {
+  if (engine == nullptr || engine->shards.empty()) MKUDNS_ABORT();
+  size_t active = engine->shards.size();
+  if (engine->bucket.rate > 0) {
+    active = std::min(active, static_cast<size_t>(engine->bucket.rate));
+  }
+  if (engine->server_max_qps > 0) {
+    active = std::min(active, static_cast<size_t>(engine->server_max_qps));
+  }
+  if (engine->server_max_inflight > 0) {
+    active = std::min(active, engine->server_max_inflight);
+  }
+  return active;
+}
+
+// mkudns_engine_share returns the part of the @p limit of a sharded engine
+// that applies to the shard at index @p shard, when we route queries to
+// @p active shards. The parts of the active shards add up to @p limit.
+template <typename Type>
+static Type mkudns_engine_share(Type limit, size_t active, size_t shard) {
+  if (limit <= 0 || active == 0) return limit;
+  Type count = static_cast<Type>(active);
+  Type index = static_cast<Type>(shard % active);
+  return limit / count + ((index < limit % count) ? Type{1} : Type{0});
+}
+
+// mkudns_engine_spread divides the limits of the sharded @p engine among
+// its shards. Since the limits determine the active shards, we divide all
+// of them whenever one changes.
+static void mkudns_engine_spread(mkudns_engine *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  if (engine->shards.empty()) return;
+  size_t active = mkudns_engine_active_shards(engine);
+  for (size_t idx = 0; idx < engine->shards.size(); ++idx) {
+    mkudns_engine *shard = engine->shards[idx]->engine.get();
+    mkudns_engine_set_max_qps(
+        shard, mkudns_engine_share(engine->bucket.rate, active, idx));
+    mkudns_engine_set_server_max_qps(
+        shard, mkudns_engine_share(engine->server_max_qps, active, idx));
+    mkudns_engine_set_server_max_inflight(
+        shard, mkudns_engine_share(engine->server_max_inflight, active, idx));
+  }
+}
+
+void mkudns_engine_set_max_qps(mkudns_engine_t *engine, int64_t qps) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  mkudns_bucket_reset(&engine->bucket, qps);
+  mkudns_engine_spread(engine);
+}
+
+void mkudns_engine_set_server_max_qps(mkudns_engine_t *engine, int64_t qps) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  engine->server_max_qps = std::max<int64_t>(qps, 0);
+  for (auto &server : engine->servers) {
+    mkudns_bucket_reset(&server.second.bucket, engine->server_max_qps);
+  }
+  mkudns_engine_spread(engine);
+}
+
+void mkudns_engine_set_server_max_inflight(
+    mkudns_engine_t *engine, size_t max) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  engine->server_max_inflight = max;
+  mkudns_engine_spread(engine);
+}
+
+void mkudns_engine_set_adaptive_inflight(mkudns_engine_t *engine) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  engine->adaptive = true;
+  for (auto &shard : engine->shards) {
+    mkudns_engine_set_adaptive_inflight(shard->engine.get());
+  }
+}
+
+size_t mkudns_engine_get_shards(const mkudns_engine_t *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  return engine->shards.size();
+}
+
+const char *mkudns_engine_get_backend(const mkudns_engine_t *engine) {
+  if (engine == nullptr) MKUDNS_ABORT();
+  return mkudns_engine_backend_name(engine->backend);
+}
+
+void mkudns_engine_submit(mkudns_engine_t *engine,
+                          const mkudns_query_t *query) {
+  if (engine == nullptr || query == nullptr || engine->serving) {
+    MKUDNS_ABORT();
+  }
+  if (!engine->shards.empty()) {
+    // The shards are idle between runs, so we can add to their queues.
+    size_t shard = engine->next_shard++ % mkudns_engine_active_shards(engine);
+    mkudns_engine_submit(engine->shards[shard]->engine.get(), query);
+    engine->routes.push_back(shard);
+    return;
+  }
+  engine->batch.push_back(mkudns_engine_add(engine, query));
+}
+
+uint64_t mkudns_engine_submit_callback(
+    mkudns_engine_t *engine, const mkudns_query_t *query,
+    std::chrono::steady_clock::time_point deadline,
+    mkudns_engine_callback callback) {
+  if (engine == nullptr || query == nullptr || !callback ||
+      !engine->shards.empty() || engine->serving) {
+    MKUDNS_ABORT();
+  }
+  // So that mkudns_engine_cancel_async can wake us up.
+  mkudns_engine_watch(engine);
+  mkudns_engine_op *op = engine->ops[mkudns_engine_add(engine, query)].get();
+  op->callback = std::move(callback);
+  if (deadline != std::chrono::steady_clock::time_point::max()) {
+    op->deadline = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline.time_since_epoch()).count();
+    op->deadline = std::max<int64_t>(op->deadline, 0);
+  }
+  return op->serial;
+}
+
+void mkudns_engine_cancel(mkudns_engine_t *engine, uint64_t serial) {
+  if (engine == nullptr || !engine->shards.empty()) MKUDNS_ABORT();
+  auto it = engine->serials.find(serial);
+  if (it == engine->serials.end()) return;
+  mkudns_engine_op *op = engine->ops[it->second].get();
+  if (op->done) return;
+  op->response->events.push_back(mkudns_generic_event_new(
+      &op->query, "mkudns.cancel", "", "operation_canceled", -1));
+  mkudns_engine_complete(engine, it->second);
+}
+
+void mkudns_engine_cancel_async(mkudns_engine_t *engine, uint64_t serial) {
+  if (engine == nullptr || !engine->shards.empty()) MKUDNS_ABORT();
+  std::unique_ptr<mkudns_mpsc_node<uint64_t>> node{
+      new mkudns_mpsc_node<uint64_t>};
+  node->value = serial;
+  mkudns_mpsc_push(&engine->cancels, node.release());
+  if (engine->sleeping) mkudns_engine_wake(engine);
+}
+
+mkudns_responses_t *mkudns_engine_run_nonnull(mkudns_engine_t *engine) {
+  if (engine == nullptr || engine->serving) MKUDNS_ABORT();
+  if (!engine->shards.empty()) return mkudns_engine_run_shards(engine);
+  while (engine->pending > 0 || engine->sending > 0 ||
+         !engine->completed.empty()) {
+    mkudns_engine_accept_cancels(engine);
+    mkudns_engine_unblock(engine);
+    int64_t timeout =
+        mkudns_engine_timeout(engine, mkudns_engine_start_some(engine));
+    if (engine->watched && engine->wakeup == mkudns_socket_invalid) {
+      timeout = (timeout >= 0)
+          ? std::min<int64_t>(timeout, mkudns_engine_idle_poll)
+          : mkudns_engine_idle_poll;
+    } else if (engine->watched && timeout != 0) {
+      // Like in mkudns_engine_serve, but for the canceling threads.
+      engine->sleeping = true;
+      if (!mkudns_mpsc_empty(&engine->cancels)) timeout = 0;
+    }
+    mkudns_engine_wait(engine, timeout);
+    engine->sleeping = false;
+    mkudns_engine_expire(engine);
+    mkudns_engine_dispatch(engine);
+  }
+  {
+    std::unique_lock<std::mutex> lock{engine->processed_mutex};
+    engine->processed_cond.wait(
+        lock, [&]() { return engine->processing <= 0; });
+  }
+  mkudns_responses_uptr responses{new mkudns_responses_t};
+  for (size_t idx : engine->batch) {
+    mkudns_engine_op *op = engine->ops[idx].get();
+    if (op->pooled && op->response->good) {
+      engine->rtts[mkudns_rtts_key(op->query.server_address,
+                                   op->query.server_port)]
+          .push_back(op->response->rtt);
+    }
+    responses->responses.push_back(std::move(op->response));
+    mkudns_engine_free(engine, idx);
+  }
+  engine->batch.clear();
+  mkudns_engine_flush_rtts(engine);
+  return responses.release();
+}
+
+void mkudns_engine_post(mkudns_engine_t *engine, const mkudns_query_t *query,
+                        uint64_t tag) {
+  if (engine == nullptr || query == nullptr) MKUDNS_ABORT();
+  std::call_once(engine->serve_once, mkudns_engine_serve_start, engine);
+  mkudns_engine *target = engine;
+  if (!engine->shards.empty()) {
+    size_t shard = engine->next_post++ % mkudns_engine_active_shards(engine);
+    target = engine->shards[shard]->engine.get();
+  }
+  std::unique_ptr<mkudns_mpsc_node<mkudns_engine_request>> node{
+      new mkudns_mpsc_node<mkudns_engine_request>};
+  node->value.query = *query;
+  node->value.tag = tag;
+  engine->results->outstanding += 1;
+  mkudns_mpsc_push(&target->inbox, node.release());
+  if (target->sleeping) mkudns_engine_wake(target);
+}
+
+size_t mkudns_engine_reap(mkudns_engine_t *engine, mkudns_completion_t *out,
+                          size_t max) {
+  if (engine == nullptr || (out == nullptr && max > 0)) MKUDNS_ABORT();
+  mkudns_engine_results *results = engine->results.get();
+  size_t count = 0;
+  for (;;) {
+    mkudns_engine_result result;
+    while (count < max && mkudns_mpsc_pop(&results->queue, &result)) {
+      out[count].response = result.response.release();
+      out[count].tag = result.tag;
+      results->outstanding -= 1;
+      ++count;
+    }
+    if (count > 0 || max <= 0 || results->outstanding <= 0) return count;
+    std::unique_lock<std::mutex> lock{results->mutex};
+    results->waiting = true;
+    results->cond.wait(
+        lock, [&]() { return !mkudns_mpsc_empty(&results->queue); });
+    results->waiting = false;
+  }
+}
+
+void mkudns_engine_delete(mkudns_engine_t *engine) {
+  if (engine != nullptr) {
+    for (auto &shard : engine->shards) {
+      {
+        std::unique_lock<std::mutex> _{shard->mutex};
+        shard->stop = true;
+        shard->cond.notify_all();
+      }
+      shard->engine->stopping = true;
+      mkudns_engine_wake(shard->engine.get());
+      shard->thread.join();
+    }
+    if (engine->thread.joinable()) {
+      engine->stopping = true;
+      mkudns_engine_wake(engine);
+      engine->thread.join();
+    }
+    {
+      std::unique_lock<std::mutex> lock{engine->processed_mutex};
+      engine->processed_cond.wait(
+          lock, [&]() { return engine->processing <= 0; });
+    }
+    if (engine->wakeup != mkudns_socket_invalid) {
+      MKUDNS_CLOSESOCKET(engine->wakeup);
+    }
+#ifdef MKUDNS_HAVE_IO_URING
+    if (engine->uring != nullptr) mkudns_uring_close(engine->uring.get());
+#endif
+#ifdef __linux__
+    if (engine->epoll_fd >= 0) close(engine->epoll_fd);
+#endif
+    for (auto sock : engine->socks) {
+      if (sock != mkudns_socket_invalid) MKUDNS_CLOSESOCKET(sock);
+    }
+    delete engine;
+  }
 }
 
 #endif  // MKUDNS_INLINE_IMPL